@@ -0,0 +1,1535 @@
+// bench.c - expression parser benchmarks
+//
+// "make bench" builds and runs this. Each result is one CSV line:
+//
+//   case,mode,threads,evals,ns_per_eval,evals_per_sec,allocs_per_eval
+//
+// where mode is how the expression was run: "parse" (Evaluate() with its
+// cache off), "evaluate" (Evaluate()), "compile" (Compile() then
+// FreeCompiled()), "compiled" (EvaluateCompiled() with native code off),
+// "native" (EvaluateCompiled() with native code, if this build has it) or
+// "batch" (EvaluateBatch(), counting each row as an evaluation). With more
+// than one thread, the figures are for all the threads together. Only the
+// evaluations are timed, not setting up the symbols or compiling.
+// Allocations are counted by wrapping malloc() and friends (see the
+// Makefile), so they include any made by the C library. Evaluating compiled
+// expressions ("compiled", "native" and "batch") should make none at all: if
+// it does, that's reported on stderr, and the exit status is 1.
+//
+// Usage: parser_bench [seconds per result (default 0.2)] [case name]
+//        parser_bench fuzz [cases (default 200)] [seed (default 1)]
+//                          [seconds per result (default 0.002)]
+//        parser_bench check
+//
+// The second checks random expressions agree whichever way they're run (see
+// "fuzzing" below), reporting each way's speed the same as the benchmarks;
+// the third checks particular promises the library makes (see "checks").
+// Either's exit status is 1 if anything failed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "parser.h"
+#include "service.h"
+
+#define MAX_SYMS 1000   /* most symbols any case uses */
+#define BATCH_ROWS 4096 /* rows per EvaluateBatch() call */
+#define MAX_THREADS 8
+
+static double min_secs = 0.2;  // run each result for at least this long
+static int alloc_failures_;    // results that shouldn't have allocated, but did
+
+// allocation counting
+// -------------------
+
+static __thread unsigned long allocs_;  // made by this thread
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    ++allocs_;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    ++allocs_;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+    ++allocs_;
+    return __real_realloc(p, size);
+}
+
+static double Now(void)  // seconds
+{
+#ifdef WIN32
+    LARGE_INTEGER count, freq;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (double)count.QuadPart / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+// cases
+// -----
+
+typedef struct _bench_case {
+    const char *name;
+    char *expr;
+    int num_syms;       // symbols are s0, s1, ...
+    double sym_value;   // value of every symbol
+} BENCH_CASE;
+
+static BENCH_CASE cases_[16];
+static int num_cases_;
+
+static char *Concat(char *buf, size_t *len, const char *s)  // grow as need be
+{
+    size_t n = strlen(s);
+
+    buf = realloc(buf, *len + n + 1);
+    memcpy(buf + *len, s, n + 1);
+    *len += n;
+    return buf;
+}
+
+static void AddCase(const char *name, char *expr, int num_syms, double value)
+{
+    cases_[num_cases_].name = name;
+    cases_[num_cases_].expr = expr;
+    cases_[num_cases_].num_syms = num_syms;
+    cases_[num_cases_].sym_value = value;
+    ++num_cases_;
+}
+
+// s0*1.5 + s1*1.5 + ... (n symbols)
+static char *SymbolSum(int n)
+{
+    char *buf = NULL, term[32];
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        sprintf(term, "%ss%d*1.5", i ? " + " : "", i);
+        buf = Concat(buf, &len, term);
+    }
+    return buf;
+}
+
+static void MakeCases(void)
+{
+    char *buf = NULL, term[64];
+    size_t len = 0;
+    int i;
+
+    // tokenizer: long numeric literals
+    for (i = 0; i < 100; ++i) {
+        sprintf(term, "%s%d.%d847349578e-3", i ? " + " : "", 1234567 + i, i);
+        buf = Concat(buf, &len, term);
+    }
+    AddCase("literals", buf, 0, 0.0);
+
+    // recursion: deeply nested parentheses
+    buf = NULL;
+    len = 0;
+    for (i = 0; i < 100; ++i)
+        buf = Concat(buf, &len, "(s0 + ");
+    buf = Concat(buf, &len, "1");
+    for (i = 0; i < 100; ++i)
+        buf = Concat(buf, &len, ") * 0.5");
+    AddCase("nesting", buf, 1, 2.0);
+
+    AddCase("symbols10", SymbolSum(10), 10, 2.0);
+    AddCase("symbols100", SymbolSum(100), 100, 2.0);
+    AddCase("symbols1000", SymbolSum(1000), 1000, 2.0);
+
+    AddCase("functions", strdup("sqrt(abs(sin(s0)) + cos(s0)) + exp(-s0) * "
+            "log10(s0 + 1) + min(floor(s0), ceil(s0)) + max(int(s0), pow(s0, 3))"
+            " + if(s0 > 1, atan(s0), tanh(s0)) + mod(s0 * 7, 3)"), 1, 2.0);
+
+    AddCase("errors", strdup("s0 * 2 / (s0 - s0)"), 1, 2.0);
+}
+
+static void SetSymbols(PARSER_CONTEXT *ctx, BENCH_CASE *bc)
+{
+    char name[16];
+    int i;
+
+    for (i = 0; i < bc->num_syms; ++i) {
+        sprintf(name, "s%d", i);
+        SaveSymbol_r(ctx, name, bc->sym_value);
+    }
+}
+
+// running
+// -------
+
+enum Mode { PARSE, EVALUATE, COMPILE, COMPILED, NATIVE, BATCH };
+
+static const char *mode_names[] = {
+    "parse", "evaluate", "compile", "compiled", "native", "batch"
+};
+
+typedef struct _bench_run {
+    BENCH_CASE *bc;
+    enum Mode mode;
+    long evals;             // to do (in), evaluations done (out)
+    unsigned long allocs;   // allocations made while timing (out)
+    double start, end;      // when the evaluations started and ended (out)
+    pthread_t thread;
+} BENCH_RUN;
+
+// volatile, so the compiler can't drop the evaluations
+static volatile double sink_;
+
+// do run->evals evaluations (in a context of its own)
+static void *Run(void *arg)
+{
+    BENCH_RUN *run = arg;
+    BENCH_CASE *bc = run->bc;
+    PARSER_CONTEXT *ctx = NewParserContext();
+    COMPILED_EXPR *ce = NULL;
+    const double *columns[MAX_SYMS];
+    double *data = NULL, *out = NULL;
+    unsigned long start_allocs;
+    long i, n = run->evals;
+    double sum = 0.0;
+
+    SetSymbols(ctx, bc);
+    if (run->mode == PARSE)
+        SetEvalCache_r(ctx, 0, 0);
+    if (run->mode == COMPILED || run->mode == NATIVE || run->mode == BATCH) {
+        SetJitThreshold_r(ctx, run->mode == NATIVE ? 1 : 0);
+        ce = Compile_r(ctx, bc->expr);
+        EvaluateCompiled(ce);  // makes native code, if wanted
+    }
+    if (run->mode == BATCH) {
+        data = malloc(BATCH_ROWS * sizeof(double));
+        out = malloc(BATCH_ROWS * sizeof(double));
+        for (i = 0; i < BATCH_ROWS; ++i)
+            data[i] = bc->sym_value;
+        for (i = 0; i < CompiledSymbolCount(ce); ++i)
+            columns[i] = data;
+        n = (n + BATCH_ROWS - 1) / BATCH_ROWS;
+    }
+
+    start_allocs = allocs_;
+    run->start = Now();
+    for (i = 0; i < n; ++i) {
+        switch (run->mode) {
+        case PARSE:
+        case EVALUATE:
+            sum += Evaluate_r(ctx, bc->expr);
+            break;
+        case COMPILE:
+            FreeCompiled(Compile_r(ctx, bc->expr));
+            break;
+        case COMPILED:
+        case NATIVE:
+            sum += EvaluateCompiled(ce);
+            break;
+        case BATCH:
+            EvaluateBatch(ce, columns, BATCH_ROWS, out);
+            sum += out[0];
+            break;
+        }
+    }
+    run->end = Now();
+    run->allocs = allocs_ - start_allocs;
+    run->evals = run->mode == BATCH ? n * BATCH_ROWS : n;
+    sink_ = sum;
+
+    free(data);
+    free(out);
+    FreeCompiled(ce);
+    FreeParserContext(ctx);
+    return NULL;
+}
+
+// time the case in this mode on nthreads threads, and print the result
+static void Bench(BENCH_CASE *bc, enum Mode mode, int nthreads)
+{
+    BENCH_RUN runs[MAX_THREADS];
+    long evals = 1, total;
+    unsigned long allocs;
+    double start, end, secs;
+    int i;
+
+    while (true) {  // double the evaluations until it takes long enough
+        for (i = 0; i < nthreads; ++i) {
+            runs[i].bc = bc;
+            runs[i].mode = mode;
+            runs[i].evals = evals;
+        }
+        if (nthreads == 1)
+            Run(&runs[0]);
+        else {
+            for (i = 0; i < nthreads; ++i)
+                pthread_create(&runs[i].thread, NULL, Run, &runs[i]);
+            for (i = 0; i < nthreads; ++i)
+                pthread_join(runs[i].thread, NULL);
+        }
+        start = runs[0].start;  // from the first start to the last end
+        end = runs[0].end;
+        for (i = 1; i < nthreads; ++i) {
+            if (runs[i].start < start)
+                start = runs[i].start;
+            if (runs[i].end > end)
+                end = runs[i].end;
+        }
+        secs = end - start;
+        if (secs >= min_secs)
+            break;
+        evals = secs > min_secs / 64 ? (long)(evals * min_secs * 1.2 / secs)
+                                     : evals * 2;
+    }
+
+    total = 0;
+    allocs = 0;
+    for (i = 0; i < nthreads; ++i) {
+        total += runs[i].evals;
+        allocs += runs[i].allocs;
+    }
+    printf("%s,%s,%d,%ld,%.2f,%.0f,%.3f\n", bc->name, mode_names[mode],
+           nthreads, total, secs * 1e9 / total, total / secs,
+           (double)allocs / total);
+    fflush(stdout);
+    if (allocs && (mode == COMPILED || mode == NATIVE || mode == BATCH)) {
+        fprintf(stderr, "%s,%s,%d: %lu allocations while evaluating\n",
+                bc->name, mode_names[mode], nthreads, allocs);
+        ++alloc_failures_;
+    }
+}
+
+// checks
+// ------
+//
+// Each returns false (saying why on stderr) if what it checks doesn't hold.
+
+static bool CheckSymbol(PARSER_CONTEXT *ctx, const char *check, char *name,
+                        double want)
+{
+    double v = LookupSymbol_r(ctx, name);
+
+    if (v == want)
+        return true;
+    fprintf(stderr, "%s: %s is %.17g, not %.17g\n", check, name, v, want);
+    return false;
+}
+
+// a program sees symbols changed however they're assigned
+static bool CheckProgramChanges(void)
+{
+    static const char *formulas[] = { "y = x * 2" };
+    static const char *others[] = { "z = y + 1" };  // (another program)
+    PARSER_CONTEXT *ctx = NewParserContext();
+    PARSER_PROGRAM *prog, *other;
+    COMPILED_EXPR *ce;
+    bool ok = true;
+    int i;
+
+    SaveSymbol_r(ctx, "x", 1);
+    prog = CompileProgram_r(ctx, formulas, 1);
+    other = CompileProgram_r(ctx, others, 1);
+    RunProgram(prog);
+    RunProgram(other);
+    for (i = 0; i < 4 && ok; ++i) {  // (compiled by its cache from the second)
+        Evaluate_r(ctx, "x = x + 1");
+        RunProgram(prog);
+        ok = CheckSymbol(ctx, "Evaluate()", "y", 2 * (i + 2));
+    }
+    for (i = 0; i < 2 && ok; ++i) {  // (then native code, if there is any)
+        SetJitThreshold_r(ctx, i ? 1 : 0);
+        ce = Compile_r(ctx, i ? "x = 50" : "x = 40");
+        EvaluateCompiled(ce);
+        FreeCompiled(ce);
+        RunProgram(prog);
+        ok = CheckSymbol(ctx, "EvaluateCompiled()", "y", i ? 100 : 80);
+    }
+    if (ok) {
+        RunProgram(other);
+        ok = CheckSymbol(ctx, "RunProgram()", "z", 101);
+    }
+    FreeProgram(prog);
+    FreeProgram(other);
+    FreeParserContext(ctx);
+    return ok;
+}
+
+// ^ is pow() whichever way it's run (x*x differs for this x)
+static bool CheckPowOperator(void)
+{
+    PARSER_CONTEXT *ctx = NewParserContext();
+    COMPILED_EXPR *ce;
+    volatile double two = 2.0;  // (so the compiler can't make it x*x too)
+    double want, v;
+    bool ok = true;
+    int i;
+
+    SaveSymbol_r(ctx, "x", 0x1.aa66f307f80c1p+60);
+    want = pow(0x1.aa66f307f80c1p+60, two);
+    for (i = 0; i < 3 && ok; ++i) {  // (parsed, then compiled by the cache)
+        v = Evaluate_r(ctx, "x^2");
+        ok = v == want;
+    }
+    SetJitThreshold_r(ctx, 1);
+    ce = Compile_r(ctx, "x^2");
+    if (ok) {
+        v = EvaluateCompiled(ce);
+        ok = v == want;
+    }
+    FreeCompiled(ce);
+    FreeParserContext(ctx);
+    if (!ok)
+        fprintf(stderr, "x^2 is %a, not %a\n", v, want);
+    return ok;
+}
+
+// SaveCompiled()'s checksum (FNV-1a of the words, its own as 0), so
+// tampered blocks are only caught by what LoadCompiled() checks
+static void Reseal(unsigned char *block, size_t size)
+{
+    uint32_t hash = 2166136261u, word;
+    size_t i;
+
+    memset(block + 12, 0, 4);  // (SAVED_HEADER check)
+    for (i = 0; i < size; i += 4) {
+        memcpy(&word, block + i, 4);
+        hash = (hash ^ word) * 16777619u;
+    }
+    memcpy(block + 12, &hash, 4);
+}
+
+// a saved block with any word changed (and the checksum made to match)
+// either doesn't load or runs within its memory (build with
+// -fsanitize=address to be sure of the latter)
+static bool CheckSavedTampered(void)
+{
+    static const char *exprs[] = {
+        "if(a > b, a / b, sqrt(a)) + (a && b || c)",
+        "x = a * 3, y = mod(x, b) - x, pow(y, 3) + max(x, y) ^ c",
+        "sqrt(a*a + b*b) + sqrt(a*a + b*b) / c + !(a < 0)",
+    };
+    static const uint32_t values[] = { 0, 1, 2, 0xffffffffu, 0x7fffffffu };
+    static const char renames[][2][5] = {
+        { "max", "mod" }, { "max", "min" }, { "pow", "mod" }, { "sqrt", "tanh" }
+    };
+    static unsigned char saved[4096], block[4096];
+    static double column[3][8], out[8];
+    const double *columns[3] = { column[0], column[1], column[2] };
+    PARSER_CONTEXT *ctx = NewParserContext();
+    COMPILED_EXPR *ce;
+    size_t size, w;
+    uint32_t word;
+    int e, i, loaded = 0, tried = 0;
+    bool ok = true;
+
+    for (i = 0; i < 8; ++i) {
+        column[0][i] = i - 3;
+        column[1][i] = i % 3;
+        column[2][i] = 0.5 * i;
+    }
+    SaveSymbol_r(ctx, "a", 2);
+    SaveSymbol_r(ctx, "b", 3);
+    SaveSymbol_r(ctx, "c", 4);
+    SetJitThreshold_r(ctx, 1);
+    for (e = 0; e < (int)(sizeof(exprs) / sizeof(exprs[0])) && ok; ++e) {
+        ce = Compile_r(ctx, exprs[e]);
+        size = SaveCompiled(ce, saved, sizeof(saved));
+        FreeCompiled(ce);
+        for (w = 16; w < size && ok; w += 4) {  // (past magic, ..., check)
+            for (i = 0; i < (int)(sizeof(values) / sizeof(values[0])) + 2; ++i) {
+                memcpy(block, saved, size);
+                memcpy(&word, block + w, 4);
+                word = i < 2 ? word + (i ? 1 : -1) : values[i - 2];
+                memcpy(block + w, &word, 4);
+                Reseal(block, size);
+                ++tried;
+                if ((ce = LoadCompiled_r(ctx, block, size, NULL)) == NULL)
+                    continue;
+                ++loaded;
+                EvaluateCompiled(ce);
+                EvaluateCompiled(ce);  // (native code, if it could be made)
+                if (CompiledSymbolCount(ce) <= 3)
+                    EvaluateBatch(ce, columns, 8, out);
+                FreeCompiled(ce);
+            }
+        }
+        // the deepest the stack gets must be more than 1 (36: max_stack)
+        memcpy(block, saved, size);
+        word = 1;
+        memcpy(block + 36, &word, 4);
+        Reseal(block, size);
+        if ((ce = LoadCompiled_r(ctx, block, size, NULL)) != NULL) {
+            fprintf(stderr, "%s: loaded with a stack of 1\n", exprs[e]);
+            FreeCompiled(ce);
+            ok = false;
+        }
+    }
+    // and with a built-in's name changed to another's taking as many
+    // arguments (mod()'s is never called, the compiler checking for a 0
+    // divisor itself), run by the batch kernels too (b's column has zeros)
+    ce = Compile_r(ctx, "max(a, b) / 2 + pow(b, a) + sqrt(a)");
+    size = SaveCompiled(ce, saved, sizeof(saved));
+    FreeCompiled(ce);
+    for (e = 0; e < (int)(sizeof(renames) / sizeof(renames[0])) && ok; ++e) {
+        memcpy(block, saved, size);
+        for (w = 0; w + 4 < size; ++w) {  // (with "max"'s 0, just max)
+            if (!memcmp(block + w, renames[e][0], 4)) {
+                memcpy(block + w, renames[e][1], 4);
+                break;
+            }
+        }
+        Reseal(block, size);
+        if ((ce = LoadCompiled_r(ctx, block, size, NULL)) == NULL)
+            continue;
+        EvaluateCompiled(ce);
+        EvaluateCompiled(ce);
+        EvaluateBatch(ce, columns, 8, out);
+        FreeCompiled(ce);
+    }
+
+    if (ok && loaded == tried) {
+        fprintf(stderr, "every tampered block loaded\n");
+        ok = false;
+    }
+    FreeParserContext(ctx);
+    return ok;
+}
+
+// seeded, rand() in a program gives the same numbers on any threads
+static bool CheckProgramRandom(void)
+{
+    static char text[64][32];
+    const char *formulas[64];
+    char name[8];
+    static double values[3][3 * 64];  // by threads tried, run and formula
+    PARSER_CONTEXT *ctx;
+    PARSER_PROGRAM *prog;
+    int i, t, run;
+
+    for (i = 0; i < 64; ++i) {
+        sprintf(text[i], "v%d = rand(1000000) + x", i);
+        formulas[i] = text[i];
+    }
+    for (t = 0; t < 3; ++t) {  // 1 thread, then 4 twice
+        ctx = NewParserContext();
+        SetRandomSeed_r(ctx, 42);
+        SaveSymbol_r(ctx, "x", 0);
+        prog = CompileProgram_r(ctx, formulas, 64);
+        SetProgramThreads(prog, t ? 4 : 1, 1);
+        for (run = 0; run < 3; ++run) {
+            SaveSymbol_r(ctx, "x", run);
+            RunProgram(prog);
+            for (i = 0; i < 64; ++i) {
+                sprintf(name, "v%d", i);
+                values[t][run * 64 + i] = LookupSymbol_r(ctx, name);
+            }
+        }
+        FreeProgram(prog);
+        FreeParserContext(ctx);
+    }
+    for (i = 0; i < 3 * 64; ++i) {
+        if (values[0][i] != values[1][i] || values[0][i] != values[2][i]) {
+            fprintf(stderr, "run %d: v%d is %.17g, then %.17g and %.17g\n",
+                    i / 64, i % 64, values[0][i], values[1][i], values[2][i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// a syntax error after "a = 5, " leaves a = 5 however deep the rest nests
+// (Evaluate() compiles deep ones instead of parsing them)
+static bool CheckDeepSyntaxError(void)
+{
+    PARSER_CONTEXT *ctx = NewParserContext();
+    char expr[128];
+    bool ok = true;
+    int parens, i;
+
+    SetEvalCache_r(ctx, 0, 0);
+    for (parens = 2; parens <= 40 && ok; parens += 38) {
+        strcpy(expr, "a = 5, b = a + 1, ");
+        for (i = 0; i < parens; ++i)
+            strcat(expr, "(");
+        strcat(expr, "1+");
+        SaveSymbol_r(ctx, "a", 1);
+        SaveSymbol_r(ctx, "b", 1);
+        Evaluate_r(ctx, expr);
+        ok = CheckSymbol(ctx, expr, "a", 5) && CheckSymbol(ctx, expr, "b", 6);
+        if (ok && GetParserErrCode_r(ctx) != PARSER_ERR_END) {
+            fprintf(stderr, "%s: error %d\n", expr, GetParserErrCode_r(ctx));
+            ok = false;
+        }
+    }
+    FreeParserContext(ctx);
+    return ok;
+}
+
+// a program run after random changes gives what working out every formula
+// again (by Evaluate(), in order) does, on one thread or several
+#define RECOMPUTE_INPUTS 8
+#define RECOMPUTE_FORMULAS 40
+
+static bool CheckProgramRecompute(void)
+{
+    static char text[RECOMPUTE_FORMULAS][64];
+    static const char *ops[] = { "+", "-", "*", "/" };
+    const char *formulas[RECOMPUTE_FORMULAS];
+    char name[8], assign[32];
+    PARSER_CONTEXT *ctx, *ref;
+    PARSER_PROGRAM *prog;
+    double got, want;
+    int i, k, t, run;
+
+    srand(29);
+    for (k = 0; k < RECOMPUTE_FORMULAS; ++k) {  // (each reads earlier ones)
+        sprintf(text[k], "v%d = ", k);
+        for (i = 0; i < 3; ++i) {
+            if (i)
+                strcat(text[k], ops[rand() % 4]);
+            if (k && rand() % 2)
+                sprintf(name, "v%d", rand() % k);
+            else
+                sprintf(name, "x%d", rand() % RECOMPUTE_INPUTS);
+            strcat(text[k], name);
+        }
+        formulas[RECOMPUTE_FORMULAS - 1 - k] = text[k];  // (given backwards)
+    }
+
+    for (t = 1; t <= 4; t += 3) {
+        ctx = NewParserContext();
+        ref = NewParserContext();
+        for (i = 0; i < RECOMPUTE_INPUTS; ++i) {
+            sprintf(name, "x%d", i);
+            SaveSymbol_r(ctx, name, i + 1);
+            SaveSymbol_r(ref, name, i + 1);
+        }
+        prog = CompileProgram_r(ctx, formulas, RECOMPUTE_FORMULAS);
+        if (!prog) {
+            fprintf(stderr, "CompileProgram() error %d\n",
+                    GetParserErrCode_r(ctx));
+            FreeParserContext(ctx);
+            FreeParserContext(ref);
+            return false;
+        }
+        SetProgramThreads(prog, t, 2);
+        for (run = 0; run < 50; ++run) {
+            for (i = rand() % 3; i >= 0; --i) {  // change one to three inputs
+                sprintf(name, "x%d", rand() % RECOMPUTE_INPUTS);
+                want = rand() % 5 - 2;  // (0 for divide by zero)
+                if (run % 2)
+                    SaveSymbol_r(ctx, name, want);
+                else {  // (or have an expression assign it)
+                    sprintf(assign, "%s = %g", name, want);
+                    Evaluate_r(ctx, assign);
+                }
+                SaveSymbol_r(ref, name, want);
+            }
+            RunProgram(prog);
+            for (k = 0; k < RECOMPUTE_FORMULAS; ++k) {
+                sprintf(name, "v%d", k);
+                Evaluate_r(ref, text[k]);
+                if (GetParserErrCode_r(ref) != PARSER_OK)
+                    SaveSymbol_r(ref, name, sqrt(-1.0));  // (as RunProgram())
+                got = LookupSymbol_r(ctx, name);
+                want = LookupSymbol_r(ref, name);
+                if (!(got == want || (isnan(got) && isnan(want)))) {
+                    fprintf(stderr, "%d threads, run %d: %s gives %.17g, not "
+                            "%.17g\n", t, run, text[k], got, want);
+                    FreeProgram(prog);
+                    FreeParserContext(ctx);
+                    FreeParserContext(ref);
+                    return false;
+                }
+            }
+        }
+        FreeProgram(prog);
+        FreeParserContext(ctx);
+        FreeParserContext(ref);
+    }
+    return true;
+}
+
+// requests from several threads at once, some by ServiceEvaluate() and some
+// by ServiceEvaluateWait(), get the results (and errors) Evaluate() gives
+// them, rows in error being mixed in with the rest of their batch; the
+// queue turns requests away when it's full; and FreeParserService() still
+// completes the queued ones
+#define SERVICE_THREADS 4
+#define SERVICE_REQUESTS 2000  /* by each thread */
+
+typedef struct _service_check {  // a request
+    int expr;
+    double values[2];   // in the order CompiledSymbolName() gives
+    double want;        // what Evaluate() gives
+    int want_err;
+    double result;      // what the service gave
+    int err;
+    int calls;          // to the callback
+} SERVICE_CHECK;
+
+static const char *service_exprs_[] = {
+    "x / y", "x * 2 + y", "mod(x, y) + sqrt(abs(x))"
+};
+static COMPILED_EXPR *service_ces_[3];
+static PARSER_SERVICE *service_;
+static SERVICE_CHECK service_checks_[SERVICE_THREADS][SERVICE_REQUESTS];
+
+static void ServiceCheckDone(double result, int err, void *data)
+{
+    SERVICE_CHECK *sc = data;
+
+    sc->result = result;
+    sc->err = err;
+    ++sc->calls;
+}
+
+static void *ServiceCheckThread(void *arg)
+{
+    SERVICE_CHECK *sc = arg;
+    int i;
+
+    for (i = 0; i < SERVICE_REQUESTS; ++i, ++sc) {
+        if (i % 4 == 3) {
+            sc->result = ServiceEvaluateWait(service_, service_ces_[sc->expr],
+                                             sc->values, &sc->err);
+            ++sc->calls;
+        } else {
+            while (!ServiceEvaluate(service_, service_ces_[sc->expr],
+                                    sc->values, ServiceCheckDone, sc))
+                sched_yield();  // (queue full)
+        }
+    }
+    return NULL;
+}
+
+static bool CheckService(void)
+{
+    static double values[5][2];
+    pthread_t threads[SERVICE_THREADS];
+    PARSER_CONTEXT *ref = NewParserContext();
+    SERVICE_CHECK *sc;
+    SERVICE_STATS stats;
+    int e, i, t, x, bad = 0;
+
+    SetEvalCache_r(ref, 0, 0);
+    if ((service_ = NewParserService(NewParserContext(), 200, 64, 256))
+            == NULL) {
+        FreeParserContext(ref);
+        return true;  // (this build has no threads)
+    }
+    for (e = 0; e < 3; ++e)
+        service_ces_[e] = ServiceCompile(service_, service_exprs_[e], NULL);
+    srand(17);
+    for (t = 0; t < SERVICE_THREADS; ++t) {
+        for (i = 0; i < SERVICE_REQUESTS; ++i) {
+            sc = &service_checks_[t][i];
+            sc->expr = rand() % 3;
+            SaveSymbol_r(ref, "x", rand() % 9 - 4);
+            SaveSymbol_r(ref, "y", rand() % 10 ? rand() % 9 - 4 : 0);
+            for (e = 0; e < 2; ++e)
+                sc->values[e] = LookupSymbol_r(ref,
+                        (char *)CompiledSymbolName(service_ces_[sc->expr], e));
+            sc->want = Evaluate_r(ref, (char *)service_exprs_[sc->expr]);
+            sc->want_err = GetParserErrCode_r(ref);
+            sc->calls = 0;
+        }
+    }
+    for (t = 0; t < SERVICE_THREADS; ++t)
+        pthread_create(&threads[t], NULL, ServiceCheckThread,
+                       service_checks_[t]);
+    for (t = 0; t < SERVICE_THREADS; ++t)
+        pthread_join(threads[t], NULL);
+    GetServiceStats(service_, &stats);
+    FreeParserService(service_);  // (completes any still queued)
+    FreeParserContext(ref);
+
+    for (t = 0; t < SERVICE_THREADS; ++t) {
+        for (i = 0; i < SERVICE_REQUESTS; ++i) {
+            sc = &service_checks_[t][i];
+            if (sc->calls == 1 && sc->err == sc->want_err &&
+                    (sc->err != PARSER_OK || sc->result == sc->want))
+                continue;
+            if (bad++ < 5)
+                fprintf(stderr, "%s with %g, %g: %d results, %.17g (error "
+                        "%d), not %.17g (error %d)\n",
+                        service_exprs_[sc->expr], sc->values[0],
+                        sc->values[1], sc->calls, sc->result, sc->err,
+                        sc->want, sc->want_err);
+        }
+    }
+    if (stats.batches >= stats.requests && stats.requests) {
+        fprintf(stderr, "%lu requests took %lu batches\n", stats.requests,
+                stats.batches);
+        ++bad;
+    }
+
+    // a queue of 4 that won't run until it's waited a second: the fifth
+    // request is turned away, and freeing finishes the other four at once
+    service_ = NewParserService(NewParserContext(), 1000000, 1000, 4);
+    service_ces_[0] = ServiceCompile(service_, "x / y", NULL);
+    x = strcmp(CompiledSymbolName(service_ces_[0], 0), "x") != 0;
+    for (i = 0; i < 5; ++i) {
+        sc = &service_checks_[0][i];
+        sc->calls = 0;
+        values[i][x] = i;  // (divides by 0 when i is 0 or 1)
+        values[i][!x] = i / 2;
+        e = ServiceEvaluate(service_, service_ces_[0], values[i],
+                            ServiceCheckDone, sc);
+        if (e != (i < 4)) {
+            fprintf(stderr, "request %d %squeued\n", i, e ? "" : "not ");
+            ++bad;
+        }
+    }
+    GetServiceStats(service_, &stats);
+    if (stats.rejected != 1 || stats.requests != 0) {
+        fprintf(stderr, "%lu requests done and %lu turned away, not 0 and "
+                "1\n", stats.requests, stats.rejected);
+        ++bad;
+    }
+    FreeParserService(service_);
+    for (i = 0; i < 5; ++i) {
+        sc = &service_checks_[0][i];
+        e = i < 2 ? PARSER_ERR_DIVIDE_BY_ZERO : PARSER_OK;
+        if (sc->calls != (i < 4) || (i < 4 && (sc->err != e ||
+                (e == PARSER_OK && sc->result != i / (i / 2))))) {
+            fprintf(stderr, "freed service: request %d had %d results, %.17g "
+                    "(error %d)\n", i, sc->calls, sc->result, sc->err);
+            ++bad;
+        }
+    }
+    return bad == 0;
+}
+
+typedef struct _check {
+    const char *name;
+    bool (*check)(void);
+} CHECK;
+
+static const CHECK checks_[] = {
+    { "program_changes", CheckProgramChanges },
+    { "pow_operator", CheckPowOperator },
+    { "saved_tampered", CheckSavedTampered },
+    { "program_random", CheckProgramRandom },
+    { "deep_syntax_error", CheckDeepSyntaxError },
+    { "program_recompute", CheckProgramRecompute },
+    { "service", CheckService },
+};
+
+// parser_bench check; returns the exit status
+static int Check(void)
+{
+    int failed = 0, i;
+
+    for (i = 0; i < (int)(sizeof(checks_) / sizeof(checks_[0])); ++i) {
+        if (!checks_[i].check()) {
+            fprintf(stderr, "%s failed\n", checks_[i].name);
+            ++failed;
+        }
+    }
+    fprintf(stderr, "%d checks, %d failed\n", i, failed);
+    return failed ? 1 : 0;
+}
+
+// fuzzing
+// -------
+//
+// Random expressions from the grammar Evaluate() parses (numbers, symbols
+// s0 to s3, prefix and infix operators, assignments, comma lists and the
+// built-in functions but the clock ones), each run for FUZZ_ROWS rows of
+// random symbol values (small round ones, huge and subnormal ones and random
+// bit patterns) every way the library offers: compiled, loaded, native, by
+// EvaluateBatch() (with each instruction set, and over enough rows for
+// SetBatchThreads() to share them out), with the symbols bound, and as a
+// program (see FuzzProgramPass()), all with SetShortCircuit() off and then
+// on. The results must agree exactly with Evaluate()'s (NaN with any NaN),
+// and the errors too: for EvaluateBatch() that's NaN in the rows in error.
+// rand() is seeded the same for each, so it gives the same numbers. Each
+// way's speed is reported as a benchmark result, "fuzz<n>" being the case's
+// number.
+
+#define FUZZ_SYMS 4     /* symbols are s0 .. s3 */
+#define FUZZ_ROWS 300   /* rows each case is run for (over a batch block) */
+#define FUZZ_THREAD_ROWS (28 * FUZZ_ROWS)  /* (EvaluateBatch() shares 8192
+                                              rows or more among threads) */
+#define FUZZ_THREADS 4  /* for SetBatchThreads() and SetProgramThreads() */
+#define FUZZ_LEN 8192   /* longest expression generated */
+#define FUZZ_DEPTH 5    /* deepest nesting generated */
+#define FUZZ_SEED 12345 /* what rand() is seeded with */
+
+static unsigned long long fuzz_state_;  // generator of the cases
+static char fuzz_expr_[FUZZ_LEN + 1];
+static size_t fuzz_len_;    // (FUZZ_LEN + 1: too long)
+static double fuzz_values_[FUZZ_SYMS][FUZZ_THREAD_ROWS];  // (FUZZ_ROWS of
+                                                          // them, repeated)
+static double fuzz_one_[FUZZ_SYMS];     // bound by BindSymbol()
+static double fuzz_bound_[FUZZ_SYMS][FUZZ_ROWS];  // by BindSymbolColumn()
+static char fuzz_setter_[] = "s0 = t0, s1 = t1, s2 = t2, s3 = t3";
+static double fuzz_secs_ = 0.002;  // run each result for at least this long
+
+static unsigned long long FuzzNext(void)  // SplitMix64
+{
+    unsigned long long z = (fuzz_state_ += 0x9E3779B97F4A7C15ull);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static int FuzzRandom(int n)  // 0 .. n - 1
+{
+    return (int)(FuzzNext() % n);
+}
+
+static void Emit(const char *s)
+{
+    size_t n = strlen(s);
+
+    if (fuzz_len_ + n > FUZZ_LEN) {
+        fuzz_len_ = FUZZ_LEN + 1;
+        return;
+    }
+    memcpy(fuzz_expr_ + fuzz_len_, s, n + 1);
+    fuzz_len_ += n;
+}
+
+#define PICK(list) (list[FuzzRandom(sizeof(list) / sizeof(list[0]))])
+
+static const char *fuzz_numbers[] = {
+    "0", "1", "2", "3", "7", "10", "100", "0.5", ".25", "2.5e-2", "1e3",
+    "1e300", "4294967296"
+};
+static const char *fuzz_ops[] = {
+    "+", "-", "*", "/", "^", "<", ">", "<=", ">=", "==", "!=", "&&", "||"
+};
+static const char *fuzz_assigns[] = { "=", "=", "+=", "-=", "*=", "/=" };
+static const char *fuzz_funs1[] = {
+    "abs", "ceil", "floor", "int", "sqrt", "exp", "log", "log10", "sin",
+    "cos", "tan", "atan", "tanh", "rand", "percent"
+};
+static const char *fuzz_funs2[] = { "min", "max", "mod", "pow" };
+
+static void FuzzExpr(int depth);
+
+static void FuzzSymbol(void)
+{
+    char name[8];
+
+    sprintf(name, "s%d", FuzzRandom(FUZZ_SYMS));
+    Emit(name);
+}
+
+static void FuzzPrimary(int depth)
+{
+    switch (depth <= 0 ? FuzzRandom(2) : FuzzRandom(10)) {
+    case 0:
+        Emit(PICK(fuzz_numbers));
+        break;
+    case 1:
+        FuzzSymbol();
+        break;
+    case 2:
+        Emit("(");
+        FuzzExpr(depth - 1);
+        Emit(")");
+        break;
+    case 3:
+        Emit(FuzzRandom(2) ? "-" : "!");
+        FuzzPrimary(depth - 1);
+        break;
+    case 4:
+    case 5:
+        Emit(PICK(fuzz_funs1));
+        Emit("(");
+        FuzzExpr(depth - 1);
+        Emit(")");
+        break;
+    case 6:
+        Emit(PICK(fuzz_funs2));
+        Emit("(");
+        FuzzExpr(depth - 1);
+        Emit(", ");
+        FuzzExpr(depth - 1);
+        Emit(")");
+        break;
+    case 7:
+        Emit("if(");
+        FuzzExpr(depth - 1);
+        Emit(", ");
+        FuzzExpr(depth - 1);
+        Emit(", ");
+        FuzzExpr(depth - 1);
+        Emit(")");
+        break;
+    case 8:
+        Emit("(");
+        FuzzSymbol();
+        Emit(" ");
+        Emit(PICK(fuzz_assigns));
+        Emit(" ");
+        FuzzExpr(depth - 1);
+        Emit(")");
+        break;
+    case 9:
+        Emit("(");
+        FuzzExpr(depth - 1);
+        Emit(", ");
+        FuzzExpr(depth - 1);
+        Emit(")");
+        break;
+    }
+}
+
+static void FuzzExpr(int depth)  // primaries and infix operators
+{
+    int i, n = FuzzRandom(3);
+
+    FuzzPrimary(depth);
+    for (i = 0; i < n; ++i) {
+        Emit(" ");
+        Emit(PICK(fuzz_ops));
+        Emit(" ");
+        FuzzPrimary(depth);
+    }
+}
+
+static bool FuzzAssigns(void)  // does the case assign a symbol?
+{
+    char op[8];
+    int i;
+
+    for (i = 0; i < (int)(sizeof(fuzz_assigns) / sizeof(fuzz_assigns[0]));
+            ++i) {
+        sprintf(op, " %s ", fuzz_assigns[i]);
+        if (strstr(fuzz_expr_, op))
+            return true;
+    }
+    return false;
+}
+
+static bool FuzzRandoms(void)  // does the case use rand() numbers?
+{
+    return strstr(fuzz_expr_, "rand") || strstr(fuzz_expr_, "percent");
+}
+
+static double FuzzValue(void)
+{
+    static const double values[] = {
+        0.0, -0.0, 1.0, -1.0, 2.0, 3.0, 0.5, -2.5, 100.0, 1e-300, 1e300,
+        1.7976931348623157e308, 2.2250738585072014e-308,  // largest, least
+        4.9406564584124654e-324, -1e-310                  // subnormals
+    };
+    unsigned long long bits;
+    double x;
+
+    switch (FuzzRandom(6)) {
+    case 0:
+    case 1:
+    case 2:
+        return PICK(values);
+    case 3:
+        return (FuzzRandom(2000001) - 1000000) / 1000.0;
+    case 4:  // any magnitude (overflowing to inf, or subnormal)
+        return (FuzzRandom(2000001) - 1000000) / 1000.0
+                * pow(10.0, FuzzRandom(633) - 324);
+    default:  // any bits (NaNs too)
+        bits = FuzzNext();
+        memcpy(&x, &bits, sizeof(x));
+        return x;
+    }
+}
+
+static void FuzzValues(void)  // random symbol values for each row
+{
+    int i, row;
+
+    for (i = 0; i < FUZZ_SYMS; ++i) {
+        for (row = 0; row < FUZZ_ROWS; ++row)
+            fuzz_values_[i][row] = FuzzValue();
+        for (; row < FUZZ_THREAD_ROWS; ++row)
+            fuzz_values_[i][row] = fuzz_values_[i][row - FUZZ_ROWS];
+    }
+}
+
+// ways of running a case
+enum FuzzMode { FUZZ_PARSE, FUZZ_COMPILED, FUZZ_LOADED, FUZZ_NATIVE,
+                FUZZ_BATCH, FUZZ_BATCH_THREADS, FUZZ_BOUND, FUZZ_COLUMN,
+                FUZZ_PROGRAM };
+
+static const char *fuzz_isas[] = { "c", "sse2", "avx2", "avx512", "neon" };
+
+typedef struct _fuzz_run {
+    enum FuzzMode mode;
+    const char *isa;        // FUZZ_BATCH's instruction set
+    int threads;            // FUZZ_BATCH_THREADS' and FUZZ_PROGRAM's
+    bool short_circuit;     // SetShortCircuit() is on
+    PARSER_CONTEXT *ctx;
+    COMPILED_EXPR *ce;      // (not used by FUZZ_PARSE or FUZZ_PROGRAM)
+    COMPILED_EXPR *set;     // FUZZ_PROGRAM's: assigns a row's values
+    int rows;               // in a pass (FUZZ_PROGRAM: 0 if it didn't compile)
+    double out[FUZZ_THREAD_ROWS];
+    double deps[2][FUZZ_ROWS];  // FUZZ_PROGRAM's other formulas, q and p
+    int err[FUZZ_ROWS];     // by row (batches: the first only)
+} FUZZ_RUN;
+
+static void FuzzSetRow(PARSER_CONTEXT *ctx, int row)
+{
+    char name[8];
+    int i;
+
+    for (i = 0; i < FUZZ_SYMS; ++i) {
+        sprintf(name, "s%d", i);
+        SaveSymbol_r(ctx, name, fuzz_values_[i][row]);
+    }
+}
+
+// FUZZ_PROGRAM's pass: the case is formula "r = (<case>)" of a program, with
+// "q = r + s0" reading it, and "p = -(<case>)" beside it if the case assigns
+// nothing (so two formulas may). The rows' values are given in turn by
+// SaveSymbol(), Evaluate() and EvaluateCompiled() assigning them, which
+// RunProgram() has to notice. The program's compiled afresh for each pass,
+// so that every pass starts the same.
+static void FuzzProgramPass(FUZZ_RUN *run)
+{
+    char r[FUZZ_LEN + 8], p[FUZZ_LEN + 8], name[8];
+    const char *formulas[3];
+    PARSER_PROGRAM *prog;
+    int nformulas = FuzzAssigns() ? 2 : 3, i, row;
+
+    sprintf(r, "r = (%s)", fuzz_expr_);
+    sprintf(p, "p = -(%s)", fuzz_expr_);
+    formulas[0] = "q = r + s0";  // (before the one it reads)
+    formulas[1] = r;
+    formulas[2] = p;
+    if ((prog = CompileProgram_r(run->ctx, formulas, nformulas)) == NULL) {
+        run->rows = 0;
+        run->err[0] = GetParserErrCode_r(run->ctx);
+        return;
+    }
+    if (run->threads > 1 && !SetProgramThreads(prog, run->threads, 1))
+        run->threads = 1;  // (this build has none)
+
+    for (row = 0; row < FUZZ_ROWS; ++row) {
+        if (row % 3 == 0)
+            FuzzSetRow(run->ctx, row);
+        else {
+            for (i = 0; i < FUZZ_SYMS; ++i) {
+                sprintf(name, "t%d", i);
+                SaveSymbol_r(run->ctx, name, fuzz_values_[i][row]);
+            }
+            if (row % 3 == 1)
+                Evaluate_r(run->ctx, fuzz_setter_);
+            else
+                EvaluateCompiled(run->set);
+        }
+        run->err[row] = RunProgram(prog) ? GetParserErrCode_r(run->ctx)
+                                         : PARSER_OK;
+        run->out[row] = LookupSymbol_r(run->ctx, "r");
+        run->deps[0][row] = LookupSymbol_r(run->ctx, "q");
+        run->deps[1][row] = nformulas > 2 ? LookupSymbol_r(run->ctx, "p") : 0;
+    }
+    FreeProgram(prog);
+}
+
+static void FuzzPass(FUZZ_RUN *run)  // run every row once
+{
+    const double *columns[FUZZ_SYMS];
+    int i, row;
+
+    SetRandomSeed_r(run->ctx, FUZZ_SEED);
+    switch (run->mode) {
+    case FUZZ_BATCH:
+    case FUZZ_BATCH_THREADS:
+        for (i = 0; i < CompiledSymbolCount(run->ce); ++i)
+            columns[i] = fuzz_values_[atoi(CompiledSymbolName(run->ce, i) + 1)];
+        EvaluateBatch(run->ce, columns, run->rows, run->out);
+        run->err[0] = GetParserErrCode_r(run->ctx);
+        return;
+    case FUZZ_PROGRAM:
+        FuzzProgramPass(run);
+        return;
+    case FUZZ_COLUMN:
+        for (i = 0; i < FUZZ_SYMS; ++i)  // (the case may assign them)
+            memcpy(fuzz_bound_[i], fuzz_values_[i], sizeof(fuzz_bound_[i]));
+        break;
+    default:
+        break;
+    }
+    for (row = 0; row < FUZZ_ROWS; ++row) {
+        if (run->mode == FUZZ_BOUND) {
+            for (i = 0; i < FUZZ_SYMS; ++i)
+                fuzz_one_[i] = fuzz_values_[i][row];
+        } else if (run->mode == FUZZ_COLUMN)
+            SetBoundRow_r(run->ctx, row);
+        else
+            FuzzSetRow(run->ctx, row);
+        run->out[row] = run->mode == FUZZ_PARSE
+                            ? Evaluate_r(run->ctx, fuzz_expr_)
+                            : EvaluateCompiled(run->ce);
+        run->err[row] = GetParserErrCode_r(run->ctx);
+    }
+}
+
+static bool FuzzIsBatch(const FUZZ_RUN *run)
+{
+    return run->mode == FUZZ_BATCH || run->mode == FUZZ_BATCH_THREADS;
+}
+
+static const char *FuzzModeName(const FUZZ_RUN *run, char *name)
+{
+    static const char *names[] = {
+        "parse", "compiled", "loaded", "native", "batch", "batch_threads",
+        "bound", "bound_column", "program"
+    };
+
+    if (run->mode == FUZZ_BATCH)
+        sprintf(name, "batch_%s", run->isa);
+    else
+        strcpy(name, names[run->mode]);
+    if (run->short_circuit)
+        strcat(name, "_sc");
+    return name;
+}
+
+// time passes of the case until they take long enough, and print the result
+static void FuzzTime(FUZZ_RUN *run, int n)
+{
+    char mode[32];
+    unsigned long allocs = allocs_;
+    long evals = 0;
+    double start = Now(), secs;
+
+    do {
+        FuzzPass(run);
+        evals += run->rows;
+    } while ((secs = Now() - start) < fuzz_secs_);
+    allocs = allocs_ - allocs;
+
+    printf("fuzz%d,%s,%d,%ld,%.2f,%.0f,%.3f\n", n, FuzzModeName(run, mode),
+           run->threads, evals, evals ? secs * 1e9 / evals : 0.0,
+           evals / secs, evals ? (double)allocs / evals : 0.0);
+}
+
+static bool SameResult(double a, double b)  // exactly (any NaN for a NaN)
+{
+    return (isnan(a) && isnan(b)) || !memcmp(&a, &b, sizeof(double));
+}
+
+// compare run with ref (FUZZ_PARSE); returns false (saying why) if it differs
+static bool FuzzCheck(const FUZZ_RUN *ref, const FUZZ_RUN *run, int n)
+{
+    char mode[32];
+    int rows = FUZZ_ROWS, row, i;
+    bool same = true;
+    double want;
+
+    FuzzModeName(run, mode);
+    if (run->mode == FUZZ_PROGRAM) {
+        if (run->rows == 0) {
+            fprintf(stderr, "fuzz%d: %s\n  CompileProgram() error %d\n", n,
+                    fuzz_expr_, run->err[0]);
+            return false;
+        }
+        // a formula gets rand() numbers of its own, and one reading a symbol
+        // it assigns isn't run again when just that symbol's changed
+        if (FuzzRandoms() || FuzzAssigns())
+            return true;
+    }
+
+    // a row in error stops where the error is, leaving the rand() numbers
+    // it didn't use to the next, but EvaluateBatch() rows each take their
+    // own: past one the numbers needn't agree
+    if (FuzzRandoms())
+        for (rows = 0; rows < FUZZ_ROWS && ref->err[rows] == PARSER_OK; )
+            ++rows;
+    if (rows < FUZZ_ROWS)
+        ++rows;  // (up to and including that row)
+    for (row = 0; row < rows && same; ++row) {
+        if (FuzzIsBatch(run))
+            same = ref->err[row] != PARSER_OK ? isnan(run->out[row])
+                                    : SameResult(ref->out[row], run->out[row]);
+        else if (run->mode == FUZZ_PROGRAM) {
+            // (a formula whose symbols are as they were isn't run again, so
+            // the error its last run had isn't reported)
+            want = ref->err[row] != PARSER_OK ? sqrt(-1.0) : ref->out[row];
+            same = (run->err[row] == PARSER_OK ||
+                    run->err[row] == ref->err[row]) &&
+                   (ref->err[row] != PARSER_OK ||
+                    run->err[row] == PARSER_OK) &&
+                   SameResult(want, run->out[row]) &&
+                   SameResult(want + fuzz_values_[0][row], run->deps[0][row])
+                   && SameResult(-want, run->deps[1][row]);
+        } else
+            same = ref->err[row] == run->err[row] &&
+                   (ref->err[row] != PARSER_OK ||
+                    SameResult(ref->out[row], run->out[row]));
+    }
+    if (same)
+        return true;
+    --row;
+    fprintf(stderr, "fuzz%d: %s\n  row %d:", n, fuzz_expr_, row);
+    for (i = 0; i < FUZZ_SYMS; ++i)
+        fprintf(stderr, " s%d=%.17g", i, fuzz_values_[i][row]);
+    fprintf(stderr, "\n  parse %.17g (error %d), %s %.17g (error %d)\n",
+            ref->out[row], ref->err[row], mode, run->out[row],
+            FuzzIsBatch(run) ? run->err[0] : run->err[row]);
+    if (run->mode == FUZZ_PROGRAM)
+        fprintf(stderr, "  q %.17g, p %.17g\n", run->deps[0][row],
+                run->deps[1][row]);
+    return false;
+}
+
+// compare run (on threads) with one, the same on one thread; returns false
+// (saying why) if they differ at all
+static bool FuzzAgree(const FUZZ_RUN *one, const FUZZ_RUN *run, int n)
+{
+    char mode[32];
+    int row;
+
+    for (row = 0; row < run->rows; ++row) {
+        if (!SameResult(one->out[row], run->out[row]))
+            break;
+        if (!FuzzIsBatch(run) && (one->err[row] != run->err[row] ||
+                    !SameResult(one->deps[0][row], run->deps[0][row]) ||
+                    !SameResult(one->deps[1][row], run->deps[1][row])))
+            break;
+    }
+    if (row == run->rows && (!FuzzIsBatch(run) || one->err[0] == run->err[0]))
+        return true;
+    if (row == run->rows)
+        row = 0;
+    fprintf(stderr, "fuzz%d: %s\n  row %d: one thread %.17g (error %d), %s "
+            "%.17g (error %d)\n", n, fuzz_expr_, row, one->out[row],
+            one->err[FuzzIsBatch(run) ? 0 : row], FuzzModeName(run, mode),
+            run->out[row], run->err[FuzzIsBatch(run) ? 0 : row]);
+    return false;
+}
+
+// run case n every way with short_circuit (off or on); returns the number of
+// ways that disagreed
+static int FuzzWays(int n, bool native, bool short_circuit)
+{
+    static FUZZ_RUN ref, run, one;
+    static unsigned char saved[1 << 16];
+    PARSER_CONTEXT *ctx;
+    char name[8];
+    int failed = 0, i, code;
+    size_t size;
+
+    ref.mode = FUZZ_PARSE;
+    ref.threads = run.threads = 1;
+    ref.rows = run.rows = FUZZ_ROWS;
+    ref.short_circuit = run.short_circuit = short_circuit;
+    ref.ctx = NewParserContext();
+    SetEvalCache_r(ref.ctx, 0, 0);
+    SetShortCircuit_r(ref.ctx, short_circuit);
+    ctx = run.ctx = NewParserContext();
+    SetShortCircuit_r(ctx, short_circuit);
+    SetJitThreshold_r(ctx, 0);
+    FuzzSetRow(ctx, 0);
+    if ((run.ce = Compile_r(ctx, fuzz_expr_)) == NULL) {
+        code = GetParserErrCode_r(ctx);
+        FuzzSetRow(ref.ctx, 0);
+        Evaluate_r(ref.ctx, fuzz_expr_);
+        // (Evaluate() may report a runtime error before the syntax error)
+        if (GetParserErrCode_r(ref.ctx) == PARSER_OK) {
+            fprintf(stderr, "fuzz%d: %s\n  Compile() error %d, Evaluate() "
+                    "none\n", n, fuzz_expr_, code);
+            failed = 1;
+        }
+        FreeParserContext(ref.ctx);
+        FreeParserContext(ctx);
+        return failed;
+    }
+    FuzzTime(&ref, n);
+
+    run.mode = FUZZ_COMPILED;
+    FuzzTime(&run, n);
+    failed += !FuzzCheck(&ref, &run, n);
+
+    run.mode = FUZZ_BATCH;
+    for (i = 0; i < (int)(sizeof(fuzz_isas) / sizeof(fuzz_isas[0])); ++i) {
+        if (!SetBatchIsa_r(ctx, fuzz_isas[i]))
+            continue;  // (this CPU doesn't have it)
+        run.isa = fuzz_isas[i];
+        FuzzTime(&run, n);
+        failed += !FuzzCheck(&ref, &run, n);
+    }
+
+    // sharing the rows among threads mustn't change any of them
+    run.mode = FUZZ_BATCH_THREADS;
+    run.rows = FUZZ_THREAD_ROWS;
+    FuzzPass(&run);
+    one = run;
+    if (SetBatchThreads_r(ctx, FUZZ_THREADS)) {
+        run.threads = FUZZ_THREADS;
+        FuzzTime(&run, n);
+        failed += !FuzzCheck(&ref, &run, n) || !FuzzAgree(&one, &run, n);
+        SetBatchThreads_r(ctx, 1);
+        run.threads = 1;
+    }
+    run.rows = FUZZ_ROWS;
+
+    size = SaveCompiled(run.ce, saved, sizeof(saved));
+    FreeCompiled(run.ce);
+    if (size <= sizeof(saved) &&
+            (run.ce = LoadCompiled_r(ctx, saved, size, NULL)) != NULL) {
+        run.mode = FUZZ_LOADED;
+        FuzzTime(&run, n);
+        failed += !FuzzCheck(&ref, &run, n);
+        FreeCompiled(run.ce);
+    }
+
+    if (native) {
+        SetJitThreshold_r(ctx, 1);
+        run.ce = Compile_r(ctx, fuzz_expr_);
+        run.mode = FUZZ_NATIVE;
+        FuzzTime(&run, n);
+        failed += !FuzzCheck(&ref, &run, n);
+        FreeCompiled(run.ce);
+    }
+
+    // bound symbols, in a context of their own: bound before compiling (run
+    // natively, if this build can), then columns of them bound after
+    run.ctx = NewParserContext();
+    SetShortCircuit_r(run.ctx, short_circuit);
+    SetJitThreshold_r(run.ctx, native ? 1 : 0);
+    for (i = 0; i < FUZZ_SYMS; ++i) {
+        sprintf(name, "s%d", i);
+        BindSymbol_r(run.ctx, name, &fuzz_one_[i]);
+    }
+    run.ce = Compile_r(run.ctx, fuzz_expr_);
+    run.mode = FUZZ_BOUND;
+    FuzzTime(&run, n);
+    failed += !FuzzCheck(&ref, &run, n);
+    FreeCompiled(run.ce);
+
+    SetJitThreshold_r(run.ctx, 0);
+    run.ce = Compile_r(run.ctx, fuzz_expr_);
+    for (i = 0; i < FUZZ_SYMS; ++i) {
+        sprintf(name, "s%d", i);
+        BindSymbolColumn_r(run.ctx, name, fuzz_bound_[i], sizeof(double));
+    }
+    run.mode = FUZZ_COLUMN;
+    FuzzTime(&run, n);
+    failed += !FuzzCheck(&ref, &run, n);
+    FreeCompiled(run.ce);
+    FreeParserContext(run.ctx);
+
+    // a program, on one thread and then on several
+    run.ctx = ctx;
+    SetJitThreshold_r(ctx, native ? 50 : 0);  // (the setter goes native)
+    run.set = Compile_r(ctx, fuzz_setter_);
+    run.mode = FUZZ_PROGRAM;
+    FuzzTime(&run, n);
+    failed += !FuzzCheck(&ref, &run, n);
+    if (run.rows) {
+        one = run;
+        run.threads = FUZZ_THREADS;
+        FuzzTime(&run, n);
+        failed += !FuzzAgree(&one, &run, n);
+    }
+    FreeCompiled(run.set);
+
+    FreeParserContext(ref.ctx);
+    FreeParserContext(ctx);
+    return failed;
+}
+
+// generate and run case n; returns the number of ways that disagreed
+static int FuzzCase(int n, bool native)
+{
+    do {
+        fuzz_len_ = 0;
+        FuzzExpr(FUZZ_DEPTH);
+    } while (fuzz_len_ > FUZZ_LEN);
+    FuzzValues();
+    return FuzzWays(n, native, false) + FuzzWays(n, native, true);
+}
+
+// parser_bench fuzz [cases (default 200)] [seed (default 1)] [seconds per
+// result (default 0.002)]; returns the exit status
+static int Fuzz(int argc, char *argv[], bool native)
+{
+    int cases = argc > 2 ? atoi(argv[2]) : 200;
+    int failed = 0, n;
+
+    fuzz_state_ = argc > 3 ? strtoull(argv[3], NULL, 0) : 1;
+    if (argc > 4)
+        fuzz_secs_ = atof(argv[4]);
+    printf("case,mode,threads,evals,ns_per_eval,evals_per_sec,allocs_per_eval\n");
+    for (n = 0; n < cases; ++n)
+        failed += FuzzCase(n, native);
+    fprintf(stderr, "%d cases, %d disagreements\n", cases, failed);
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    PARSER_CONTEXT *probe;
+    bool native;
+    int i, m, t;
+
+    probe = NewParserContext();
+    native = SetJitThreshold_r(probe, 1) != 0;  // does this build have it?
+    FreeParserContext(probe);
+    if (argc > 1 && !strcmp(argv[1], "fuzz"))
+        return Fuzz(argc, argv, native);
+    if (argc > 1 && !strcmp(argv[1], "check"))
+        return Check();
+
+    if (argc > 1)
+        min_secs = atof(argv[1]);
+    MakeCases();
+
+    printf("case,mode,threads,evals,ns_per_eval,evals_per_sec,allocs_per_eval\n");
+    for (i = 0; i < num_cases_; ++i) {
+        if (argc > 2 && strcmp(argv[2], cases_[i].name))
+            continue;
+        for (m = PARSE; m <= BATCH; ++m) {
+            if (m == NATIVE && !native)
+                continue;
+            Bench(&cases_[i], m, 1);
+        }
+    }
+
+    // scaling: each thread has its own context
+    for (i = 0; i < num_cases_; ++i) {
+        if (strcmp(cases_[i].name, argc > 2 ? argv[2] : "symbols100"))
+            continue;
+        for (t = 2; t <= MAX_THREADS; t *= 2) {
+            Bench(&cases_[i], PARSE, t);
+            Bench(&cases_[i], native ? NATIVE : COMPILED, t);
+        }
+    }
+
+    for (i = 0; i < num_cases_; ++i)
+        free(cases_[i].expr);
+    return alloc_failures_ ? 1 : 0;
+}
@@ -60,25 +60,39 @@ is currently at:
 #include <sys/timeb.h>
 #include <time.h>
 #include <memory.h>
-#include <setjmp.h>
 #include <stdarg.h>
 #include <math.h>
-#include <ctype.h>
 
 #include "parser.h"
+#include "simd.h"
 
 #define DBG if(0)printf
 
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 #ifndef WIN32
 #include <sys/time.h>
 #endif
 
+#ifdef HAVE_THREADS
+#include <pthread.h>
+#endif
+
+#if defined(HAVE_JIT) && defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+#define JIT_X86_64  // native code for compiled expressions
+#endif
+
 #define STRNCPY(dst, src, len) \
         { strncpy(dst, src, len); if (len >= 0) dst[len] = '\0'; }
 
 #define CheckToken(wanted) { \
-    if (type_ != wanted) { \
-      runtime_error("expected '%c'", (int)wanted); \
+    if (ctx->type_ != wanted) { \
+      runtime_error(ctx, PARSER_ERR_EXPECTED, NULL, (int)wanted); \
     } \
 }
 
@@ -91,22 +105,32 @@ is currently at:
 #define M_E (2.7182818284590452354)
 #endif
 
-typedef struct _fun1_entry {
-    char *name;  // function name string
-    double (*fun)(double p1);
-} const FUN1_ENTRY;
-
-typedef struct _fun2_entry {
+typedef struct _fun_entry {
     char *name;  // function name string
-    double (*fun)(double p1, double p2);
-} const FUN2_ENTRY;
+    int args;    // how many arguments it takes (1, 2 or 3)
+    double (*fun1)(double p1);  // the one of these that it is
+    double (*fun2)(double p1, double p2);
+    double (*fun3)(double p1, double p2, double p3);
+} const FUN_ENTRY;
 
-typedef struct _fun3_entry {
-    char *name;  // function name string
-    double (*fun)(double p1, double p2, double p3);
-} const FUN3_ENTRY;
+#define FUN1_ENTRY(name, fun) { name, 1, fun, NULL, NULL },
+#define FUN2_ENTRY(name, fun) { name, 2, NULL, fun, NULL },
+#define FUN3_ENTRY(name, fun) { name, 3, NULL, NULL, fun },
+#define MAX_BUILTIN_FUNS 32  /* room in fun_table[] (see PARSER_CONTEXT) */
 
-#define FUN_TABLE_ENTRY(fun) { #fun, fun },
+typedef struct _user_fun {  // added by AddFunction_r()
+    char *name;
+    size_t len;
+    unsigned hash;          // HashName(name)
+    int nargs;
+    int flags;              // PARSER_FUN_PURE etc.
+    PARSER_FUN fun;
+    PARSER_BATCH_FUN batch; // or NULL
+    void *data;
+#ifdef HAVE_STATS
+    unsigned long *calls;   // (allocated on its own, so it doesn't move)
+#endif
+} USER_FUN;
 
 #define bool int
 #define true (1)
@@ -146,62 +170,382 @@ enum TokenType {
     ASSIGN_DIV   //  +/
 };
 
-static const char *pWord_;
-static const char *pWordStart_;
-static enum TokenType type_; // last token parsed
-static double value_;
 
-#define MAX_WORD 1024  /* maximum size of a token */
-static char word_[MAX_WORD];
+// character classes for the tokenizer (ASCII, so they don't depend on the
+// locale; anything else is in no class)
+#define C_SPACE 1   /* white space */
+#define C_DIGIT 2   /* 0-9 */
+#define C_ALPHA 4   /* A-Z a-z (may start a name) */
+#define C_NAME  8   /* A-Z a-z 0-9 _ (may continue a name) */
+#define C_NUM  16   /* 0-9 . (may continue a number) */
+
+#define S_ C_SPACE
+#define D_ (C_DIGIT | C_NAME | C_NUM)
+#define A_ (C_ALPHA | C_NAME)
+
+static const unsigned char char_class[256] = {
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  S_, S_, S_, S_, S_, 0,  0,  // 00
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 10
+    S_, 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  C_NUM, 0, // 20 .
+    D_, D_, D_, D_, D_, D_, D_, D_, D_, D_, 0,  0,  0,  0,  0,  0,  // 30 0-9
+    0,  A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, // 40 A-O
+    A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, 0,  0,  0,  0,  C_NAME, // 50 P-Z _
+    0,  A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, // 60 a-o
+    A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, 0,  0,  0,  0,  0   // 70 p-z
+};
+
+#undef S_
+#undef D_
+#undef A_
+
+#define IS(c, class) (char_class[(unsigned char)(c)] & (class))
+
+// bump allocator: memory is carved out of a chain of chunks, and is only
+// given back all at once (by ArenaReset() or ArenaFree())
+typedef struct _arena_chunk {
+    struct _arena_chunk *next;
+    size_t size;            // bytes in data[]
+    size_t used;
+    double data[1];         // (double for alignment)
+} ARENA_CHUNK;
+
+typedef struct _arena {
+    ARENA_CHUNK *first;
+    ARENA_CHUNK *cur;       // chunk being allocated from
+} ARENA;
+
+#define ARENA_CHUNK_SIZE 4096  /* size of first arena chunk */
+
+// symbol bound to the caller's memory: its value is at first + row * stride
+// (see BindSymbolColumn_r())
+typedef struct _binding {
+    int slot;
+    double *first;
+    size_t stride;          // bytes (0: the same value on every row)
+    double seen;            // value when programs last looked (see RunProgram())
+} BINDING;
+
+// values a symbol is declared to have (see SetSymbolRange_r())
+typedef struct _sym_range {
+    double lo, hi;
+    bool stored;            // assigned by the expression Optimize() is doing
+} SYM_RANGE;
+
+typedef struct _cache_entry CACHE_ENTRY;  // (see "Expression cache")
+
+// compiled expressions made by Evaluate(), by expression text
+typedef struct _eval_cache {
+    CACHE_ENTRY **buckets;  // hash table (NULL until first used)
+    unsigned num_buckets;   // power of 2
+    CACHE_ENTRY *newest;    // most recently used first
+    CACHE_ENTRY *oldest;
+    int entries;
+    size_t bytes;
+    bool configured;        // limits set by SetEvalCache_r() (else defaults)
+    int max_entries;        // 0: cache off
+    size_t max_bytes;
+    unsigned generation;    // sym_generation_ when the entries were made
+    unsigned long hits, misses, evictions;
+} EVAL_CACHE;
+
+#ifdef HAVE_THREADS
+// threads that each run a job given by RunPool(), along with the thread
+// giving it (see "Thread pool")
+typedef void (*POOL_JOB)(void *arg, int worker);  // worker 0: the caller
+
+typedef struct _pool_thread {
+    struct _thread_pool *pool;
+    int worker;             // 1, 2, ...
+    pthread_t thread;
+} POOL_THREAD;
+
+typedef struct _thread_pool {
+    POOL_THREAD *threads;   // NULL: not started
+    int num_threads;
+    pthread_mutex_t lock;   // for round, busy and quit
+    pthread_cond_t start;   // round (or quit) changed
+    pthread_cond_t done;    // busy is 0
+    unsigned round;         // jobs given out so far
+    int busy;               // threads still running this job
+    bool quit;
+    POOL_JOB job;
+    void *arg;
+} THREAD_POOL;
+#endif
+
+#ifdef HAVE_STATS
+// profiling counters of a context or compiled expression (see PARSER_STATS);
+// updated atomically, as threads may share them
+typedef struct _stats {
+    unsigned long evals;
+    unsigned long lookups;
+    unsigned long calls;    // (compiled expressions only: contexts count
+                            //  calls by function)
+    unsigned long long eval_ns, token_ns, compile_ns;
+    unsigned long latency[PARSER_LATENCY_BUCKETS];
+    unsigned long errors[PARSER_NUM_ERRS];
+} STATS;
+
+#define STAT_ADD(counter, n) ((void)__sync_fetch_and_add(&(counter), (n)))
+#else
+#define STAT_ADD(counter, n) ((void)0)  /* (not even evaluated) */
+#endif
+
+// all parser state lives here, so separate contexts can be used
+// concurrently from separate threads
+struct _parser_context {
+    const char *pWord_;
+    const char *pWordStart_;
+    enum TokenType type_; // last token parsed (from pWordStart_ to pWord_)
+    double value_;
+
+    enum ParserErrCode err_;  // first error since Evaluate() etc. started
+    int err_char_;          // character the error message refers to
+    char err_text_[256];    // text the error message refers to
+    const char *err_at_;    // token being parsed when the error happened
+    char ParserErrBuf[256]; // message, built by GetParserErr_r()
+
+    char **vars_lhs;        // symbol table (names allocated from sym_arena_)
+    double *vars_rhs;
+    unsigned *vars_hash;    // HashName(vars_lhs[slot])
+    double **vars_ptr;      // bound symbol's value (NULL: it's in vars_rhs)
+    SYM_RANGE *vars_range;  // SetSymbolRange_r() ranges (NULL: none set)
+    int num_vars;
+    int max_vars;
+    unsigned sym_generation_;  // bumped by ResetSymbols_r()
+    BINDING *bindings_;     // symbols bound by BindSymbolColumn_r()
+    int num_bindings_;
+    int max_bindings_;
+    size_t bound_row_;      // set by SetBoundRow_r()
+    unsigned bind_generation_;  // bumped when a symbol is bound or unbound
+                                // (or the clock stops or starts being live)
+    ARENA sym_arena_;
+    int *sym_index_;        // hash index: slot + 1 (or 0 if unused)
+    int sym_index_size_;    // power of 2
+
+    struct _expr_node *nodes_;  // expression tree built by Compile()
+    int num_nodes_;
+    int max_nodes_;
+    struct _parse_frame *frames_;  // Compile()'s parser stack
+    int num_frames_;
+    int max_frames_;
+    int *args_;             // function call arguments parsed so far
+    int num_args_;
+    int max_args_;
+    int pi_slot_, e_slot_;  // symbol slots of the "pi" and "e" built-ins
+
+    USER_FUN *funs_;        // functions added by AddFunction_r()
+    int num_funs_;
+    int max_funs_;
+
+    PARSER_PROGRAM *programs_;  // CompileProgram_r() results, not yet freed
+
+    bool short_circuit_;    // set by SetShortCircuit_r()
+    int skip_;              // > 0: parsing a part short-circuit eval skips
+
+    const BATCH_KERNELS *kernels_;  // EvaluateBatch() kernels (NULL: best)
+#ifdef HAVE_THREADS
+    THREAD_POOL batch_pool_;  // EvaluateBatch() helpers (see SetBatchThreads_r())
+#endif
+    int jit_threshold_;     // runs before native code (0: default, < 0: never)
+    EVAL_CACHE cache_;      // used by Evaluate_r()
+    ARENA scratch_;         // EvaluateBatch() working memory (see WarmScratch())
+    size_t scratch_need_;   // bytes of batch state the largest compiled one needs
+    bool scratch_busy_;     // an EvaluateBatch() is using scratch_
+    unsigned long long rng_seed_;     // rand() etc.'s generator (see simd.h)
+    unsigned long long rng_counter_;  // values of it used so far
+    bool rng_seeded_;       // false: seed from the clock when first used
+    int clock_mode_;        // PARSER_CLOCK_LIVE etc. (see SetClockMode_r())
+    double clock_[2];       // "time" and "timems", unless the clock is live
+    int clock_depth_;       // Evaluate() etc. calls in progress
+#ifdef HAVE_STATS
+    STATS stats_;           // everything done in this context
+    unsigned long fun_calls_[MAX_BUILTIN_FUNS];  // calls of fun_table[i]
+#endif
+};
+
+static PARSER_CONTEXT default_ctx_;  // used by the non-"_r" functions
+
+// context of the evaluation in progress on this thread (for built-in
+// functions that report errors, eg. DoFmod)
+static THREAD_LOCAL PARSER_CONTEXT *cur_ctx_;
+
+static enum TokenType GetToken(PARSER_CONTEXT *ctx, const bool ignoreSign);  
+static double CommaList(PARSER_CONTEXT *ctx, const bool get);
+static double Expression(PARSER_CONTEXT *ctx, const bool get);
+static double Comparison(PARSER_CONTEXT *ctx, const bool get);
+static double AddSubtract(PARSER_CONTEXT *ctx, const bool get);
+static double Term(PARSER_CONTEXT *ctx, const bool get);  // multiply and divide
+static double Primary(PARSER_CONTEXT *ctx, const bool get); // primary (base) tokens
+static COMPILED_EXPR *CachedCompile(PARSER_CONTEXT *ctx, const char *expr);
+static COMPILED_EXPR *CompileExpr(PARSER_CONTEXT *ctx, const char *expr);
+static void FlushCache(EVAL_CACHE *cache);
+static void SymbolChanged(PARSER_CONTEXT *ctx, int slot);
+static size_t BatchStateSize(COMPILED_EXPR *ce);
+static bool WarmScratch(PARSER_CONTEXT *ctx, size_t need);
+#ifdef HAVE_THREADS
+static void StopPool(THREAD_POOL *pool);
+#endif
+
+#ifdef HAVE_STATS
+static unsigned long long StatsClock(void)  // nanoseconds
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// count evals evaluations, done by one call taking ns nanoseconds
+static void CountEvals(STATS *stats, unsigned long evals, unsigned long long ns)
+{
+    int bucket = 0;
+
+    while (bucket < PARSER_LATENCY_BUCKETS - 1 && ns >> (bucket + 1))
+        ++bucket;
+    STAT_ADD(stats->evals, evals);
+    STAT_ADD(stats->eval_ns, ns);
+    STAT_ADD(stats->latency[bucket], 1);
+}
+#endif
 
-static enum TokenType GetToken(const bool ignoreSign);  
-static double CommaList(const bool get);
-static double Expression(const bool get);
-static double Comparison(const bool get);
-static double AddSubtract(const bool get);
-static double Term(const bool get);      // multiply and divide
-static double Primary(const bool get);   // primary (base) tokens
+// error messages, indexed by enum ParserErrCode ("%s" is err_text_, "%c"
+// is err_char_)
+static const char *const err_formats[] = {
+    "",
+    "Out of memory",
+    "Divide by zero",
+    "Divide by zero in mod",
+    "expected '%c'",
+    "Unexpected end of expression",
+    "Bad numeric literal: %s",
+    "Unexpected character '%c'",
+    "Function '%s' not implemented",
+    "Unexpected token: '%s'",
+    "Unexpected text at end of expression: '%s'",
+    "Symbols were reset since compiling",
+    "Symbol '%s' is assigned by more than one formula",
+    "Formulas depend on each other in a loop (through '%s')",
+    "Not a saved compiled expression (or saved by another version)"
+};
 
-static jmp_buf parse_err_jmp_buf;
+char *GetParserErr_r(PARSER_CONTEXT *ctx) // returns "" if no parse error
+{
+    const char *fmt = err_formats[ctx->err_];
+    char *msg = ctx->ParserErrBuf + 7;
+    size_t len = sizeof(ctx->ParserErrBuf) - 7;
 
-static char ParserErrBuf[256];
+    // the message is only made now, so errors are cheap if nobody asks
+    if (ctx->err_ == PARSER_OK) {
+        ctx->ParserErrBuf[0] = '\0';
+        return &ctx->ParserErrBuf[0];
+    }
+    strcpy(ctx->ParserErrBuf, "Error! ");
+    if (ctx->err_ == PARSER_ERR_BAD_CHARACTER && ctx->err_char_ < ' ')
+        snprintf(msg, len, "Unexpected character 0x%02x", ctx->err_char_);
+    else if (strstr(fmt, "%c"))
+        snprintf(msg, len, fmt, ctx->err_char_);
+    else
+        snprintf(msg, len, fmt, ctx->err_text_);
+    return &ctx->ParserErrBuf[0];
+}
 
 char *GetParserErr(void)  // returns empty string if no parse error
 {
-    return &ParserErrBuf[0];
+    return GetParserErr_r(&default_ctx_);
+}
+
+int GetParserErrCode_r(PARSER_CONTEXT *ctx)  // PARSER_OK if no error
+{
+    return ctx->err_;
 }
 
-static void runtime_error(const char *String, ...)
+int GetParserErrCode(void)
 {
-    va_list ArgPtr;
+    return GetParserErrCode_r(&default_ctx_);
+}
 
-    strcpy(ParserErrBuf, "Error! ");
-    va_start(ArgPtr, String);
-    vsnprintf(ParserErrBuf + strlen(ParserErrBuf),
-             sizeof(ParserErrBuf) - strlen(ParserErrBuf) - 1, String, ArgPtr);
-    va_end(ArgPtr);
-    ParserErrBuf[sizeof(ParserErrBuf) - 1] = '\0';  // safety knows no season!
+// Record an error (text and ch are what the message refers to, if anything)
+// and stop parsing: pretending the expression has ended makes every parse
+// function return promptly, so there's nothing to check on the way out.
+// Only the first error counts.
+static void runtime_error(PARSER_CONTEXT *ctx, enum ParserErrCode code,
+                          const char *text, int ch)
+{
+    if (ctx->err_ != PARSER_OK)
+        return;
+    ctx->err_ = code;
+    ctx->err_char_ = ch;
+    ctx->err_at_ = ctx->pWordStart_;
+    if (text)
+        STRNCPY(ctx->err_text_, text, sizeof(ctx->err_text_) - 1)
+    ctx->pWord_ = "";
+    ctx->type_ = END;
 
 #ifdef ENABLE_PARSER_ERR_OUTPUT
     fflush(stdout);
-    fprintf(stderr, "%s\n", ParserErrBuf);
+    fprintf(stderr, "%s\n", GetParserErr_r(ctx));
     fflush(stderr);
 #endif
+}
+
+// runtime_error() about the source text from start up to end (a token, which
+// isn't NUL-terminated)
+static void TokenError(PARSER_CONTEXT *ctx, enum ParserErrCode code,
+                       const char *start, const char *end)
+{
+    size_t len;
 
-    longjmp(parse_err_jmp_buf, 1);
+    if (ctx->err_ != PARSER_OK)
+        return;
+    len = end - start;
+    if (len > sizeof(ctx->err_text_) - 1)
+        len = sizeof(ctx->err_text_) - 1;
+    memcpy(ctx->err_text_, start, len);
+    ctx->err_text_[len] = '\0';
+    runtime_error(ctx, code, NULL, 0);
 }
 
-// returns a number from 0 up to, but excluding x
-const int getrandom(const int x)
+// ctx's generator starts with seed, for reproducible runs
+void SetRandomSeed_r(PARSER_CONTEXT *ctx, unsigned long long seed)
 {
-    double r;
-    if (x <= 0)
-        return 0;
+    ctx->rng_seed_ = seed;
+    ctx->rng_counter_ = 0;
+    ctx->rng_seeded_ = true;
+}
+
+void SetRandomSeed(unsigned long long seed)
+{
+    SetRandomSeed_r(&default_ctx_, seed);
+}
+
+// seed ctx's generator from the clock (and where ctx is, so contexts made
+// at once differ), unless SetRandomSeed_r() did
+static void SeedRandom(PARSER_CONTEXT *ctx)
+{
+    if (!ctx->rng_seeded_)
+        SetRandomSeed_r(ctx, (unsigned long long)time(NULL)
+                                * 0x9E3779B97F4A7C15ull ^ (uintptr_t)ctx);
+}
+
+// next value of the generator of the evaluation in progress (or of the
+// default context), from 0 up to, but excluding 1
+static double NextRandom(void)
+{
+    PARSER_CONTEXT *ctx = cur_ctx_ ? cur_ctx_ : &default_ctx_;
 
-    // r will be between 0 and 1 (but below 1 as we are dividing by RAND_MAX+1)
-    r = ((double) (rand() % RAND_MAX)) / ((double) RAND_MAX + 1.0);
-    return floor(r * x);
+    SeedRandom(ctx);
+    return RandomUnit(ctx->rng_seed_, ctx->rng_counter_++);
+}
 
+// returns a number from 0 up to, but excluding x
+const int getrandom(const int x)
+{
+    return RandomBelow(NextRandom(), x);
 }
 
 const int roll(const int howmany, const int die)
@@ -225,17 +569,8 @@ const bool percent(const int prob)
     if (prob >= 100)
         return true;
 
-    return getrandom(100) > (100 - prob);
-
-}
+    return RandomPercent(NextRandom(), prob) != 0.0;
 
-static int initRandom()
-{
-    srand(time(NULL));
-#ifndef WIN32
-    srand48(time(NULL));
-#endif
-    return 0;
 }
 
 /******************************************************************************
@@ -333,15 +668,12 @@ static double DoInt(double arg)
 
 static double DoRandom(double arg)
 {
-    return getrandom(arg);      // random number in range 0 to arg
+    return RandomBelow(NextRandom(), arg);  // random number in range 0 to arg
 }
 
 static double DoPercent(double arg)
 {
-    if (percent(arg))   // true x% of the time
-         return 1.0;
-    else
-        return 0.0;
+    return RandomPercent(NextRandom(), arg);  // 1 (true) arg% of the time
 }
 
 static double DoMin(const double arg1, const double arg2)
@@ -356,8 +688,10 @@ static double DoMax(const double arg1, const double arg2)
 
 static double DoFmod(const double arg1, const double arg2)
 {
-    if (arg2 == 0.0)
-        runtime_error("Divide by zero in mod");
+    // (no context: EvaluateBatch(), which checks OP_MOD's itself, called it
+    // for a LoadCompiled() block)
+    if (arg2 == 0.0 && cur_ctx_)
+        runtime_error(cur_ctx_, PARSER_ERR_MOD_BY_ZERO, NULL, 0);
 
     return fmod(arg1, arg2);
 }
@@ -393,423 +727,987 @@ static double DoIf(const double arg1, const double arg2, const double arg3)
         return arg3;
 }
 
-FUN1_ENTRY fun1_table[] = {
-    { "abs", fabs },
-    FUN_TABLE_ENTRY(acos)
-    FUN_TABLE_ENTRY(asin)
-    FUN_TABLE_ENTRY(atan)
+// all the built-in functions, sorted by name (in strcmp() order) for
+// LookupFun()
+FUN_ENTRY fun_table[] = {
+    FUN1_ENTRY("DoInt", DoInt)
+    FUN1_ENTRY("abs", fabs)
+    FUN1_ENTRY("acos", acos)
+    FUN1_ENTRY("asin", asin)
+    FUN1_ENTRY("atan", atan)
 #ifndef WIN32
-    FUN_TABLE_ENTRY(atanh) // doesn't seem to exist under Visual C++ 6
-#endif
-    FUN_TABLE_ENTRY(ceil)
-    FUN_TABLE_ENTRY(cos)
-    FUN_TABLE_ENTRY(cosh)
-    FUN_TABLE_ENTRY(exp)
-    FUN_TABLE_ENTRY(exp)
-    FUN_TABLE_ENTRY(floor)
-    FUN_TABLE_ENTRY(log)
-    FUN_TABLE_ENTRY(log10)
-    FUN_TABLE_ENTRY(sin)
-    FUN_TABLE_ENTRY(sinh)
-    FUN_TABLE_ENTRY(sqrt)
-    FUN_TABLE_ENTRY(tan)
-    FUN_TABLE_ENTRY(tanh)
-    FUN_TABLE_ENTRY(DoInt)
-    { "int", DoInt },
-    { "rand", DoRandom },
-    { "percent", DoPercent },
-    { "", NULL }
-};
-
-FUN2_ENTRY fun2_table[] = {
-    { "min", DoMin },
-    { "max", DoMax },
-    { "mod", DoFmod },
-    { "pow", DoPow },
+    FUN1_ENTRY("atanh", atanh) // doesn't seem to exist under Visual C++ 6
+#endif
+    FUN1_ENTRY("ceil", ceil)
+    FUN1_ENTRY("cos", cos)
+    FUN1_ENTRY("cosh", cosh)
+    FUN1_ENTRY("exp", exp)
+    FUN1_ENTRY("floor", floor)
+    FUN3_ENTRY("if", DoIf)
+    FUN1_ENTRY("int", DoInt)
+    FUN1_ENTRY("log", log)
+    FUN1_ENTRY("log10", log10)
+    FUN2_ENTRY("max", DoMax)
+    FUN2_ENTRY("min", DoMin)
+    FUN2_ENTRY("mod", DoFmod)
+    FUN1_ENTRY("percent", DoPercent)
+    FUN2_ENTRY("pow", DoPow)
+    FUN1_ENTRY("rand", DoRandom)
 #ifdef HAVE_ROLL
-    { "roll", DoRoll },
+    FUN2_ENTRY("roll", DoRoll)
 #endif
-    { "", NULL }
+    FUN1_ENTRY("sin", sin)
+    FUN1_ENTRY("sinh", sinh)
+    FUN1_ENTRY("sqrt", sqrt)
+    FUN1_ENTRY("tan", tan)
+    FUN1_ENTRY("tanh", tanh)
 };
 
-FUN3_ENTRY fun3_table[] = {
-    { "if", DoIf },
-    { "", NULL }
-};
+#define NUM_FUNS ((int)(sizeof(fun_table) / sizeof(fun_table[0])))
 
-static FUN1_ENTRY *LookupFun1(char *name)
+// binary search for the function named by the len characters at name
+static FUN_ENTRY *LookupFun(const char *name, int len)
 {
-    int ix;
+    int lo = 0, hi = NUM_FUNS - 1, mid, cmp;
 
-    for (ix = 0; fun1_table[ix].fun; ++ix) {
-        if (!strcmp(name, fun1_table[ix].name)) return &fun1_table[ix];
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        cmp = strncmp(name, fun_table[mid].name, len);
+        if (cmp == 0 && fun_table[mid].name[len] != '\0')
+            cmp = -1;  // name is a prefix of this one, so sorts first
+        if (cmp == 0)
+            return &fun_table[mid];
+        if (cmp < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
     }
     return NULL;
 }
 
-static FUN2_ENTRY *LookupFun2(char *name)
+static void *ArenaAlloc(ARENA *arena, size_t n)  // NULL if out of memory
 {
-    int ix;
+    ARENA_CHUNK *chunk = arena->cur;
+    size_t size;
 
-    for (ix = 0; fun2_table[ix].fun; ++ix) {
-        if (!strcmp(name, fun2_table[ix].name)) return &fun2_table[ix];
+    n = (n + sizeof(double) - 1) & ~(sizeof(double) - 1);  // keep aligned
+    while (chunk && chunk->used + n > chunk->size) {
+        // try the next (already allocated) chunk, if any
+        if ((chunk = chunk->next) != NULL) {
+            chunk->used = 0;
+            arena->cur = chunk;
+        }
     }
-    return NULL;
+    if (!chunk) {  // add a new chunk, doubling in size each time
+        size = arena->cur ? arena->cur->size * 2 : ARENA_CHUNK_SIZE;
+        while (size < n) size *= 2;
+        chunk = malloc(sizeof(ARENA_CHUNK) + size);
+        if (!chunk) return NULL;
+        chunk->next = NULL;
+        chunk->size = size;
+        chunk->used = 0;
+        if (arena->cur)
+            arena->cur->next = chunk;
+        else
+            arena->first = chunk;
+        arena->cur = chunk;
+    }
+    chunk->used += n;
+    return (char *)chunk->data + chunk->used - n;
+}
+
+static void ArenaReset(ARENA *arena)  // release everything (keeps chunks)
+{
+    if ((arena->cur = arena->first) != NULL)
+        arena->cur->used = 0;
 }
 
-static FUN3_ENTRY *LookupFun3(char *name)
+static void ArenaFree(ARENA *arena)
 {
-    int ix;
+    ARENA_CHUNK *chunk, *next;
 
-    for (ix = 0; fun3_table[ix].fun; ++ix) {
-        if (!strcmp(name, fun3_table[ix].name)) return &fun3_table[ix];
+    for (chunk = arena->first; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
     }
-    return NULL;
+    arena->first = arena->cur = NULL;
 }
 
-static char *vars_lhs[MAX_PARSE_SYMBOLS];
-static double vars_rhs[MAX_PARSE_SYMBOLS];
-static int num_vars = 0;
+// The symbol table is a dense array of names and values indexed by "slot",
+// plus an open-addressing hash index (linear probing, kept at most half
+// full) mapping names to slots. Each name is stored once, along with its
+// hash, so a failed probe rarely needs a strcmp(). A bound symbol's value
+// is kept in the caller's memory instead, at vars_ptr[slot].
 
-int SaveSymbol(char *lhs, double rhs) // returns 1:success, 0:malloc() failed
+static unsigned HashName(const char *name, size_t len)  // FNV-1a
 {
-    int i;
+    unsigned hash = 2166136261u;
 
-    DBG("SaveSymbol('%s', %g)...\n", lhs, rhs);
-    for (i = 0; i < num_vars; ++i) {  // aleady in table?
-        if (!strcmp(vars_lhs[i], lhs)) {
-            vars_rhs[i] = rhs;
-            return 1;  // found exit
-        }
+    while (len--)
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    return hash;
+}
+
+// returns slot of symbol (the len characters at name), or -1 if not in table
+static int FindSymbol(PARSER_CONTEXT *ctx, const char *name, size_t len,
+                      unsigned hash)
+{
+    unsigned mask = ctx->sym_index_size_ - 1;
+    unsigned ix;
+    int slot;
+
+    STAT_ADD(ctx->stats_.lookups, 1);
+    if (!ctx->sym_index_size_) return -1;  // empty table
+    for (ix = hash & mask; (slot = ctx->sym_index_[ix] - 1) >= 0;
+                                                    ix = (ix + 1) & mask) {
+        if (ctx->vars_hash[slot] == hash &&
+                                !strncmp(ctx->vars_lhs[slot], name, len) &&
+                                ctx->vars_lhs[slot][len] == '\0')
+            return slot;
     }
-    // symbol not found...add new entry in table
-    vars_lhs[num_vars] = malloc(strlen(lhs) + 1);
-    if (!vars_lhs[num_vars]) return 0;  // error exit (no free memory!)
-    strcpy(vars_lhs[num_vars], lhs);
-    vars_rhs[num_vars] = rhs;
-    ++num_vars;
-    return 0;  // not found
+    return -1;
 }
 
-double LookupSymbol(char *lhs)
+static void IndexSymbol(PARSER_CONTEXT *ctx, int slot)
+{
+    unsigned mask = ctx->sym_index_size_ - 1;
+    unsigned ix;
+
+    for (ix = ctx->vars_hash[slot] & mask; ctx->sym_index_[ix];
+                                                    ix = (ix + 1) & mask)
+        ;
+    ctx->sym_index_[ix] = slot + 1;
+}
+
+static bool GrowSymbolIndex(PARSER_CONTEXT *ctx)  // false if out of memory
 {
+    int n = ctx->sym_index_size_ ? ctx->sym_index_size_ * 2 : 64;
+    int *index;
     int i;
-    double rhs;
 
-    DBG("LookupSymbol('%s')", lhs);
-    if (!strcmp(lhs, "time")) {  // "time" built-in (secs since 1970 epoch)
-        return (double)time(NULL);
-    }
-#if !defined(WIN32) || defined(HAVE_GETTIMEOFDAY)
-    if (!strcmp(lhs, "timems")) {  // "timems" built-in (msecs since 1970 epoch)
-        typedef struct timeval {
-            long tv_sec;
-            long tv_usec;
-        } timeval;
-        struct timeval tv;
+    if ((index = calloc(n, sizeof(int))) == NULL) return false;
+    free(ctx->sym_index_);
+    ctx->sym_index_ = index;
+    ctx->sym_index_size_ = n;
+    for (i = 0; i < ctx->num_vars; ++i)  // rehash existing entries
+        IndexSymbol(ctx, i);
+    return true;
+}
 
-        gettimeofday(&tv, NULL);
-        return ((double)tv.tv_sec * 1000 + (double)tv.tv_usec / 1000); 
-    }
-#endif
-    for (i = 0; i < num_vars; ++i) {
-        if (!strcmp(vars_lhs[i], lhs)) {
-            rhs = vars_rhs[i];  // match
-            DBG("=%g\n", rhs);
-            return rhs;  // return symbol value
-        }
+static bool GrowSymbols(PARSER_CONTEXT *ctx)  // false if out of memory
+{
+    int n = ctx->max_vars ? ctx->max_vars * 2 : 64;
+    void *p;
+
+    if ((p = realloc(ctx->vars_lhs, n * sizeof(char *))) == NULL)
+        return false;
+    ctx->vars_lhs = p;
+    if ((p = realloc(ctx->vars_rhs, n * sizeof(double))) == NULL)
+        return false;
+    ctx->vars_rhs = p;
+    if ((p = realloc(ctx->vars_hash, n * sizeof(unsigned))) == NULL)
+        return false;
+    ctx->vars_hash = p;
+    if ((p = realloc(ctx->vars_ptr, n * sizeof(double *))) == NULL)
+        return false;
+    ctx->vars_ptr = p;
+    if (ctx->vars_range) {
+        if ((p = realloc(ctx->vars_range, n * sizeof(SYM_RANGE))) == NULL)
+            return false;
+        ctx->vars_range = p;
     }
-    rhs = PARSE_ERROR;
-    DBG("=%g\n", rhs);
-    return rhs;  // no match
+    ctx->max_vars = n;
+    return true;
 }
 
-static enum TokenType GetToken(const bool ignoreSign)
+// returns slot of new symbol, or -1 if out of memory
+static int AddSymbol(PARSER_CONTEXT *ctx, const char *name, size_t len,
+                     unsigned hash, double value)
 {
-    unsigned char cFirstCharacter;
-    unsigned char cNextCharacter;
-    char *p;
-
-    DBG("GetToken('%s')...'%s'\n", pWord_, word_);
-    //word_.erase (0, std::string::npos);
-    *word_ = '\0';
-    ////memset(word_, 0, sizeof(word_));
+    int slot = ctx->num_vars;
 
-    // skip spaces
-    while (*pWord_ && isspace(*pWord_)) ++pWord_;
+    if (slot >= ctx->max_vars && !GrowSymbols(ctx))
+        return -1;
+    if (2 * (slot + 1) > ctx->sym_index_size_ && !GrowSymbolIndex(ctx))
+        return -1;
+    ctx->vars_lhs[slot] = ArenaAlloc(&ctx->sym_arena_, len + 1);
+    if (!ctx->vars_lhs[slot]) return -1;  // error exit (no free memory!)
+    memcpy(ctx->vars_lhs[slot], name, len);
+    ctx->vars_lhs[slot][len] = '\0';
+    ctx->vars_hash[slot] = hash;
+    ctx->vars_rhs[slot] = value;
+    ctx->vars_ptr[slot] = NULL;
+    if (ctx->vars_range) {
+        ctx->vars_range[slot].lo = -HUGE_VAL;
+        ctx->vars_range[slot].hi = HUGE_VAL;
+        ctx->vars_range[slot].stored = false;
+    }
+    ++ctx->num_vars;
+    IndexSymbol(ctx, slot);
+    return slot;
+}
 
-    pWordStart_ = pWord_;       // remember where word_ starts *now*
+static double *SymbolValue(PARSER_CONTEXT *ctx, int slot)  // where it's kept
+{
+    return ctx->vars_ptr[slot] ? ctx->vars_ptr[slot] : &ctx->vars_rhs[slot];
+}
 
-    // look out for unterminated statements and things
-    if (*pWord_ == 0 &&         // we have EOF
-        type_ == END)           // after already detecting it
-        runtime_error("Unexpected end of expression");
+// save the len characters at lhs as a symbol
+static int SaveSymbolN(PARSER_CONTEXT *ctx, const char *lhs, size_t len,
+                       double rhs)
+{
+    unsigned hash = HashName(lhs, len);
+    int slot;
 
-    cFirstCharacter = *pWord_;  // first character in new word_
-    DBG("cFirstCharacter='%c'\n", cFirstCharacter);
+    DBG("SaveSymbol('%.*s', %g)...\n", (int)len, lhs, rhs);
+    if ((slot = FindSymbol(ctx, lhs, len, hash)) >= 0) {  // aleady in table?
+        double *value = SymbolValue(ctx, slot);
+        bool changed = ctx->programs_ && memcmp(value, &rhs, sizeof(rhs));
 
-    if (cFirstCharacter == 0)   // stop at end of file
-    {
-        strcpy(word_, "<end of expression>");
-        DBG("return END\n");
-        return type_ = END;
+        *value = rhs;
+        if (changed)
+            SymbolChanged(ctx, slot);  // formulas reading it must be run again
+        return 1;  // found exit
     }
+    // symbol not found...add new entry in table
+    return AddSymbol(ctx, lhs, len, hash, rhs) >= 0;
+}
 
-    cNextCharacter = *(pWord_ + 1);     // 2nd character in new word_
-    DBG("cNextCharacter='%c'\n", cNextCharacter);
+int SaveSymbol_r(PARSER_CONTEXT *ctx, char *lhs, double rhs)
+{
+    return SaveSymbolN(ctx, lhs, strlen(lhs), rhs);
+}
 
-    // look for number
-    // can be: + or - followed by a decimal point
-    // or: + or - followed by a digit
-    // or: starting with a digit
-    // or: decimal point followed by a digit
-    if ((!ignoreSign &&
-         (cFirstCharacter == '+' || cFirstCharacter == '-') &&
-         (isdigit(cNextCharacter) || cNextCharacter == '.'))
-        || isdigit(cFirstCharacter)
-        // allow decimal numbers without a leading 0. e.g. ".5"
-        // Dennis Jones 01-30-2009
-        || (cFirstCharacter == '.' && isdigit(cNextCharacter))) {
-        // skip sign for now
-        if ((cFirstCharacter == '+' || cFirstCharacter == '-'))
-            pWord_++;
-        while (isdigit(*pWord_) || *pWord_ == '.')
-            pWord_++;
+void ResetSymbols_r(PARSER_CONTEXT *ctx)  // forget all symbols
+{
+    free(ctx->sym_index_);  // (reallocated by the next AddSymbol())
+    ctx->sym_index_ = NULL;
+    ctx->sym_index_size_ = 0;
+    ctx->num_vars = 0;
+    ctx->num_bindings_ = 0;
+    ++ctx->bind_generation_;
+    ++ctx->sym_generation_;  // invalidates existing COMPILED_EXPRs
+    ArenaReset(&ctx->sym_arena_);
+}
 
-        // allow for 1.53158e+15
-        if (*pWord_ == 'e' || *pWord_ == 'E') {
-            pWord_++;           // skip 'e'
-            if ((*pWord_ == '+' || *pWord_ == '-'))
-                pWord_++;       // skip sign after e
-            while (isdigit(*pWord_))    // now digits after e
-                pWord_++;
-        }
-
-        //word_ = std::string(pWordStart_, pWord_ - pWordStart_);
-        STRNCPY(word_, pWordStart_, pWord_ - pWordStart_);
-        DBG("pWordStart_='%s'\n", pWordStart_);
-        DBG("pWord_='%s'\n", pWord_);
-
-        //std::istringstream is(word_);
-        // parse std::string into double value
-        //is >> value_;
-        p = NULL;
-        value_ = strtod(word_, &p);
-        DBG("strtod('%s')\n", word_);
-        //////pWord_ += p - word_;  // skip it
-
-        //if (is.fail() && !is.eof())
-        if (p && *p != '\0')
-             runtime_error("Bad numeric literal: %s", word_);
-        DBG("return NUMBER\n");
-        return type_ = NUMBER;
-    }
+static double TimeSecs(void)  // "time" built-in (secs since 1970 epoch)
+{
+    return (double)time(NULL);
+}
 
-    // special test for 2-character sequences: <= >= == !=
-    // also +=, -=, /=, *=
-    DBG("check %c for 2-char...\n", cNextCharacter);
-    if (cNextCharacter == '=') {
-        switch (cFirstCharacter) {
-            // comparisons
-        case '=':
-            type_ = EQ;
-            break;
-        case '<':
-            type_ = LE;
-            break;
-        case '>':
-            type_ = GE;
-            break;
-        case '!':
-            type_ = NE;
-            break;
-            // assignments
-        case '+':
-            type_ = ASSIGN_ADD;
-            break;
-        case '-':
-            type_ = ASSIGN_SUB;
-            break;
-        case '*':
-            type_ = ASSIGN_MUL;
-            break;
-        case '/':
-            type_ = ASSIGN_DIV;
-            break;
-            // none of the above
-        default:
-            type_ = NONE;
-            break;
-        }
+#if !defined(WIN32) || defined(HAVE_GETTIMEOFDAY)
+static double TimeMsecs(void)  // "timems" built-in (msecs since 1970 epoch)
+{
+    typedef struct timeval {
+        long tv_sec;
+        long tv_usec;
+    } timeval;
+    struct timeval tv;
 
-        if (type_ != NONE) {
-            //word_ = std::string(pWordStart_, 2);
-            STRNCPY(word_, pWordStart_, 2);
-            pWord_ += 2;        // skip both characters
-            DBG("return 2-char\n");
-            return type_;
-        }
-    }
+    gettimeofday(&tv, NULL);
+    return ((double)tv.tv_sec * 1000 + (double)tv.tv_usec / 1000); 
+}
+#endif
 
-    DBG("check %c for 1-char...\n", cFirstCharacter);
-    switch (cFirstCharacter) {
-    case '&':
-        if (cNextCharacter == '&')      // &&
-        {
-            //word_ = std::string(pWordStart_, 2);
-            STRNCPY(word_, pWordStart_, 2);
-            pWord_ += 2;        // skip both characters
-            DBG("return AND\n");
-            return type_ = AND;
-        }
-        break;
-    case '|':
-        if (cNextCharacter == '|')      // ||
-        {
-            //word_ = std::string(pWordStart_, 2);
-            STRNCPY(word_, pWordStart_, 2);
-            pWord_ += 2;        // skip both characters
-            DBG("return OR\n");
-            return type_ = OR;
-        }
-        break;
-        // single-character symboles
-    case '=':
-    case '<':
-    case '>':
-    case '+':
-    case '-':
-    case '/':
-    case '*':
-    case '^':
-    case '(':
-    case ')':
-    case ',':
-    case '!':
-        //word_ = std::string(pWordStart_, 1);
-        STRNCPY(word_, pWordStart_, 1);
-        ++pWord_;               // skip it
-        //type_ = TokenType(cFirstCharacter);
-        type_ = cFirstCharacter;
-        DBG("return %c\n", cFirstCharacter);
-        return type_;
-    }
+// the clock built-ins' values become msecs (since the 1970 epoch) and the
+// whole seconds of that
+static void SetClockTo(PARSER_CONTEXT *ctx, double msecs)
+{
+    ctx->clock_[0] = floor(msecs / 1000);
+    ctx->clock_[1] = msecs;
+}
 
-    if (!isalpha(cFirstCharacter)) {
-        if (cFirstCharacter < ' ') {
-            runtime_error("Unexpected character 0x%02x", cFirstCharacter);
-        } else
-            runtime_error("Unexpected character '%c'", cFirstCharacter);
-    }
-    // we have a word (starting with A-Z) - pull it out
-    while (isalnum(*pWord_) || *pWord_ == '_')
-        ++pWord_;
+// choose when "time" and "timems" read the clock: PARSER_CLOCK_LIVE (every
+// time they're used) or PARSER_CLOCK_ONCE (at the start of each Evaluate_r(),
+// EvaluateCompiled(), EvaluateBatch() or RunProgram(), for all of it);
+// returns 0 if mode is neither
+int SetClockMode_r(PARSER_CONTEXT *ctx, int mode)
+{
+    if (mode != PARSER_CLOCK_LIVE && mode != PARSER_CLOCK_ONCE)
+        return 0;
+    if ((mode == PARSER_CLOCK_LIVE) != (ctx->clock_mode_ == PARSER_CLOCK_LIVE))
+        ++ctx->bind_generation_;  // compiled code reads ctx->clock_ or not
+    ctx->clock_mode_ = mode;
+    return 1;
+}
 
-    //word_ = std::string(pWordStart_, pWord_ - pWordStart_);
-    STRNCPY(word_, pWordStart_, pWord_ - pWordStart_);
-    DBG("return NAME/%d (%s)\n", (int)NAME, word_);
-    return type_ = NAME;
+int SetClockMode(int mode)
+{
+    return SetClockMode_r(&default_ctx_, mode);
 }
 
-static double Primary(const bool get)  // primary (base) tokens
+// logical clock: "time" and "timems" give msecs (since the 1970 epoch) from
+// now on, until it's set again or SetClockMode_r() is called
+void SetClock_r(PARSER_CONTEXT *ctx, double msecs)
 {
-    if (get)
-        GetToken(false);                // one-token lookahead  
+    if (ctx->clock_mode_ == PARSER_CLOCK_LIVE)
+        ++ctx->bind_generation_;
+    ctx->clock_mode_ = PARSER_CLOCK_FIXED;
+    SetClockTo(ctx, msecs);
+}
 
-    DBG("---------Primary(%d)\n", type_);
+void SetClock(double msecs)
+{
+    SetClock_r(&default_ctx_, msecs);
+}
 
-    switch (type_) {
-    case NUMBER:
-        {
-            double v = value_;
-            GetToken(true);     // get next one (one-token lookahead)
-            return v;
-        }
+// an Evaluate_r() etc. starts: in PARSER_CLOCK_ONCE mode, the outermost one
+// (not one called by a user function) reads the clock for all of it to use
+static void ClockEnter(PARSER_CONTEXT *ctx)
+{
+    if (ctx->clock_depth_++ == 0 && ctx->clock_mode_ == PARSER_CLOCK_ONCE) {
+#if !defined(WIN32) || defined(HAVE_GETTIMEOFDAY)
+        SetClockTo(ctx, TimeMsecs());
+#else
+        SetClockTo(ctx, TimeSecs() * 1000);
+#endif
+    }
+}
 
-    case NAME:
-        {
-            //std::string word = word_;
-            char word[1024];
+static void ClockLeave(PARSER_CONTEXT *ctx)
+{
+    --ctx->clock_depth_;
+}
+
+// value of "time" (which 0) or "timems" (1)
+static double ClockValue(PARSER_CONTEXT *ctx, int which)
+{
+    if (ctx->clock_mode_ != PARSER_CLOCK_LIVE)
+        return ctx->clock_[which];
+#if !defined(WIN32) || defined(HAVE_GETTIMEOFDAY)
+    return which ? TimeMsecs() : TimeSecs();
+#else
+    return TimeSecs();
+#endif
+}
+
+// look up the len characters at lhs as a symbol
+static double LookupSymbolN(PARSER_CONTEXT *ctx, const char *lhs, size_t len)
+{
+    int slot;
+    double rhs;
+
+    DBG("LookupSymbol('%.*s')", (int)len, lhs);
+    if (*lhs == 't') {      // only clock built-ins need the compare
+        if (len == 4 && !memcmp(lhs, "time", 4)) {  // "time" built-in (secs since 1970 epoch)
+            return ClockValue(ctx, 0);
+        }
+#if !defined(WIN32) || defined(HAVE_GETTIMEOFDAY)
+        if (len == 6 && !memcmp(lhs, "timems", 6)) { // "timems" built-in (msecs since epoch)
+            return ClockValue(ctx, 1);
+        }
+#endif
+    }
+    if ((slot = FindSymbol(ctx, lhs, len, HashName(lhs, len))) >= 0) {
+        rhs = *SymbolValue(ctx, slot);  // match
+        DBG("=%g\n", rhs);
+        return rhs;  // return symbol value
+    }
+    rhs = PARSE_ERROR;
+    DBG("=%g\n", rhs);
+    return rhs;  // no match
+}
+
+double LookupSymbol_r(PARSER_CONTEXT *ctx, char *lhs)
+{
+    return LookupSymbolN(ctx, lhs, strlen(lhs));
+}
+
+// bind name to the values stride bytes apart from first, the one at the row
+// given by SetBoundRow_r() being used (first NULL: unbind, keeping the value)
+int BindSymbolColumn_r(PARSER_CONTEXT *ctx, const char *name, double *first,
+                       size_t stride)
+{
+    size_t len = strlen(name), i;
+    unsigned hash = HashName(name, len);
+    BINDING *b;
+    int slot, j;
+
+    if (!IS(*name, C_ALPHA)) return 0;
+    for (i = 1; i < len; ++i) {
+        if (!IS(name[i], C_NAME)) return 0;
+    }
+    if (!strcmp(name, "pi") || !strcmp(name, "e") || !strcmp(name, "time") ||
+                                                    !strcmp(name, "timems"))
+        return 0;  // built-ins stay as they are
+    if ((slot = FindSymbol(ctx, name, len, hash)) < 0) {
+        if (!first) return 1;  // (nothing to unbind)
+        if ((slot = AddSymbol(ctx, name, len, hash, 0.0)) < 0)
+            return 0;
+    }
+
+    for (j = 0; j < ctx->num_bindings_ && ctx->bindings_[j].slot != slot; ++j)
+        ;
+    if (!first) {
+        if (j < ctx->num_bindings_) {
+            ctx->vars_rhs[slot] = *ctx->vars_ptr[slot];
+            ctx->vars_ptr[slot] = NULL;
+            ctx->bindings_[j] = ctx->bindings_[--ctx->num_bindings_];
+            ++ctx->bind_generation_;  // compiled code must read it again
+        }
+        return 1;
+    }
+    if (j == ctx->num_bindings_) {  // wasn't bound before
+        if (j >= ctx->max_bindings_) {
+            int n = ctx->max_bindings_ ? ctx->max_bindings_ * 2 : 16;
+
+            if ((b = realloc(ctx->bindings_, n * sizeof(BINDING))) == NULL)
+                return 0;
+            ctx->bindings_ = b;
+            ctx->max_bindings_ = n;
+        }
+        ctx->bindings_[j].slot = slot;
+        ctx->bindings_[j].seen = ctx->vars_rhs[slot];
+        ++ctx->num_bindings_;
+        ++ctx->bind_generation_;
+    }
+    b = &ctx->bindings_[j];
+    b->first = first;
+    b->stride = stride;
+    ctx->vars_ptr[slot] = (double *)((char *)first + ctx->bound_row_ * stride);
+    return 1;
+}
+
+int BindSymbol_r(PARSER_CONTEXT *ctx, const char *name, double *value)
+{
+    return BindSymbolColumn_r(ctx, name, value, 0);
+}
+
+void SetBoundRow_r(PARSER_CONTEXT *ctx, size_t row)  // of every column bound
+{
+    BINDING *b;
+
+    ctx->bound_row_ = row;
+    for (b = ctx->bindings_; b < ctx->bindings_ + ctx->num_bindings_; ++b)
+        ctx->vars_ptr[b->slot] = (double *)((char *)b->first + row * b->stride);
+}
+
+// promise that symbol name's values will be from lo to hi (or NaN), for
+// expressions compiled from now on
+int SetSymbolRange_r(PARSER_CONTEXT *ctx, const char *name, double lo,
+                     double hi)
+{
+    size_t len = strlen(name);
+    unsigned hash = HashName(name, len);
+    int slot, i;
+
+    if (!(lo <= hi))
+        return 0;  // (either is NaN, or they're the wrong way round)
+    if ((slot = FindSymbol(ctx, name, len, hash)) < 0 &&
+                (slot = AddSymbol(ctx, name, len, hash, PARSE_ERROR)) < 0)
+        return 0;
+    if (!ctx->vars_range) {  // the first one: the rest are unlimited
+        if ((ctx->vars_range = malloc(ctx->max_vars * sizeof(SYM_RANGE))) == NULL)
+            return 0;
+        for (i = 0; i < ctx->num_vars; ++i) {
+            ctx->vars_range[i].lo = -HUGE_VAL;
+            ctx->vars_range[i].hi = HUGE_VAL;
+            ctx->vars_range[i].stored = false;
+        }
+    }
+    ctx->vars_range[slot].lo = lo;
+    ctx->vars_range[slot].hi = hi;
+    FlushCache(&ctx->cache_);  // (compiled with the old range)
+    return 1;
+}
+
+int SaveSymbol(char *lhs, double rhs) // returns 1:success, 0:malloc() failed
+{
+    return SaveSymbol_r(&default_ctx_, lhs, rhs);
+}
+
+double LookupSymbol(char *lhs)
+{
+    return LookupSymbol_r(&default_ctx_, lhs);
+}
+
+void ResetSymbols(void)
+{
+    ResetSymbols_r(&default_ctx_);
+}
+
+int BindSymbol(const char *name, double *value)
+{
+    return BindSymbol_r(&default_ctx_, name, value);
+}
+
+int BindSymbolColumn(const char *name, double *first, size_t stride)
+{
+    return BindSymbolColumn_r(&default_ctx_, name, first, stride);
+}
+
+void SetBoundRow(size_t row)
+{
+    SetBoundRow_r(&default_ctx_, row);
+}
+
+int SetSymbolRange(const char *name, double lo, double hi)
+{
+    return SetSymbolRange_r(&default_ctx_, name, lo, hi);
+}
+
+// the user function named by the len characters at name, or NULL (there
+// are usually only a few, so they're just searched in turn)
+static USER_FUN *FindUserFun(PARSER_CONTEXT *ctx, const char *name, size_t len)
+{
+    unsigned hash = HashName(name, len);
+    int i;
+
+    for (i = 0; i < ctx->num_funs_; ++i) {
+        if (ctx->funs_[i].hash == hash && ctx->funs_[i].len == len &&
+                                    !memcmp(ctx->funs_[i].name, name, len))
+            return &ctx->funs_[i];
+    }
+    return NULL;
+}
+
+int AddFunction_r(PARSER_CONTEXT *ctx, const char *name, int nargs, int flags,
+                  PARSER_FUN fun, PARSER_BATCH_FUN batch, void *data)
+{
+    size_t len = strlen(name), i;
+    USER_FUN *uf;
+
+    if (!IS(*name, C_ALPHA) || nargs < 0 || nargs > PARSER_MAX_ARGS || !fun)
+        return 0;
+    for (i = 1; i < len; ++i) {
+        if (!IS(name[i], C_NAME)) return 0;
+    }
+    if (LookupFun(name, (int)len) || FindUserFun(ctx, name, len))
+        return 0;  // names can't be reused
+
+    if (ctx->num_funs_ >= ctx->max_funs_) {
+        int n = ctx->max_funs_ ? ctx->max_funs_ * 2 : 8;
+
+        if ((uf = realloc(ctx->funs_, n * sizeof(USER_FUN))) == NULL)
+            return 0;
+        ctx->funs_ = uf;
+        ctx->max_funs_ = n;
+    }
+    uf = &ctx->funs_[ctx->num_funs_];
+    if ((uf->name = malloc(len + 1)) == NULL)
+        return 0;
+#ifdef HAVE_STATS
+    if ((uf->calls = calloc(1, sizeof(unsigned long))) == NULL) {
+        free(uf->name);
+        return 0;
+    }
+#endif
+    memcpy(uf->name, name, len + 1);
+    uf->len = len;
+    uf->hash = HashName(name, len);
+    uf->nargs = nargs;
+    uf->flags = flags;
+    uf->fun = fun;
+    uf->batch = batch;
+    uf->data = data;
+    ++ctx->num_funs_;
+    FlushCache(&ctx->cache_);  // so expressions that failed can be compiled
+    return 1;
+}
+
+int AddFunction(const char *name, int nargs, int flags, PARSER_FUN fun,
+                PARSER_BATCH_FUN batch, void *data)
+{
+    return AddFunction_r(&default_ctx_, name, nargs, flags, fun, batch, data);
+}
+
+// powers of ten that are exact as doubles
+static const double pow10_table[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Convert the number from s up to end (as GetToken() found it: a sign, digits
+// and dots, maybe an exponent) to *value, and return whether it was all one
+// number. Most numbers have at most 15 or so digits and a small exponent, so
+// the digits fit exactly in a double, as does the power of ten, and a single
+// multiply or divide gives the correctly rounded value. Anything else goes to
+// strtod(), which also catches mistakes like "1.2.3" or "1e".
+static bool ParseNumber(const char *s, const char *end, double *value)
+{
+    const char *p = s;
+    unsigned long long m = 0;   // the significant digits
+    int digits = 0, e10 = 0, exp = 0, dots = 0, any = 0, eneg = 0;
+    bool neg = false;
+    char buf[64], *q;
+
+    if (*p == '+' || *p == '-')
+        neg = *p++ == '-';
+    for (; p < end && IS(*p, C_NUM); ++p) {
+        if (*p == '.') {
+            ++dots;
+            continue;
+        }
+        ++any;
+        if (m == 0 && *p == '0') {      // leading zero
+            e10 -= dots;
+            continue;
+        }
+        if (++digits > 19)
+            goto slow;
+        m = m * 10 + (*p - '0');
+        e10 -= dots;
+    }
+    if (dots > 1 || !any)
+        goto slow;
+    if (p < end) {    // exponent
+        if (++p < end && (*p == '+' || *p == '-'))
+            eneg = *p++ == '-';
+        if (p == end)
+            goto slow;
+        for (; p < end; ++p) {
+            if (exp > 9999)
+                goto slow;
+            exp = exp * 10 + (*p - '0');
+        }
+        e10 += eneg ? -exp : exp;
+    }
+
+    if (m == 0)
+        *value = 0.0;
+    else if (m <= (1ULL << 53) && e10 >= -22 && e10 <= 22)
+        *value = e10 < 0 ? (double)m / pow10_table[-e10]
+                         : (double)m * pow10_table[e10];
+    else
+        goto slow;
+    if (neg)
+        *value = -*value;
+    return true;
+
+slow:
+    if (end - s < (int)sizeof(buf)) {
+        memcpy(buf, s, end - s);
+        buf[end - s] = '\0';
+        *value = strtod(buf, &q);
+        return q == buf + (end - s);
+    }
+    // too big for buf: strtod() stops where GetToken() did, or sooner
+    *value = strtod(s, &q);
+    return q == end;
+}
+
+// Tokens aren't copied anywhere: the token is the source text from
+// pWordStart_ up to pWord_, with its number in value_.
+static enum TokenType ScanToken(PARSER_CONTEXT *ctx, const bool ignoreSign)
+{
+    const char *p = ctx->pWord_;
+    unsigned char cFirstCharacter;
+    unsigned char cNextCharacter;
+
+    DBG("GetToken('%s')...\n", ctx->pWord_);
+
+    // skip spaces
+    while (IS(*p, C_SPACE)) ++p;
+
+    ctx->pWordStart_ = ctx->pWord_ = p;   // the token starts here
+
+    // look out for unterminated statements and things
+    if (*p == 0 &&                   // we have EOF
+        ctx->type_ == END)           // after already detecting it
+        runtime_error(ctx, PARSER_ERR_END, NULL, 0);
+
+    cFirstCharacter = *p;            // first character in new token
+    DBG("cFirstCharacter='%c'\n", cFirstCharacter);
+
+    if (cFirstCharacter == 0)   // stop at end of file
+    {
+        DBG("return END\n");
+        return ctx->type_ = END;
+    }
+
+    cNextCharacter = p[1];           // 2nd character in new token
+    DBG("cNextCharacter='%c'\n", cNextCharacter);
+
+    // look for number
+    // can be: + or - followed by a decimal point
+    // or: + or - followed by a digit
+    // or: starting with a digit
+    // or: decimal point followed by a digit
+    if ((!ignoreSign &&
+         (cFirstCharacter == '+' || cFirstCharacter == '-') &&
+         IS(cNextCharacter, C_NUM))
+        || IS(cFirstCharacter, C_DIGIT)
+        // allow decimal numbers without a leading 0. e.g. ".5"
+        // Dennis Jones 01-30-2009
+        || (cFirstCharacter == '.' && IS(cNextCharacter, C_DIGIT))) {
+        // skip sign for now
+        if ((cFirstCharacter == '+' || cFirstCharacter == '-'))
+            p++;
+        while (IS(*p, C_NUM))
+            p++;
+
+        // allow for 1.53158e+15
+        if (*p == 'e' || *p == 'E') {
+            p++;                     // skip 'e'
+            if ((*p == '+' || *p == '-'))
+                p++;                 // skip sign after e
+            while (IS(*p, C_DIGIT))  // now digits after e
+                p++;
+        }
+        ctx->pWord_ = p;
+        DBG("number='%.*s'\n", (int)(p - ctx->pWordStart_), ctx->pWordStart_);
+
+        if (!ParseNumber(ctx->pWordStart_, p, &ctx->value_)) {
+             TokenError(ctx, PARSER_ERR_BAD_NUMBER, ctx->pWordStart_, p);
+             return ctx->type_;
+        }
+        DBG("return NUMBER\n");
+        return ctx->type_ = NUMBER;
+    }
+
+    // special test for 2-character sequences: <= >= == !=
+    // also +=, -=, /=, *=
+    DBG("check %c for 2-char...\n", cNextCharacter);
+    if (cNextCharacter == '=') {
+        switch (cFirstCharacter) {
+            // comparisons
+        case '=':
+            ctx->type_ = EQ;
+            break;
+        case '<':
+            ctx->type_ = LE;
+            break;
+        case '>':
+            ctx->type_ = GE;
+            break;
+        case '!':
+            ctx->type_ = NE;
+            break;
+            // assignments
+        case '+':
+            ctx->type_ = ASSIGN_ADD;
+            break;
+        case '-':
+            ctx->type_ = ASSIGN_SUB;
+            break;
+        case '*':
+            ctx->type_ = ASSIGN_MUL;
+            break;
+        case '/':
+            ctx->type_ = ASSIGN_DIV;
+            break;
+            // none of the above
+        default:
+            ctx->type_ = NONE;
+            break;
+        }
+
+        if (ctx->type_ != NONE) {
+            ctx->pWord_ += 2;        // skip both characters
+            DBG("return 2-char\n");
+            return ctx->type_;
+        }
+    }
+
+    DBG("check %c for 1-char...\n", cFirstCharacter);
+    switch (cFirstCharacter) {
+    case '&':
+        if (cNextCharacter == '&')      // &&
+        {
+            ctx->pWord_ += 2;        // skip both characters
+            DBG("return AND\n");
+            return ctx->type_ = AND;
+        }
+        break;
+    case '|':
+        if (cNextCharacter == '|')      // ||
+        {
+            ctx->pWord_ += 2;        // skip both characters
+            DBG("return OR\n");
+            return ctx->type_ = OR;
+        }
+        break;
+        // single-character symboles
+    case '=':
+    case '<':
+    case '>':
+    case '+':
+    case '-':
+    case '/':
+    case '*':
+    case '^':
+    case '(':
+    case ')':
+    case ',':
+    case '!':
+        ++ctx->pWord_;               // skip it
+        //type_ = TokenType(cFirstCharacter);
+        ctx->type_ = cFirstCharacter;
+        DBG("return %c\n", cFirstCharacter);
+        return ctx->type_;
+    }
+
+    if (!IS(cFirstCharacter, C_ALPHA)) {
+        runtime_error(ctx, PARSER_ERR_BAD_CHARACTER, NULL, cFirstCharacter);
+        return ctx->type_;
+    }
+    // we have a word (starting with A-Z) - pull it out
+    while (IS(*p, C_NAME))
+        ++p;
+    ctx->pWord_ = p;
+
+    DBG("return NAME/%d (%.*s)\n", (int)NAME,
+        (int)(p - ctx->pWordStart_), ctx->pWordStart_);
+    return ctx->type_ = NAME;
+}
+
+static enum TokenType GetToken(PARSER_CONTEXT *ctx, const bool ignoreSign)
+{
+#ifdef HAVE_STATS
+    unsigned long long start = StatsClock();
+    enum TokenType type = ScanToken(ctx, ignoreSign);
+
+    STAT_ADD(ctx->stats_.token_ns, StatsClock() - start);
+    return type;
+#else
+    return ScanToken(ctx, ignoreSign);
+#endif
+}
+
+static double Primary(PARSER_CONTEXT *ctx, const bool get) // primary (base) tokens
+{
+    if (get)
+        GetToken(ctx, false);                // one-token lookahead  
+
+    DBG("---------Primary(%d)\n", ctx->type_);
+
+    switch (ctx->type_) {
+    case NUMBER:
+        {
+            double v = ctx->value_;
+            GetToken(ctx, true);     // get next one (one-token lookahead)
+            return v;
+        }
+
+    case NAME:
+        {
+            // the name stays put in the source text
+            const char *word = ctx->pWordStart_;
+            int len = (int)(ctx->pWord_ - ctx->pWordStart_);
             double v;
-            FUN1_ENTRY *si;
-            FUN2_ENTRY *di;
-            FUN3_ENTRY *ti;
-
-            STRNCPY(word, word_, sizeof(word) - 2);
-            GetToken(true);
-            if (type_ == LHPAREN) {
-                // might be single-argument function (eg. abs (x) )
-                //std::map < std::string,
-                 //   OneArgFunction >::const_iterator si;
-                //si = OneArgumentFunctions.find(word);
-                //if (si != OneArgumentFunctions.end()) 
-                if ((si = LookupFun1(word)) != NULL) {
-                    double v = Expression(true);        // get argument
-                    CheckToken(RHPAREN);
-                    GetToken(true);     // get next one (one-token lookahead)
-                    return si->fun(v);  // evaluate function
-                }
-                // might be double-argument function (eg. roll (6, 2) )
-                //std::map < std::string,
-                 //   TwoArgFunction >::const_iterator di;
-                //di = TwoArgumentFunctions.find(word);
-                //if (di != TwoArgumentFunctions.end()) 
-                if ((di = LookupFun2(word)) != NULL) {
-                    double v1 = Expression(true);
-                    CheckToken(COMMA);
-                    double v2 = Expression(true);
-                    CheckToken(RHPAREN);
-                    GetToken(true);     // get next one (one-token lookahead)
-                    return di->fun(v1, v2);     // evaluate function
+            FUN_ENTRY *f;
+            USER_FUN *uf;
+
+            GetToken(ctx, true);
+            if (ctx->type_ == LHPAREN) {
+                switch ((f = LookupFun(word, len)) ? f->args : 0) {
+                case 1:  // single-argument function (eg. abs (x) )
+                    {
+                        double v = Expression(ctx, true);    // get argument
+                        CheckToken(RHPAREN);
+                        GetToken(ctx, true);  // get next one (one-token lookahead)
+                        if (ctx->skip_)
+                            return 0.0;  // short-circuited: don't call it
+                        STAT_ADD(ctx->fun_calls_[f - fun_table], 1);
+                        return f->fun1(v);  // evaluate function
+                    }
+                case 2:  // double-argument function (eg. roll (6, 2) )
+                    {
+                        double v1 = Expression(ctx, true);
+                        CheckToken(COMMA);
+                        double v2 = Expression(ctx, true);
+                        CheckToken(RHPAREN);
+                        GetToken(ctx, true);  // get next one (one-token lookahead)
+                        if (ctx->skip_)
+                            return 0.0;
+                        STAT_ADD(ctx->fun_calls_[f - fun_table], 1);
+                        return f->fun2(v1, v2);     // evaluate function
+                    }
+                case 3:  // three-argument function (eg. if (a > b, 6, 2) )
+                    {
+                        // short-circuit if() only does the side it returns
+                        bool lazy = ctx->short_circuit_ && f->fun3 == DoIf;
+                        double v1 = Expression(ctx, true);
+                        CheckToken(COMMA);
+                        ctx->skip_ += lazy && v1 == 0.0;
+                        double v2 = Expression(ctx, true);
+                        ctx->skip_ -= lazy && v1 == 0.0;
+                        CheckToken(COMMA);
+                        ctx->skip_ += lazy && v1 != 0.0;
+                        double v3 = Expression(ctx, true);
+                        ctx->skip_ -= lazy && v1 != 0.0;
+                        CheckToken(RHPAREN);
+                        GetToken(ctx, true);  // get next one (one-token lookahead)
+                        if (ctx->skip_)
+                            return 0.0;
+                        STAT_ADD(ctx->fun_calls_[f - fun_table], 1);
+                        return f->fun3(v1, v2, v3); // evaluate function
+                    }
                 }
-                // might be three-argument function (eg. if (a > b, 6, 2) )
-                //std::map < std::string,
-                 //   ThreeArgFunction >::const_iterator ti;
-                //ti = ThreeArgumentFunctions.find(word);
-                //if (ti != ThreeArgumentFunctions.end()) 
-                if ((ti = LookupFun3(word)) != NULL) {
-                    double v1 = Expression(true);
-                    CheckToken(COMMA);
-                    double v2 = Expression(true);
-                    CheckToken(COMMA);
-                    double v3 = Expression(true);
+                if ((uf = FindUserFun(ctx, word, len)) != NULL) {
+                    double args[PARSER_MAX_ARGS];
+                    int i;
+
+                    for (i = 0; i < uf->nargs; ++i) {
+                        if (i > 0)
+                            CheckToken(COMMA);
+                        args[i] = Expression(ctx, true);
+                    }
+                    if (uf->nargs == 0)
+                        GetToken(ctx, true);  // the )
                     CheckToken(RHPAREN);
-                    GetToken(true);     // get next one (one-token lookahead)
-                    return ti->fun(v1, v2, v3); // evaluate function
+                    GetToken(ctx, true);  // get next one (one-token lookahead)
+                    if (ctx->err_ != PARSER_OK)
+                        return PARSE_ERROR;  // don't call it
+                    if (ctx->skip_)
+                        return 0.0;
+                    STAT_ADD(*uf->calls, 1);
+                    return uf->fun(args, uf->data);
                 }
-                runtime_error("Function '%s' not implemented", word);
+                TokenError(ctx, PARSER_ERR_UNKNOWN_FUNCTION, word, word + len);
             }
             // not a function? must be a symbol in the symbol table
+            if (ctx->err_ != PARSER_OK)
+                return PARSE_ERROR;  // don't touch the symbol table
+            if (ctx->skip_) {         // (nor if short-circuited)
+                switch (ctx->type_) {
+                case ASSIGN:
+                case ASSIGN_ADD:
+                case ASSIGN_SUB:
+                case ASSIGN_MUL:
+                case ASSIGN_DIV:
+                    Expression(ctx, true);  // parse what would be assigned
+                    break;
+                default:
+                    break;
+                }
+                return 0.0;
+            }
             //double &v = symbols_[word]; // get REFERENCE to symbol table entry
-            if ((v = LookupSymbol(word)) == PARSE_ERROR) {
-                SaveSymbol(word, v);  // not found, add to table
+            if ((v = LookupSymbolN(ctx, word, len)) == PARSE_ERROR) {
+                SaveSymbolN(ctx, word, len, v);  // not found, add to table
             }
             // change table entry with expression? (eg. a = 22, or a = 22)
-            switch (type_) {
+            switch (ctx->type_) {
                 // maybe check for NaN or Inf here (see: isinf, isnan functions)
             case ASSIGN:
-                v = Expression(true);
-                SaveSymbol(word, v);// save new value
+                v = Expression(ctx, true);
+                if (ctx->err_ == PARSER_OK)
+                    SaveSymbolN(ctx, word, len, v);// save new value
                 break;
             case ASSIGN_ADD:
-                v += Expression(true);
-                SaveSymbol(word, v);// save new value
+                v += Expression(ctx, true);
+                if (ctx->err_ == PARSER_OK)
+                    SaveSymbolN(ctx, word, len, v);// save new value
                 break;
             case ASSIGN_SUB:
-                v -= Expression(true);
-                SaveSymbol(word, v);// save new value
+                v -= Expression(ctx, true);
+                if (ctx->err_ == PARSER_OK)
+                    SaveSymbolN(ctx, word, len, v);// save new value
                 break;
             case ASSIGN_MUL:
-                v *= Expression(true);
-                SaveSymbol(word, v);// save new value
+                v *= Expression(ctx, true);
+                if (ctx->err_ == PARSER_OK)
+                    SaveSymbolN(ctx, word, len, v);// save new value
                 break;
             case ASSIGN_DIV:
                 {
-                    double d = Expression(true);
+                    double d = Expression(ctx, true);
                     if (d == 0.0)
-                        runtime_error("Divide by zero");
+                        runtime_error(ctx, PARSER_ERR_DIVIDE_BY_ZERO, NULL, 0);
                     v /= d;
-                    SaveSymbol(word, v);// save new value
+                    if (ctx->err_ == PARSER_OK)
+                        SaveSymbolN(ctx, word, len, v);// save new value
                     break;      // change table entry with expression
                 }
             default:
@@ -819,24 +1717,25 @@ static double Primary(const bool get)  // primary (base) tokens
         }
 
     case MINUS:         // unary minus
-        return -Primary(true);
+        return -Primary(ctx, true);
 
     case NOT:                   // unary not
-        return (Primary(true) == 0.0) ? 1.0 : 0.0;;
+        return (Primary(ctx, true) == 0.0) ? 1.0 : 0.0;;
 
     case LHPAREN:
         {
-            double v = CommaList(true); // inside parens, you could have commas
+            double v = CommaList(ctx, true); // inside parens, you could have commas
             CheckToken(RHPAREN);
-            GetToken(true);     // eat the )
+            GetToken(ctx, true);     // eat the )
             return v;
         }
 
     default:
-        if (type_ == END) {
-            runtime_error("Unexpected end of expression");
+        if (ctx->type_ == END) {
+            runtime_error(ctx, PARSER_ERR_END, NULL, 0);
         } else {
-            runtime_error("Unexpected token: '%s'", word_);
+            TokenError(ctx, PARSER_ERR_UNEXPECTED_TOKEN, ctx->pWordStart_,
+                       ctx->pWord_);
         }
 
     }
@@ -844,23 +1743,23 @@ static double Primary(const bool get)  // primary (base) tokens
 
 }
 
-static double Term(const bool get)       // multiply and divide
+static double Term(PARSER_CONTEXT *ctx, const bool get)  // multiply and divide
 {
-    double left = Primary(get);
-    DBG("---------Term(%d)=%g\n", type_, left);
+    double left = Primary(ctx, get);
+    DBG("---------Term(%d)=%g\n", ctx->type_, left);
     while (true) {
-        switch (type_) {
+        switch (ctx->type_) {
         case POWER:
-            left = pow(left, Primary(true));
+            left = pow(left, Primary(ctx, true));
             break;
         case MULTIPLY:
-            left *= Primary(true);
+            left *= Primary(ctx, true);
             break;
         case DIVIDE:
             {
-                double d = Primary(true);
-                if (d == 0.0)
-                    runtime_error("Divide by zero");
+                double d = Primary(ctx, true);
+                if (d == 0.0 && !ctx->skip_)
+                    runtime_error(ctx, PARSER_ERR_DIVIDE_BY_ZERO, NULL, 0);
                 left /= d;
                 break;
             }
@@ -870,17 +1769,17 @@ static double Term(const bool get)       // multiply and divide
     }
 }
 
-static double AddSubtract(const bool get)        // add and subtract
+static double AddSubtract(PARSER_CONTEXT *ctx, const bool get) // add and subtract
 {
-    double left = Term(get);
-    DBG("---------AddSubtract(%d)=%g\n", type_, left);
+    double left = Term(ctx, get);
+    DBG("---------AddSubtract(%d)=%g\n", ctx->type_, left);
     while (true) {
-        switch (type_) {
+        switch (ctx->type_) {
         case PLUS:
-            left += Term(true);
+            left += Term(ctx, true);
             break;
         case MINUS:
-            left -= Term(true);
+            left -= Term(ctx, true);
             break;
         default:
             return left;
@@ -888,29 +1787,29 @@ static double AddSubtract(const bool get)        // add and subtract
     }
 }
 
-static double Comparison(const bool get) // LT, GT, LE, EQ etc.
+static double Comparison(PARSER_CONTEXT *ctx, const bool get) // LT, GT, LE, EQ etc.
 {
-    double left = AddSubtract(get);
-    DBG("---------Comparison(%d)=%g\n", type_, left);
+    double left = AddSubtract(ctx, get);
+    DBG("---------Comparison(%d)=%g\n", ctx->type_, left);
     while (true) {
-        switch (type_) {
+        switch (ctx->type_) {
         case LT:
-            left = left < AddSubtract(true) ? 1.0 : 0.0;
+            left = left < AddSubtract(ctx, true) ? 1.0 : 0.0;
             break;
         case GT:
-            left = left > AddSubtract(true) ? 1.0 : 0.0;
+            left = left > AddSubtract(ctx, true) ? 1.0 : 0.0;
             break;
         case LE:
-            left = left <= AddSubtract(true) ? 1.0 : 0.0;
+            left = left <= AddSubtract(ctx, true) ? 1.0 : 0.0;
             break;
         case GE:
-            left = left >= AddSubtract(true) ? 1.0 : 0.0;
+            left = left >= AddSubtract(ctx, true) ? 1.0 : 0.0;
             break;
         case EQ:
-            left = left == AddSubtract(true) ? 1.0 : 0.0;
+            left = left == AddSubtract(ctx, true) ? 1.0 : 0.0;
             break;
         case NE:
-            left = left != AddSubtract(true) ? 1.0 : 0.0;
+            left = left != AddSubtract(ctx, true) ? 1.0 : 0.0;
             break;
         default:
             return left;
@@ -918,21 +1817,31 @@ static double Comparison(const bool get) // LT, GT, LE, EQ etc.
     }
 }
 
-static double Expression(const bool get) // AND and OR
+static double Expression(PARSER_CONTEXT *ctx, const bool get) // AND and OR
 {
-    double left = Comparison(get);
-    DBG("---------Expression(%d)=%g\n", type_, left);
+    double left = Comparison(ctx, get);
+    DBG("---------Expression(%d)=%g\n", ctx->type_, left);
     while (true) {
-        switch (type_) {
+        switch (ctx->type_) {
         case AND:
-            {
-                double d = Comparison(true); // don't want short-circuit eval
+            if (ctx->short_circuit_ && left == 0.0) {
+                ++ctx->skip_;  // parse the right side, but don't do it
+                Comparison(ctx, true);
+                --ctx->skip_;
+                left = 0.0;
+            } else {
+                double d = Comparison(ctx, true); // don't want short-circuit eval
                 left = (left != 0.0) && (d != 0.0);
             }
             break;
         case OR:
-            {
-                double d = Comparison(true); // don't want short-circuit eval
+            if (ctx->short_circuit_ && left != 0.0) {
+                ++ctx->skip_;
+                Comparison(ctx, true);
+                --ctx->skip_;
+                left = 1.0;
+            } else {
+                double d = Comparison(ctx, true); // don't want short-circuit eval
                 left = (left != 0.0) || (d != 0.0);
             }
             break;
@@ -942,22 +1851,16 @@ static double Expression(const bool get) // AND and OR
     }
 }
 
-// initialise random number generator
-static int someNumber = 0;
-
-static double CommaList(const bool get)  // expr1, expr2
+static double CommaList(PARSER_CONTEXT *ctx, const bool get)  // expr1, expr2
 {
     double left;
 
-    if (someNumber == 0)
-        initRandom();
-
-    left = Expression(get);
-    DBG("---------CommaList(%d)=%g\n", type_, left);
+    left = Expression(ctx, get);
+    DBG("---------CommaList(%d)=%g\n", ctx->type_, left);
     while (true) {
-        switch (type_) {
+        switch (ctx->type_) {
         case COMMA:
-            left = Expression(true);
+            left = Expression(ctx, true);
             break;              // discard previous value
         default:
             return left;
@@ -965,27 +1868,4748 @@ static double CommaList(const bool get)  // expr1, expr2
     }
 }
 
-double Evaluate(char *expr)  // get result
-{
-    int ok;
-    double v;
-
-    ParserErrBuf[0] = '\0';  // default to NULL error string
+// Evaluate() parses recursively, taking several stack frames for each
+// level of nesting, so expressions nesting more deeply than this are
+// compiled (which doesn't recurse) and run instead
+#define EVAL_MAX_NESTING 32
 
-    if( !setjmp(parse_err_jmp_buf) ) {
-        SaveSymbol("pi", M_PI); // 3.1415926535897932385
-        SaveSymbol("e",  M_E);  // 2.7182818284590452354
-        DBG("ok=%d, v=%g\n", ok, LookupSymbol("pi"));
+// could Evaluate() nest more than EVAL_MAX_NESTING deep? Parentheses,
+// assignments and unary minus and not nest (counted generously: "==" as
+// an assignment, a minus sign of a number as unary minus), until the
+// closing parenthesis, or a comma at the same level, ends them.
+static bool DeeplyNested(const char *p)
+{
+    int open[EVAL_MAX_NESTING + 1];  // assignments etc. open in each (
+    int parens = 0, level = 0;
+    bool operand = true;  // an operand comes next (so '-' is unary minus)
 
-        pWord_ = expr;
-        type_ = NONE;
-        v = CommaList(true);
-        if (type_ != END)
-            runtime_error("Unexpected text at end of expression: '%s'",
-                                                                 pWordStart_);
-        return v;
-    } else {
-        return sqrt(-1.0); // error, return NaN silently
-    }
+    open[0] = 0;
+    for (; *p; ++p) {
+        switch (*p) {
+        case '(':
+            if (++level > EVAL_MAX_NESTING)
+                return true;
+            open[++parens] = 0;
+            operand = true;
+            break;
+        case ')':
+            if (parens > 0)
+                level -= open[parens--] + 1;
+            operand = false;
+            break;
+        case ',':
+            level -= open[parens];
+            open[parens] = 0;
+            operand = true;
+            break;
+        case '-':
+            if (!operand)
+                break;  // binary minus
+            // fall through
+        case '=':
+        case '!':
+            if (++level > EVAL_MAX_NESTING)
+                return true;
+            ++open[parens];
+            operand = true;
+            break;
+        default:
+            if (!IS(*p, C_SPACE))
+                operand = strchr("+*/^<>&|", *p) != NULL;
+            break;
+        }
+    }
+    return false;
+}
+
+// expr didn't compile: do what Evaluate() would have before finding the
+// error, as far as the whole expressions of the comma list before the
+// token in error go (eg. "a = 5" of "a = 5, ((1+"), keeping the error
+// unless one of them fails first
+static double RunBeforeError(PARSER_CONTEXT *ctx, const char *expr)
+{
+    const char *at = ctx->err_at_, *p, *comma = NULL;
+    enum ParserErrCode err = ctx->err_;
+    int err_char = ctx->err_char_, parens = 0;
+    char err_text[sizeof(ctx->err_text_)];
+    COMPILED_EXPR *ce;
+    char *lead;
+
+    if (err == PARSER_ERR_NO_MEMORY || !at || at < expr || at > expr + strlen(expr))
+        return sqrt(-1.0);
+    for (p = expr; p < at; ++p) {
+        if (*p == '(')
+            ++parens;
+        else if (*p == ')')
+            --parens;
+        else if (*p == ',' && parens == 0)
+            comma = p;  // (the last before the error)
+    }
+    if (!comma || (lead = malloc(comma - expr + 1)) == NULL)
+        return sqrt(-1.0);
+    memcpy(err_text, ctx->err_text_, sizeof(err_text));
+    memcpy(lead, expr, comma - expr);
+    lead[comma - expr] = '\0';
+    if ((ce = CompileExpr(ctx, lead)) != NULL) {
+        EvaluateCompiled(ce);
+        FreeCompiled(ce);
+    }
+    if (ce == NULL || ctx->err_ == PARSER_OK) {  // (the syntax error again)
+        ctx->err_ = err;
+        ctx->err_char_ = err_char;
+        memcpy(ctx->err_text_, err_text, sizeof(err_text));
+    }
+    free(lead);
+    return sqrt(-1.0);
+}
+
+double Evaluate_r(PARSER_CONTEXT *ctx, char *expr)  // get result
+{
+    double v;
+    PARSER_CONTEXT *prev_ctx = cur_ctx_;
+    COMPILED_EXPR *ce;
+#ifdef HAVE_STATS
+    unsigned long long start = StatsClock();
+#endif
+
+    if ((ce = CachedCompile(ctx, expr)) != NULL) {  // seen it before?
+        ctx->vars_rhs[ctx->pi_slot_] = M_PI;  // as SaveSymbol_r() below
+        ctx->vars_rhs[ctx->e_slot_] = M_E;
+        return EvaluateCompiled(ce);
+    }
+    if (DeeplyNested(expr)) {
+        if ((ce = CompileExpr(ctx, expr)) == NULL)
+            return RunBeforeError(ctx, expr);  // (see GetParserErr())
+        v = EvaluateCompiled(ce);
+        FreeCompiled(ce);
+        return v;
+    }
+
+    ctx->err_ = PARSER_OK;  // default to NULL error string
+    ctx->skip_ = 0;
+    cur_ctx_ = ctx;
+    ClockEnter(ctx);
+
+    if (!SaveSymbol_r(ctx, "pi", M_PI) ||  // 3.1415926535897932385
+        !SaveSymbol_r(ctx, "e",  M_E))     // 2.7182818284590452354
+        runtime_error(ctx, PARSER_ERR_NO_MEMORY, NULL, 0);
+    DBG("v=%g\n", LookupSymbol_r(ctx, "pi"));
+
+    if (ctx->err_ == PARSER_OK) {
+        ctx->pWord_ = expr;
+        ctx->type_ = NONE;
+        v = CommaList(ctx, true);
+        if (ctx->type_ != END)
+            runtime_error(ctx, PARSER_ERR_TRAILING_TEXT, ctx->pWordStart_, 0);
+    }
+    if (ctx->err_ != PARSER_OK)
+        v = sqrt(-1.0); // error, return NaN silently
+#ifdef HAVE_STATS
+    CountEvals(&ctx->stats_, 1, StatsClock() - start);
+    STAT_ADD(ctx->stats_.errors[ctx->err_], ctx->err_ != PARSER_OK);
+#endif
+    ClockLeave(ctx);
+    cur_ctx_ = prev_ctx;
+    return v;
+}
+
+double Evaluate(char *expr)  // get result
+{
+    return Evaluate_r(&default_ctx_, expr);
+}
+
+// short-circuit mode: &&, || and if() don't evaluate parts that can't change
+// the result (so their side effects and errors don't happen either)
+void SetShortCircuit_r(PARSER_CONTEXT *ctx, int on)
+{
+    if (ctx->short_circuit_ != (on != 0))
+        FlushCache(&ctx->cache_);  // compiled the other way
+    ctx->short_circuit_ = on != 0;
+}
+
+void SetShortCircuit(int on)
+{
+    SetShortCircuit_r(&default_ctx_, on);
+}
+
+PARSER_CONTEXT *NewParserContext(void)  // returns NULL if malloc() failed
+{
+    return calloc(1, sizeof(PARSER_CONTEXT));
+}
+
+void FreeParserContext(PARSER_CONTEXT *ctx)
+{
+    if (!ctx) return;
+#ifdef HAVE_THREADS
+    StopPool(&ctx->batch_pool_);
+#endif
+    FlushCache(&ctx->cache_);
+    free(ctx->cache_.buckets);
+    ArenaFree(&ctx->sym_arena_);
+    ArenaFree(&ctx->scratch_);
+    free(ctx->vars_lhs);
+    free(ctx->vars_rhs);
+    free(ctx->vars_hash);
+    free(ctx->vars_ptr);
+    free(ctx->vars_range);
+    free(ctx->bindings_);
+    free(ctx->sym_index_);
+    free(ctx->nodes_);
+    free(ctx->frames_);
+    free(ctx->args_);
+    while (ctx->num_funs_ > 0) {
+        free(ctx->funs_[--ctx->num_funs_].name);
+#ifdef HAVE_STATS
+        free(ctx->funs_[ctx->num_funs_].calls);
+#endif
+    }
+    free(ctx->funs_);
+    free(ctx);
+}
+
+/******************************************************************************
+
+Compiled expressions
+--------------------
+
+Compile() parses the same grammar as Evaluate(), but instead of computing
+results "on the fly" it builds an expression tree, which is then flattened
+into a postfix (stack machine) program. Neither step recurses, so there's
+no limit (but memory) to how deeply an expression may nest. EvaluateCompiled() simply
+runs that program, so the tokenizer and parser costs are paid only once.
+
+Symbols are resolved to symbol table slots at compile time (creating them
+if need be), so running a compiled expression does no name lookups. The
+program refers to the symbols it uses by their position in its own list
+(see CompiledSymbolName()), which in turn holds each one's table slot.
+Bound symbols are loaded and stored through a pointer instead (OP_LOADP and
+OP_STOREP), the program being patched to match when symbols are bound or
+unbound after it was compiled (see BindCompiled()). In the same way, the
+clock built-ins are loaded from the context (OP_CLOCK) while its clock
+isn't live.
+
+    COMPILED_EXPR *ce = Compile("a * 2 + sqrt (b)");
+
+    SaveSymbol("a", 42);
+    SaveSymbol("b", 64);
+    v = EvaluateCompiled(ce);  // 92
+    ...
+    FreeCompiled(ce);
+
+******************************************************************************/
+
+// (SaveCompiled() saves these, so changing them means a new SAVED_VERSION)
+enum OpCode {
+    OP_CONST,   // push consts[arg]
+    OP_LOAD,    // push value of symbol arg (a symbol table slot in the tree)
+    OP_STORE,   // symbol arg = top of stack (value left on stack)
+    OP_POP,     // discard top of stack
+    OP_TIME,    // push "time" built-in
+    OP_TIMEMS,  // push "timems" built-in
+    OP_NEG,     // unary minus
+    OP_NOT,     // unary not
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_POW,
+    OP_POWI,    // x^arg (arg > 0) by repeated multiplication, like pow()
+    OP_MOD,     // mod(), with its divide by zero check
+    OP_LT,
+    OP_GT,
+    OP_LE,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_AND,
+    OP_OR,
+    OP_COMMA,   // expression tree only: left, then right (left discarded)
+    OP_CALL1,   // call fun_table[arg]
+    OP_CALL2,   // call fun_table[arg]
+    OP_CALL3,   // call fun_table[arg]
+    OP_UCALL,   // call ctx->funs_[arg] (as many arguments as it takes)
+    OP_ARG,     // expression tree only: argument (kid 0) and the rest (kid 1)
+    // short-circuit jumps (to code[arg]); EvaluateBatch() ignores them,
+    // doing every part, so it needs the operator they jump over
+    OP_ANDJ,    // if top of stack is false, it's 0 and jump past the OP_AND
+    OP_ORJ,     // if top of stack is true, it's 1 and jump past the OP_OR
+    OP_IFJ,     // pop if() condition, jump to the false side if it's false
+    OP_ELSEJ,   // end of if() true side, jump past the OP_IFEND
+    OP_IFEND,   // end of if() false side (EvaluateBatch() picks a side here)
+    OP_TSTORE,  // temp arg = top of stack (value left on stack)
+    OP_TLOAD,   // push temp arg (see FindCommon())
+    OP_DIVNZ,   // OP_DIV that can't be by zero (see NodeRange()), unchecked
+    OP_MODNZ,   // OP_MOD likewise
+    OP_LOADP,   // program only: OP_LOAD of a bound symbol (see BindCompiled())
+    OP_STOREP,  // program only: OP_STORE of a bound symbol
+    OP_CLOCK    // program only: push ctx->clock_[arg] (OP_TIME, OP_TIMEMS)
+};
+
+typedef struct _expr_node {
+    enum OpCode op;
+    int arg;        // symbol slot or function table index
+    int kid[3];     // operand node indices (-1 if unused; see OP_ARG)
+    double value;   // OP_CONST value
+    bool pure;      // no side effects and can't fail (set by Optimize())
+    double lo, hi;  // range of values, bar NaN (set by Optimize())
+    int same;       // first node with the same value (set by FindCommon())
+    int temp;       // temp holding the value of this (first) node, or -1
+    int ready;      // code position the temp was stored at, or -1
+} EXPR_NODE;
+
+typedef struct _instr {
+    int op;         // enum OpCode
+    int arg;        // constant pool index, symbol or function index
+} INSTR;
+
+struct _compiled_expr {
+    PARSER_CONTEXT *ctx;  // context whose symbol table slots are used
+    unsigned sym_generation;  // ctx->sym_generation_ when compiled
+    unsigned bind_generation; // ctx->bind_generation_ BindCompiled() saw
+    INSTR *code;        // postfix program
+    int code_len;
+    double *consts;     // constant pool
+    int num_consts;
+    int *syms;          // symbol table slot of each symbol used
+    int num_syms;
+    int max_stack;      // deepest operand stack use
+    double *stack;      // operand stack (max_stack entries)
+    double *temps;      // common subexpression values (after the stack)
+    int num_temps;
+    int *stores;        // of syms, those the code assigns
+    int num_stores;
+    double *old;        // their values before EvaluateCompiled() runs it
+    bool batch_by_row;  // EvaluateBatch() must do one row at a time
+    unsigned runs;      // EvaluateCompiled() calls (until native code made)
+    double (*native)(double *vars);  // native code, or NULL
+    size_t native_size;
+    bool native_failed; // native code can't be made, don't try again
+#ifdef HAVE_STATS
+    STATS stats_;       // just this expression's
+#endif
+};
+
+static int NewNode(PARSER_CONTEXT *ctx, enum OpCode op, int arg,
+                   int kid0, int kid1, int kid2)
+{
+    EXPR_NODE *node;
+
+    if (ctx->num_nodes_ >= ctx->max_nodes_) {  // grow the tree storage
+        int n = ctx->max_nodes_ ? ctx->max_nodes_ * 2 : 64;
+
+        node = realloc(ctx->nodes_, n * sizeof(EXPR_NODE));
+        if (!node) {
+            runtime_error(ctx, PARSER_ERR_NO_MEMORY, NULL, 0);
+            return -1;
+        }
+        ctx->nodes_ = node;
+        ctx->max_nodes_ = n;
+    }
+    node = &ctx->nodes_[ctx->num_nodes_];
+    node->op = op;
+    node->arg = arg;
+    node->kid[0] = kid0;
+    node->kid[1] = kid1;
+    node->kid[2] = kid2;
+    node->value = 0.0;
+    node->pure = false;
+    node->same = node->temp = node->ready = -1;
+    return ctx->num_nodes_++;
+}
+
+// find (or create) symbol table slot for the len characters at name
+static int SymbolSlot(PARSER_CONTEXT *ctx, const char *name, int len)
+{
+    unsigned hash = HashName(name, len);
+    int slot;
+
+    if ((slot = FindSymbol(ctx, name, len, hash)) >= 0)
+        return slot;
+    if ((slot = AddSymbol(ctx, name, len, hash, PARSE_ERROR)) < 0)
+        runtime_error(ctx, PARSER_ERR_NO_MEMORY, NULL, 0);  // not found, add to table
+    return slot;
+}
+
+// read of symbol (or clock built-in)
+static int SymbolRef(PARSER_CONTEXT *ctx, const char *name, int len)
+{
+    if (len == 4 && !memcmp(name, "time", 4))
+        return NewNode(ctx, OP_TIME, 0, -1, -1, -1);
+#if !defined(WIN32) || defined(HAVE_GETTIMEOFDAY)
+    if (len == 6 && !memcmp(name, "timems", 6))
+        return NewNode(ctx, OP_TIMEMS, 0, -1, -1, -1);
+#endif
+    return NewNode(ctx, OP_LOAD, SymbolSlot(ctx, name, len), -1, -1, -1);
+}
+
+// Compile()'s parser keeps what it's in the middle of on a stack of its own
+// (in the context) instead of recursing, so however deeply an expression
+// nests, it only takes heap memory. It builds exactly the tree the grammar
+// of Primary(), Term() ... CommaList() gives (including which errors are
+// reported), reading the tokens in the same order: each operator binds to
+// its left as tightly as those functions' loops would.
+enum ParseFrameKind {
+    PF_LIST,    // whole expression (comma list)
+    PF_PAREN,   // ( comma list )
+    PF_CALL,    // arguments of a function call (built-in or added)
+    PF_ASSIGN,  // right-hand side of an assignment
+    PF_BINARY,  // right operand of a binary operator
+    PF_UNARY    // operand of unary minus or not
+};
+
+typedef struct _parse_frame {
+    enum ParseFrameKind kind;
+    int prec;           // binary operators of this priority or more go in it
+    enum OpCode op;     // PF_BINARY, PF_UNARY, PF_CALL (OP_CALL1 or OP_UCALL),
+                        // PF_ASSIGN (OP_STORE, or OP_ADD etc. for +=)
+    int left;           // PF_BINARY left operand, PF_ASSIGN symbol read (+=)
+    int arg;            // PF_CALL function index
+    int nargs;          // PF_CALL arguments it takes
+    int base;           // PF_CALL arguments so far are args_[base] on
+    const char *word;   // PF_ASSIGN symbol assigned
+    int len;
+} PARSE_FRAME;
+
+#define PARSE_MORE (-2)  /* CompilePrimary(): parse the operand of a frame */
+
+// make room for n entries of size bytes in *array (of *max entries), or
+// set PARSER_ERR_NO_MEMORY
+static bool GrowArray(PARSER_CONTEXT *ctx, void **array, int *max, int n,
+                      size_t size)
+{
+    void *p;
+    int m = *max ? *max : 16;
+
+    if (n <= *max)
+        return true;
+    while (m < n)
+        m *= 2;
+    if ((p = realloc(*array, m * size)) == NULL) {
+        runtime_error(ctx, PARSER_ERR_NO_MEMORY, NULL, 0);
+        return false;
+    }
+    *array = p;
+    *max = m;
+    return true;
+}
+
+static PARSE_FRAME *PushFrame(PARSER_CONTEXT *ctx, enum ParseFrameKind kind,
+                              int prec)  // NULL if out of memory
+{
+    PARSE_FRAME *f;
+
+    if (!GrowArray(ctx, (void **)&ctx->frames_, &ctx->max_frames_,
+                   ctx->num_frames_ + 1, sizeof(PARSE_FRAME)))
+        return NULL;
+    f = &ctx->frames_[ctx->num_frames_++];
+    f->kind = kind;
+    f->prec = prec;
+    f->op = OP_CONST;
+    f->left = -1;
+    f->base = ctx->num_args_;
+    return f;
+}
+
+// start on the arguments of a call (op: OP_CALL1 for a built-in function,
+// OP_UCALL for an added one); returns PARSE_MORE, or -1 if out of memory
+static int CallFrame(PARSER_CONTEXT *ctx, enum OpCode op, int arg, int nargs)
+{
+    PARSE_FRAME *f;
+
+    // (room for the arguments, so adding them can't fail; inner calls'
+    // arguments go on top of these, and are gone before these are added)
+    if (!GrowArray(ctx, (void **)&ctx->args_, &ctx->max_args_,
+                   ctx->num_args_ + nargs, sizeof(int)) ||
+                            (f = PushFrame(ctx, PF_CALL, 2)) == NULL)
+        return -1;
+    f->op = op;
+    f->arg = arg;
+    f->nargs = nargs;
+    return PARSE_MORE;
+}
+
+// first token of a primary: returns its node (-1 on error), or PARSE_MORE
+// if it's started a frame whose first operand comes next
+static int CompilePrimary(PARSER_CONTEXT *ctx)
+{
+    PARSE_FRAME *pf;
+
+    GetToken(ctx, false);                // one-token lookahead
+
+    switch (ctx->type_) {
+    case NUMBER:
+        {
+            int n = NewNode(ctx, OP_CONST, 0, -1, -1, -1);
+            if (n >= 0)
+                ctx->nodes_[n].value = ctx->value_;
+            GetToken(ctx, true);     // get next one (one-token lookahead)
+            return n;
+        }
+
+    case NAME:
+        {
+            const char *word = ctx->pWordStart_;  // as in Primary()
+            int len = (int)(ctx->pWord_ - ctx->pWordStart_);
+            enum OpCode op;
+            int n = -1;
+            FUN_ENTRY *f;
+            USER_FUN *uf;
+
+            GetToken(ctx, true);
+            if (ctx->type_ == LHPAREN) {
+                if ((f = LookupFun(word, len)) != NULL && f->args >= 1 &&
+                                                            f->args <= 3)
+                    return CallFrame(ctx, OP_CALL1, f - fun_table, f->args);
+                if ((uf = FindUserFun(ctx, word, len)) != NULL) {
+                    if (uf->nargs > 0)
+                        return CallFrame(ctx, OP_UCALL, uf - ctx->funs_,
+                                         uf->nargs);
+                    GetToken(ctx, true);  // the )
+                    CheckToken(RHPAREN);
+                    GetToken(ctx, true);  // get next one (one-token lookahead)
+                    return NewNode(ctx, OP_UCALL, uf - ctx->funs_, -1, -1, -1);
+                }
+                TokenError(ctx, PARSER_ERR_UNKNOWN_FUNCTION, word, word + len);
+            }
+            // not a function? must be a symbol in the symbol table
+            if (ctx->err_ != PARSER_OK)
+                return -1;  // don't touch the symbol table
+            switch (ctx->type_) {
+            case ASSIGN:
+                op = OP_STORE;
+                break;
+            case ASSIGN_ADD:
+                op = OP_ADD;
+                break;
+            case ASSIGN_SUB:
+                op = OP_SUB;
+                break;
+            case ASSIGN_MUL:
+                op = OP_MUL;
+                break;
+            case ASSIGN_DIV:
+                op = OP_DIV;
+                break;
+            default:
+                return SymbolRef(ctx, word, len);
+            }
+            // special assignment, eg. a += 22 is a = a + 22
+            if (op != OP_STORE)
+                n = SymbolRef(ctx, word, len);
+            if ((pf = PushFrame(ctx, PF_ASSIGN, 2)) == NULL)
+                return -1;
+            pf->op = op;
+            pf->left = n;
+            pf->word = word;
+            pf->len = len;
+            return PARSE_MORE;
+        }
+
+    case MINUS:         // unary minus
+    case NOT:           // unary not
+        if ((pf = PushFrame(ctx, PF_UNARY, 0)) == NULL)
+            return -1;
+        pf->op = ctx->type_ == MINUS ? OP_NEG : OP_NOT;
+        return PARSE_MORE;
+
+    case LHPAREN:       // inside parens, you could have commas
+        return PushFrame(ctx, PF_PAREN, 1) ? PARSE_MORE : -1;
+
+    default:
+        if (ctx->type_ == END) {
+            runtime_error(ctx, PARSER_ERR_END, NULL, 0);
+        } else {
+            TokenError(ctx, PARSER_ERR_UNEXPECTED_TOKEN, ctx->pWordStart_,
+                       ctx->pWord_);
+        }
+
+    }
+    return -1;
+}
+
+// binary operator the token is (and its priority), or -1
+static int BinaryOp(enum TokenType type, int *prec)
+{
+    switch (type) {
+    case COMMA:     *prec = 1; return OP_COMMA;  // CommaList()
+    case AND:       *prec = 2; return OP_AND;    // Expression()
+    case OR:        *prec = 2; return OP_OR;
+    case LT:        *prec = 3; return OP_LT;     // Comparison()
+    case GT:        *prec = 3; return OP_GT;
+    case LE:        *prec = 3; return OP_LE;
+    case GE:        *prec = 3; return OP_GE;
+    case EQ:        *prec = 3; return OP_EQ;
+    case NE:        *prec = 3; return OP_NE;
+    case PLUS:      *prec = 4; return OP_ADD;    // AddSubtract()
+    case MINUS:     *prec = 4; return OP_SUB;
+    case POWER:     *prec = 5; return OP_POW;    // Term()
+    case MULTIPLY:  *prec = 5; return OP_MUL;
+    case DIVIDE:    *prec = 5; return OP_DIV;
+    default:        *prec = 0; return -1;
+    }
+}
+
+// node for a call whose arguments are args_[f->base] on
+static int CallNode(PARSER_CONTEXT *ctx, PARSE_FRAME *f)
+{
+    int *args = ctx->args_ + f->base;
+    int n, i;
+
+    if (f->op == OP_UCALL) {
+        n = -1;  // argument list, built from the end
+        for (i = f->nargs; --i >= 0; )
+            n = NewNode(ctx, OP_ARG, 0, args[i], n, -1);
+        return NewNode(ctx, OP_UCALL, f->arg, n, -1, -1);
+    }
+    switch (f->nargs) {
+    case 1:
+        return NewNode(ctx, OP_CALL1, f->arg, args[0], -1, -1);
+    case 2:
+        if (fun_table[f->arg].fun2 == DoFmod)  // inline, to check for errors
+            return NewNode(ctx, OP_MOD, 0, args[0], args[1], -1);
+        return NewNode(ctx, OP_CALL2, f->arg, args[0], args[1], -1);
+    default:
+        return NewNode(ctx, OP_CALL3, f->arg, args[0], args[1], args[2]);
+    }
+}
+
+// whole expression: returns its tree's root (-1 on error)
+static int CompileCommaList(PARSER_CONTEXT *ctx)
+{
+    PARSE_FRAME *f;
+    int n, op, prec;
+
+    ctx->num_frames_ = ctx->num_args_ = 0;
+    if (!PushFrame(ctx, PF_LIST, 1))
+        return -1;
+    while (true) {
+        if ((n = CompilePrimary(ctx)) == PARSE_MORE)
+            continue;
+        // n is a primary: finish off whatever it completes
+        while (true) {
+            f = &ctx->frames_[ctx->num_frames_ - 1];
+            if (f->kind == PF_UNARY) {
+                --ctx->num_frames_;
+                n = NewNode(ctx, f->op, 0, n, -1, -1);
+                continue;
+            }
+            if ((op = BinaryOp(ctx->type_, &prec)) >= 0 && prec >= f->prec) {
+                if ((f = PushFrame(ctx, PF_BINARY, prec + 1)) == NULL)
+                    continue;  // (the error ends the expression)
+                f->op = op;
+                f->left = n;
+                break;  // on to its right operand
+            }
+            --ctx->num_frames_;
+            switch (f->kind) {
+            case PF_LIST:
+                return n;
+            case PF_BINARY:
+                n = NewNode(ctx, f->op, 0, f->left, n, -1);
+                continue;
+            case PF_PAREN:
+                CheckToken(RHPAREN);
+                GetToken(ctx, true);     // eat the )
+                continue;
+            case PF_ASSIGN:
+                if (f->op != OP_STORE)
+                    n = NewNode(ctx, f->op, 0, f->left, n, -1);
+                n = NewNode(ctx, OP_STORE, SymbolSlot(ctx, f->word, f->len),
+                            n, -1, -1);
+                continue;
+            default:  // PF_CALL: n is its next argument
+                ++ctx->num_frames_;
+                ctx->args_[ctx->num_args_++] = n;  // (see CallFrame())
+                if (ctx->num_args_ - f->base < f->nargs) {
+                    CheckToken(COMMA);
+                    break;  // on to the next one
+                }
+                CheckToken(RHPAREN);
+                GetToken(ctx, true);  // get next one (one-token lookahead)
+                n = CallNode(ctx, f);
+                ctx->num_args_ = f->base;
+                --ctx->num_frames_;
+                continue;
+            }
+            break;
+        }
+    }
+}
+
+/*
+   Optimize() simplifies the tree before any code is generated. Operators
+   and functions whose operands are all constant are worked out once, and
+   operations that can't change their operand (x*1, x/1, x^1, --x ...) are
+   dropped. Every rewrite must give exactly what Evaluate() would, so some
+   "obvious" ones are not done: x+0 turns -0 into 0, x*0 isn't 0 when x is
+   NaN, and a divide by a constant zero is left to fail at run time. x^2
+   isn't made x*x either: the ^ operator is C's pow(), which doesn't always
+   round the same way (pow() the function multiplies out whole powers
+   itself, so those can be).
+
+   It also works out the range of values each node can have, from those
+   of the constants and the ranges declared by SetSymbolRange_r() (symbols
+   the expression assigns have no range, nor do results of functions it
+   doesn't know). A divide or mod whose divisor can't be zero then needs
+   no check at run time (OP_DIVNZ, OP_MODNZ), and pow() of an exponent that
+   can't be a whole number from 1 to 64 is just C's pow(). NaN is left out
+   of the ranges (it's never zero or a whole number anyway). The bounds
+   are worked out with the operators themselves: those round monotonically,
+   so the rounded results of values in range are within the rounded bounds.
+*/
+
+// node n is the constant value (with the same sign, if zero)
+static bool IsConst(PARSER_CONTEXT *ctx, int n, double value)
+{
+    EXPR_NODE *node = &ctx->nodes_[n];
+
+    return node->op == OP_CONST && node->value == value &&
+                                    !signbit(node->value) == !signbit(value);
+}
+
+static void FullRange(EXPR_NODE *node)  // any value possible
+{
+    node->lo = -HUGE_VAL;
+    node->hi = HUGE_VAL;
+}
+
+static bool NonZero(const EXPR_NODE *node)  // range doesn't include zero
+{
+    return node->lo > 0.0 || node->hi < 0.0;
+}
+
+// range of the n values c (bounds of the result), full if any is NaN
+static void SpanRange(EXPR_NODE *node, const double *c, int n)
+{
+    int i;
+
+    node->lo = node->hi = c[0];
+    for (i = 0; i < n; ++i) {
+        if (isnan(c[i])) {
+            FullRange(node);
+            return;
+        }
+        if (c[i] < node->lo) node->lo = c[i];
+        if (c[i] > node->hi) node->hi = c[i];
+    }
+}
+
+// work out node's range from its operands' (see Optimize())
+static void NodeRange(PARSER_CONTEXT *ctx, EXPR_NODE *node)
+{
+    EXPR_NODE *kid[3] = { NULL, NULL, NULL };
+    FUN_ENTRY *f;
+    double c[4];
+    int i;
+
+    for (i = 0; i < 3 && node->kid[i] >= 0; ++i)
+        kid[i] = &ctx->nodes_[node->kid[i]];
+    switch (node->op) {
+    case OP_CONST:
+        c[0] = node->value;
+        SpanRange(node, c, 1);
+        return;
+    case OP_LOAD:
+        if (ctx->vars_range && !ctx->vars_range[node->arg].stored) {
+            node->lo = ctx->vars_range[node->arg].lo;
+            node->hi = ctx->vars_range[node->arg].hi;
+            return;
+        }
+        break;
+    case OP_STORE:  // (value of the right side)
+        node->lo = kid[0]->lo;
+        node->hi = kid[0]->hi;
+        return;
+    case OP_COMMA:
+        node->lo = kid[1]->lo;
+        node->hi = kid[1]->hi;
+        return;
+    case OP_NOT:
+    case OP_LT:
+    case OP_GT:
+    case OP_LE:
+    case OP_GE:
+    case OP_EQ:
+    case OP_NE:
+    case OP_AND:
+    case OP_OR:
+        node->lo = 0.0;
+        node->hi = 1.0;
+        return;
+    case OP_NEG:
+        c[0] = -kid[0]->hi;
+        c[1] = -kid[0]->lo;
+        SpanRange(node, c, 2);
+        return;
+    case OP_ADD:
+        c[0] = kid[0]->lo + kid[1]->lo;
+        c[1] = kid[0]->hi + kid[1]->hi;
+        SpanRange(node, c, 2);
+        return;
+    case OP_SUB:
+        c[0] = kid[0]->lo - kid[1]->hi;
+        c[1] = kid[0]->hi - kid[1]->lo;
+        SpanRange(node, c, 2);
+        return;
+    case OP_MUL:
+    case OP_DIV:  // (only if the divisor doesn't change sign)
+        if (node->op == OP_DIV && !NonZero(kid[1]))
+            break;
+        for (i = 0; i < 4; ++i) {
+            double a = i & 1 ? kid[0]->hi : kid[0]->lo;
+            double b = i & 2 ? kid[1]->hi : kid[1]->lo;
+
+            c[i] = node->op == OP_MUL ? a * b : a / b;
+        }
+        SpanRange(node, c, 4);
+        return;
+    case OP_CALL1:
+        f = &fun_table[node->arg];
+        c[0] = kid[0]->lo;
+        c[1] = kid[0]->hi;
+        if (f->fun1 == sqrt || f->fun1 == floor || f->fun1 == ceil) {
+            if (f->fun1 == sqrt && c[0] < 0.0)
+                c[0] = 0.0;  // (below that is NaN)
+            c[0] = f->fun1(c[0]);
+            c[1] = f->fun1(c[1]);
+            SpanRange(node, c, 2);
+            return;
+        }
+        if (f->fun1 == fabs) {
+            c[0] = NonZero(kid[0]) ? fmin(fabs(c[0]), fabs(c[1])) : 0.0;
+            c[1] = fmax(fabs(kid[0]->lo), fabs(kid[0]->hi));
+            SpanRange(node, c, 2);
+            return;
+        }
+        break;
+    case OP_CALL2:  // min() and max() give one of their arguments
+        f = &fun_table[node->arg];
+        if (f->fun2 == DoMin || f->fun2 == DoMax) {
+            node->lo = fmin(kid[0]->lo, kid[1]->lo);
+            node->hi = fmax(kid[0]->hi, kid[1]->hi);
+            return;
+        }
+        break;
+    case OP_CALL3:  // so does if(), bar the condition
+        if (fun_table[node->arg].fun3 == DoIf) {
+            node->lo = fmin(kid[1]->lo, kid[2]->lo);
+            node->hi = fmax(kid[1]->hi, kid[2]->hi);
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+    FullRange(node);
+}
+
+// rand(), percent() and roll() give a different answer every time
+static bool IsVolatile(EXPR_NODE *node)
+{
+    switch (node->op) {
+    case OP_CALL1:
+        return fun_table[node->arg].fun1 == DoRandom ||
+               fun_table[node->arg].fun1 == DoPercent;
+#ifdef HAVE_ROLL
+    case OP_CALL2:
+        return fun_table[node->arg].fun2 == DoRoll;
+#endif
+    default:
+        return false;
+    }
+}
+
+// a user function call is worked out now if it's pure and its arguments
+// are constants
+static void FoldCall(PARSER_CONTEXT *ctx, EXPR_NODE *node)
+{
+    USER_FUN *uf = &ctx->funs_[node->arg];
+    double args[PARSER_MAX_ARGS];
+    int n, i = 0;
+
+    node->pure = (uf->flags & PARSER_FUN_PURE) &&
+                    (node->kid[0] < 0 || ctx->nodes_[node->kid[0]].pure);
+    if (!node->pure)
+        return;
+    for (n = node->kid[0]; n >= 0; n = ctx->nodes_[n].kid[1]) {
+        EXPR_NODE *arg = &ctx->nodes_[ctx->nodes_[n].kid[0]];
+
+        if (arg->op != OP_CONST)
+            return;
+        args[i++] = arg->value;
+    }
+    node->value = uf->fun(args, uf->data);
+    node->op = OP_CONST;
+    node->kid[0] = -1;
+}
+
+// x^n (n > 0) the same way as DoPow()
+static double PowInt(double x, int n)
+{
+    double result = x;
+
+    while (--n) result *= x;
+    return result;
+}
+
+// work out an operator of constants, false if it can't be done now
+static bool FoldNode(EXPR_NODE *node, const double *v, double *result)
+{
+    switch (node->op) {
+    case OP_NEG:
+        *result = -v[0];
+        break;
+    case OP_NOT:
+        *result = (v[0] == 0.0) ? 1.0 : 0.0;
+        break;
+    case OP_ADD:
+        *result = v[0] + v[1];
+        break;
+    case OP_SUB:
+        *result = v[0] - v[1];
+        break;
+    case OP_MUL:
+        *result = v[0] * v[1];
+        break;
+    case OP_DIV:
+        if (v[1] == 0.0)
+            return false;  // leave the error to run time
+        *result = v[0] / v[1];
+        break;
+    case OP_POW:
+        *result = pow(v[0], v[1]);
+        break;
+    case OP_POWI:
+        *result = PowInt(v[0], node->arg);
+        break;
+    case OP_MOD:
+        if (v[1] == 0.0)
+            return false;
+        *result = fmod(v[0], v[1]);
+        break;
+    case OP_LT:
+        *result = v[0] < v[1] ? 1.0 : 0.0;
+        break;
+    case OP_GT:
+        *result = v[0] > v[1] ? 1.0 : 0.0;
+        break;
+    case OP_LE:
+        *result = v[0] <= v[1] ? 1.0 : 0.0;
+        break;
+    case OP_GE:
+        *result = v[0] >= v[1] ? 1.0 : 0.0;
+        break;
+    case OP_EQ:
+        *result = v[0] == v[1] ? 1.0 : 0.0;
+        break;
+    case OP_NE:
+        *result = v[0] != v[1] ? 1.0 : 0.0;
+        break;
+    case OP_AND:
+        *result = (v[0] != 0.0) && (v[1] != 0.0);
+        break;
+    case OP_OR:
+        *result = (v[0] != 0.0) || (v[1] != 0.0);
+        break;
+    case OP_CALL1:
+        *result = fun_table[node->arg].fun1(v[0]);
+        break;
+    case OP_CALL2:
+        *result = fun_table[node->arg].fun2(v[0], v[1]);
+        break;
+    case OP_CALL3:
+        *result = fun_table[node->arg].fun3(v[0], v[1], v[2]);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+static void Optimize(PARSER_CONTEXT *ctx)
+{
+    bool store_pi = false, store_e = false;
+    int n, i;
+
+    for (n = 0; n < ctx->num_nodes_; ++n) {
+        if (ctx->nodes_[n].op != OP_STORE)
+            continue;
+        if (ctx->nodes_[n].arg == ctx->pi_slot_)
+            store_pi = true;
+        if (ctx->nodes_[n].arg == ctx->e_slot_)
+            store_e = true;
+        if (ctx->vars_range)  // (so it has no range)
+            ctx->vars_range[ctx->nodes_[n].arg].stored = true;
+    }
+
+    // operands are always created before the node using them, so one pass
+    // in order sees each node after its operands are done. A node can be
+    // replaced by one of its operands by copying it (left unused).
+    for (n = 0; n < ctx->num_nodes_; ++n) {
+        EXPR_NODE *node = &ctx->nodes_[n];
+        EXPR_NODE *kid[3] = { NULL, NULL, NULL };
+        double v[3] = { 0.0, 0.0, 0.0 }, result, d;
+        bool pure = true, constant = true;
+        int nkids, e;
+
+        for (nkids = 0; nkids < 3 && node->kid[nkids] >= 0; ++nkids) {
+            kid[nkids] = &ctx->nodes_[node->kid[nkids]];
+            v[nkids] = kid[nkids]->value;
+            pure = pure && kid[nkids]->pure;
+            constant = constant && kid[nkids]->op == OP_CONST;
+        }
+        NodeRange(ctx, node);  // (rewrites below keep the value, so it holds)
+
+        switch (node->op) {
+        case OP_LOAD:
+            // unless the expression assigns them, "pi" and "e" are constant
+            if ((node->arg == ctx->pi_slot_ && !store_pi) ||
+                                    (node->arg == ctx->e_slot_ && !store_e)) {
+                node->value = node->arg == ctx->pi_slot_ ? M_PI : M_E;
+                node->op = OP_CONST;
+                node->lo = node->hi = node->value;
+            }
+            // fall through
+        case OP_CONST:
+        case OP_TIME:
+        case OP_TIMEMS:
+            node->pure = true;
+            continue;
+        case OP_STORE:
+            node->pure = false;
+            continue;
+        case OP_ARG:
+            node->pure = pure;
+            continue;
+        case OP_UCALL:
+            FoldCall(ctx, node);
+            continue;
+        case OP_COMMA:
+            if (kid[0]->pure)  // value of left side is discarded
+                *node = *kid[1];
+            else
+                node->pure = false;
+            continue;
+        default:
+            break;
+        }
+
+        if (constant && !IsVolatile(node) && FoldNode(node, v, &result)) {
+            node->op = OP_CONST;
+            node->kid[0] = node->kid[1] = node->kid[2] = -1;
+            node->value = result;
+            node->pure = true;
+            NodeRange(ctx, node);
+            continue;
+        }
+        node->pure = pure && !IsVolatile(node);
+
+        switch (node->op) {
+        case OP_NEG:
+            if (kid[0]->op == OP_NEG)  // --x
+                *node = ctx->nodes_[kid[0]->kid[0]];
+            break;
+        case OP_ADD:
+            if (IsConst(ctx, node->kid[1], -0.0))
+                *node = *kid[0];
+            else if (IsConst(ctx, node->kid[0], -0.0))
+                *node = *kid[1];
+            break;
+        case OP_SUB:
+            if (IsConst(ctx, node->kid[1], 0.0))
+                *node = *kid[0];
+            break;
+        case OP_MUL:
+            if (IsConst(ctx, node->kid[1], 1.0))
+                *node = *kid[0];
+            else if (IsConst(ctx, node->kid[0], 1.0))
+                *node = *kid[1];
+            break;
+        case OP_DIV:
+        case OP_MOD:
+            if (!NonZero(kid[1])) {
+                node->pure = false;  // may be a divide by zero
+                break;
+            }
+            if (node->op == OP_MOD)
+                node->op = OP_MODNZ;
+            else if (IsConst(ctx, node->kid[1], 1.0))
+                *node = *kid[0];
+            else if (kid[1]->op == OP_CONST && fabs(frexp(v[1], &e)) == 0.5 &&
+                                                    isfinite(1.0 / v[1])) {
+                // dividing by a power of two is exactly multiplying by its
+                // reciprocal
+                kid[1]->value = 1.0 / v[1];
+                node->op = OP_MUL;
+            } else
+                node->op = OP_DIVNZ;
+            break;
+        case OP_POW:
+            if (IsConst(ctx, node->kid[1], 1.0))
+                *node = *kid[0];
+            break;
+        case OP_CALL2:
+            // pow() multiplies out small whole powers itself
+            if (fun_table[node->arg].fun2 == DoPow &&
+                    kid[1]->op == OP_CONST && (d = v[1]) >= 1.0 && d <= 64.0 &&
+                    d == (int)d) {
+                if (d == 1.0)
+                    *node = *kid[0];
+                else {
+                    node->op = OP_POWI;
+                    node->arg = (int)d;
+                    node->kid[1] = -1;
+                }
+            } else if (fun_table[node->arg].fun2 == DoPow &&
+                                (kid[1]->hi < 1.0 || kid[1]->lo > 64.0 ||
+                                 (floor(kid[1]->lo) == floor(kid[1]->hi) &&
+                                  floor(kid[1]->lo) != kid[1]->lo)))
+                node->op = OP_POW;  // never multiplied out, so just pow()
+            break;
+        case OP_CALL3:
+            // if() of a constant is one side, if the other can be skipped
+            if (fun_table[node->arg].fun3 == DoIf && kid[0]->op == OP_CONST) {
+                i = v[0] != 0.0 ? 1 : 2;
+                if (kid[3 - i]->pure || ctx->short_circuit_)
+                    *node = *kid[i];
+            }
+            break;
+        case OP_AND:
+        case OP_OR:
+            // short-circuited by a constant left side
+            if (ctx->short_circuit_ && kid[0]->op == OP_CONST &&
+                            (v[0] != 0.0) == (node->op == OP_OR)) {
+                node->value = node->op == OP_OR;
+                node->op = OP_CONST;
+                node->kid[0] = node->kid[1] = -1;
+                node->pure = true;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    for (n = 0; ctx->vars_range && n < ctx->num_nodes_; ++n) {
+        if (ctx->nodes_[n].op == OP_STORE)
+            ctx->vars_range[ctx->nodes_[n].arg].stored = false;
+    }
+}
+
+/*
+   FindCommon() finds parts of the tree that work out the same value again
+   (eg. sqrt(x^2+y^2) in "a = sqrt(x^2+y^2), b = sqrt(x^2+y^2)/z"), so that
+   GenCode() can keep it in a temp the first time (OP_TSTORE) and just push
+   it after that (OP_TLOAD). Nodes are numbered in the order GenCode()
+   visits them: a node is the same as an earlier one if it's the same
+   operator of the same operands, and a symbol read is the same as an
+   earlier one if the symbol isn't assigned in between. Only parts without
+   side effects are shared (never rand() or the clock); one that can fail
+   with a divide by zero can be, as it failed the first time if at all.
+*/
+
+typedef struct _cse_state {
+    int *table;         // hash table of nodes seen so far (-1: empty)
+    unsigned mask;      // its size - 1
+    int *load;          // first read of each symbol slot since assigned
+    int *walk;          // nodes (and kids done) still to visit, 2 per node
+} CSE_STATE;
+
+// can equal nodes share one result?
+static bool Shareable(PARSER_CONTEXT *ctx, EXPR_NODE *node)
+{
+    switch (node->op) {
+    case OP_STORE:
+    case OP_COMMA:
+    case OP_TIME:
+    case OP_TIMEMS:
+        return false;
+    case OP_UCALL:
+        return (ctx->funs_[node->arg].flags & PARSER_FUN_PURE) != 0;
+    default:
+        return !IsVolatile(node);
+    }
+}
+
+// operand i's number (-1 if none)
+static int SameKid(PARSER_CONTEXT *ctx, EXPR_NODE *node, int i)
+{
+    return node->kid[i] < 0 ? -1 : ctx->nodes_[node->kid[i]].same;
+}
+
+static unsigned HashNode(PARSER_CONTEXT *ctx, EXPR_NODE *node)
+{
+    unsigned h = node->op * 31u + (unsigned)node->arg, bits[2];
+    int i;
+
+    if (node->op == OP_CONST) {
+        memcpy(bits, &node->value, sizeof(bits));
+        h = (h * 31u + bits[0]) * 31u + bits[1];
+    }
+    for (i = 0; i < 3; ++i)
+        h = h * 31u + (unsigned)SameKid(ctx, node, i);
+    return h ^ h >> 15;
+}
+
+static bool SameNode(PARSER_CONTEXT *ctx, EXPR_NODE *a, EXPR_NODE *b)
+{
+    int i;
+
+    if (a->op != b->op || a->arg != b->arg)
+        return false;
+    if (a->op == OP_CONST && memcmp(&a->value, &b->value, sizeof(double)))
+        return false;  // (-0 isn't 0, and NaNs are the same)
+    for (i = 0; i < 3; ++i)
+        if (SameKid(ctx, a, i) != SameKid(ctx, b, i))
+            return false;
+    return true;
+}
+
+// number node n, whose operands are numbered already
+static void NumberNode(PARSER_CONTEXT *ctx, CSE_STATE *cs, int n)
+{
+    EXPR_NODE *node = &ctx->nodes_[n];
+    unsigned h;
+    int m;
+
+    node->same = n;
+    node->temp = 0;  // uses, until FindCommon() gives it a temp
+    node->ready = -1;
+
+    switch (node->op) {
+    case OP_LOAD:
+        if (cs->load[node->arg] >= 0)
+            node->same = cs->load[node->arg];
+        else
+            cs->load[node->arg] = n;
+        return;
+    case OP_STORE:
+        cs->load[node->arg] = -1;  // reads from now on are of the new value
+        return;
+    default:
+        break;
+    }
+    if (!Shareable(ctx, node))
+        return;  // (so nothing using it is shared either)
+    for (h = HashNode(ctx, node) & cs->mask; (m = cs->table[h]) >= 0;
+                                                    h = (h + 1) & cs->mask) {
+        if (SameNode(ctx, node, &ctx->nodes_[m])) {
+            node->same = m;
+            return;
+        }
+    }
+    cs->table[h] = n;
+}
+
+// number the nodes under root, in GenCode() order (operands first)
+static void NumberNodes(PARSER_CONTEXT *ctx, CSE_STATE *cs, int root)
+{
+    int *sp = cs->walk;  // pairs of node, operands numbered so far
+    int n, *kid;
+
+    *sp++ = root;
+    *sp++ = 0;
+    while (sp > cs->walk) {
+        n = sp[-2];
+        kid = ctx->nodes_[n].kid;
+        if (sp[-1] < 3 && kid[sp[-1]] >= 0) {
+            n = kid[sp[-1]++];
+            *sp++ = n;
+            *sp++ = 0;
+        } else {
+            NumberNode(ctx, cs, n);
+            sp -= 2;
+        }
+    }
+}
+
+// count the uses of each value, not counting inside a repeat (which won't
+// be generated)
+static void CountUses(PARSER_CONTEXT *ctx, CSE_STATE *cs, int root)
+{
+    int *sp = cs->walk;
+    int i;
+
+    *sp++ = root;
+    while (sp > cs->walk) {
+        EXPR_NODE *node = &ctx->nodes_[*--sp];
+
+        if (ctx->nodes_[node->same].temp++ > 0)
+            continue;
+        for (i = 0; i < 3 && node->kid[i] >= 0; ++i)
+            *sp++ = node->kid[i];
+    }
+}
+
+// give each value used more than once a temp; returns number of temps
+static int FindCommon(PARSER_CONTEXT *ctx, int root)
+{
+    CSE_STATE cs;
+    unsigned size = 16;
+    int n, num_temps = 0;
+
+    while (size < 2u * ctx->num_nodes_)
+        size *= 2;
+    cs.table = malloc((size + ctx->num_vars + 2 * ctx->num_nodes_)
+                                                            * sizeof(int));
+    if (!cs.table)
+        return 0;  // no sharing (NewNode() left every temp at -1)
+    cs.mask = size - 1;
+    cs.load = cs.table + size;
+    cs.walk = cs.load + ctx->num_vars;
+    memset(cs.table, -1, (size + ctx->num_vars) * sizeof(int));
+
+    NumberNodes(ctx, &cs, root);
+    CountUses(ctx, &cs, root);
+    for (n = 0; n < ctx->num_nodes_; ++n) {
+        EXPR_NODE *node = &ctx->nodes_[n];
+
+        // symbols and constants are as quick to push as a temp
+        if (node->same == n && node->temp > 1 && node->op != OP_CONST &&
+                                node->op != OP_LOAD && node->op != OP_ARG)
+            node->temp = num_temps++;
+        else
+            node->temp = -1;
+    }
+    free(cs.table);
+    return num_temps;
+}
+
+static void Emit(COMPILED_EXPR *ce, int op, int arg)
+{
+    ce->code[ce->code_len].op = op;
+    ce->code[ce->code_len].arg = arg;
+    ++ce->code_len;
+}
+
+static int EmitConst(COMPILED_EXPR *ce, double value)
+{
+    ce->consts[ce->num_consts] = value;
+    return ce->num_consts++;
+}
+
+static int EmitSymbol(COMPILED_EXPR *ce, int slot)  // slot -> symbol index
+{
+    int i;
+
+    for (i = 0; i < ce->num_syms; ++i) {
+        if (ce->syms[i] == slot) return i;
+    }
+    ce->syms[ce->num_syms] = slot;
+    return ce->num_syms++;
+}
+
+// GenCode() keeps the nodes it's in the middle of on a stack of these
+typedef struct _gen_frame {
+    int n;              // node
+    int depth;          // values on the operand stack below its value
+    int step;           // parts of its code done so far
+    int j, k;           // short-circuit jumps to fill in
+} GEN_FRAME;
+
+typedef struct _gen_state {
+    GEN_FRAME *frames;
+    int *stored;        // (first) nodes with a temp stored, oldest first
+    int num_stored;
+} GEN_STATE;
+
+// temps stored after the jump at code position start (in a part that may
+// be skipped) can't be used after it. Temps are stored at ever later
+// positions, so they're the latest ones.
+static void ForgetTemps(PARSER_CONTEXT *ctx, GEN_STATE *gs, int start)
+{
+    EXPR_NODE *first;
+
+    while (gs->num_stored > 0 &&
+            (first = &ctx->nodes_[gs->stored[gs->num_stored - 1]])->ready
+                                                                > start) {
+        first->ready = -1;
+        --gs->num_stored;
+    }
+}
+
+// short-circuit code for f's node, if it's &&, || or if() (see GenStep());
+// the operands go at the same depths as without the jumps, for
+// EvaluateBatch()
+static bool GenJumps(PARSER_CONTEXT *ctx, GEN_STATE *gs, COMPILED_EXPR *ce,
+                     GEN_FRAME *f, int *kid, int *depth)
+{
+    EXPR_NODE *node = &ctx->nodes_[f->n];
+
+    switch (node->op) {
+    case OP_AND:
+    case OP_OR:
+        switch (f->step++) {
+        case 0:
+            *kid = node->kid[0];
+            return true;
+        case 1:
+            f->j = ce->code_len;
+            Emit(ce, node->op == OP_AND ? OP_ANDJ : OP_ORJ, 0);
+            *kid = node->kid[1];
+            *depth = f->depth + 1;
+            return true;
+        }
+        ForgetTemps(ctx, gs, f->j);
+        Emit(ce, node->op, 0);
+        ce->code[f->j].arg = ce->code_len;
+        if (!ctx->nodes_[node->kid[1]].pure)  // batch can't do it anyway
+            ce->batch_by_row = true;
+        return true;
+    case OP_CALL3:
+        if (fun_table[node->arg].fun3 != DoIf)
+            return false;
+        switch (f->step++) {
+        case 0:
+            *kid = node->kid[0];
+            return true;
+        case 1:
+            f->j = ce->code_len;
+            Emit(ce, OP_IFJ, 0);
+            *kid = node->kid[1];
+            *depth = f->depth + 1;
+            return true;
+        case 2:
+            ForgetTemps(ctx, gs, f->j);
+            f->k = ce->code_len;
+            Emit(ce, OP_ELSEJ, 0);
+            ce->code[f->j].arg = ce->code_len;
+            *kid = node->kid[2];
+            *depth = f->depth + 2;
+            return true;
+        }
+        ForgetTemps(ctx, gs, f->k);
+        Emit(ce, OP_IFEND, 0);
+        ce->code[f->k].arg = ce->code_len;
+        if (!ctx->nodes_[node->kid[1]].pure || !ctx->nodes_[node->kid[2]].pure)
+            ce->batch_by_row = true;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// next part of the code for f's node: returns the operand to generate next
+// (at *depth), or -1 once the node's code is done
+static int GenStep(PARSER_CONTEXT *ctx, GEN_STATE *gs, COMPILED_EXPR *ce,
+                   GEN_FRAME *f, int *depth)
+{
+    EXPR_NODE *node = &ctx->nodes_[f->n];
+    int step, kid = -1;
+
+    *depth = f->depth;
+    if (ctx->short_circuit_ && GenJumps(ctx, gs, ce, f, &kid, depth))
+        return kid;
+    step = f->step++;
+    switch (node->op) {
+    case OP_CONST:
+        Emit(ce, OP_CONST, EmitConst(ce, node->value));
+        return -1;
+    case OP_COMMA:
+        if (step == 1)
+            Emit(ce, OP_POP, 0);   // discard previous value
+        return step < 2 ? node->kid[step] : -1;
+    case OP_LOAD:
+    case OP_STORE:
+        if (step == 0 && node->kid[0] >= 0)
+            return node->kid[0];
+        Emit(ce, node->op, EmitSymbol(ce, node->arg));
+        return -1;
+    case OP_ARG:  // arguments go on the stack in turn
+        if (step == 0)
+            return node->kid[0];
+        *depth = f->depth + 1;
+        return step == 1 ? node->kid[1] : -1;
+    default:
+        if (step < 3 && node->kid[step] >= 0) {
+            *depth = f->depth + step;
+            return node->kid[step];
+        }
+        Emit(ce, node->op, node->arg);
+        if (node->op == OP_UCALL && !(ctx->funs_[node->arg].flags
+                                    & (PARSER_FUN_PURE | PARSER_FUN_VECTOR)))
+            ce->batch_by_row = true;
+        return -1;
+    }
+}
+
+// flatten the tree under root to postfix; returns false if out of memory
+static bool GenCode(PARSER_CONTEXT *ctx, COMPILED_EXPR *ce, int root)
+{
+    GEN_STATE gs;
+    GEN_FRAME *f;
+    EXPR_NODE *node, *first;
+    int n = root, depth = 0, sp = 0;
+
+    gs.frames = malloc(ctx->num_nodes_ * (sizeof(GEN_FRAME) + sizeof(int)));
+    if (!gs.frames)
+        return false;
+    gs.stored = (int *)(gs.frames + ctx->num_nodes_);
+    gs.num_stored = 0;
+
+    while (true) {
+        if (n >= 0) {  // start on node n, with depth values on the stack
+            node = &ctx->nodes_[n];
+            first = node->same >= 0 ? &ctx->nodes_[node->same] : node;
+            if (first->temp >= 0 && first->ready >= 0) {  // worked out already
+                Emit(ce, OP_TLOAD, first->temp);
+                if (depth + 1 > ce->max_stack)
+                    ce->max_stack = depth + 1;
+            } else {
+                f = &gs.frames[sp++];
+                f->n = n;
+                f->depth = depth;
+                f->step = 0;
+            }
+        }
+        if (sp == 0)
+            break;
+        f = &gs.frames[sp - 1];
+        if ((n = GenStep(ctx, &gs, ce, f, &depth)) >= 0)
+            continue;
+
+        // f's node is done
+        node = &ctx->nodes_[f->n];
+        first = node->same >= 0 ? &ctx->nodes_[node->same] : node;
+        if (first->temp >= 0) {  // keep it for next time
+            Emit(ce, OP_TSTORE, first->temp);
+            first->ready = ce->code_len;
+            gs.stored[gs.num_stored++] = first - ctx->nodes_;
+        }
+        if (f->depth + 1 > ce->max_stack)
+            ce->max_stack = f->depth + 1;
+        --sp;
+    }
+    free(gs.frames);
+    return true;
+}
+
+#ifdef HAVE_JIT
+static void JitFree(COMPILED_EXPR *ce);
+#endif
+
+void FreeCompiled(COMPILED_EXPR *ce)
+{
+    if (!ce) return;
+#ifdef HAVE_JIT
+    JitFree(ce);
+#endif
+    free(ce->code);
+    free(ce->consts);
+    free(ce->syms);
+    free(ce->stack);
+    free(ce->stores);
+    free(ce->old);
+    free(ce);
+}
+
+// list the symbols ce assigns (so EvaluateCompiled() can tell programs
+// when it changes them); returns false if out of memory
+static bool ListStores(COMPILED_EXPR *ce)
+{
+    int i, k;
+
+    ce->stores = malloc((ce->num_syms + 1) * sizeof(int));
+    ce->old = malloc((ce->num_syms + 1) * sizeof(double));
+    if (!ce->stores || !ce->old)
+        return false;
+    for (i = 0; i < ce->num_syms; ++i)
+        ce->old[i] = 0.0;  // (1.0: listed already)
+    for (i = 0; i < ce->code_len; ++i) {
+        if (ce->code[i].op != OP_STORE && ce->code[i].op != OP_STOREP)
+            continue;
+        if (ce->old[k = ce->code[i].arg] == 0.0)
+            ce->stores[ce->num_stores++] = k;
+        ce->old[k] = 1.0;
+    }
+    return true;
+}
+
+// make ce load and store bound symbols through ctx->vars_ptr (OP_LOADP and
+// OP_STOREP), and the others directly, as they're bound now; and load the
+// clock built-ins from ctx->clock_ (OP_CLOCK) unless the clock is live
+static void BindCompiled(COMPILED_EXPR *ce)
+{
+    double *const *ptr = ce->ctx->vars_ptr;
+    bool live = ce->ctx->clock_mode_ == PARSER_CLOCK_LIVE;
+    bool changed = false;
+    INSTR *ip;
+    int op, arg;
+
+    for (ip = ce->code; ip < ce->code + ce->code_len; ++ip) {
+        arg = ip->arg;
+        if (ip->op == OP_LOAD || ip->op == OP_LOADP)
+            op = ptr[ce->syms[ip->arg]] ? OP_LOADP : OP_LOAD;
+        else if (ip->op == OP_STORE || ip->op == OP_STOREP)
+            op = ptr[ce->syms[ip->arg]] ? OP_STOREP : OP_STORE;
+        else if (ip->op == OP_TIME || ip->op == OP_TIMEMS || ip->op == OP_CLOCK) {
+            if (ip->op != OP_CLOCK)
+                arg = ip->op == OP_TIMEMS;
+            op = live ? (arg ? OP_TIMEMS : OP_TIME) : OP_CLOCK;
+            if (live)
+                arg = 0;
+        } else
+            continue;
+        changed = changed || op != ip->op;
+        ip->op = op;
+        ip->arg = arg;
+    }
+#ifdef HAVE_JIT
+    if (changed && ce->native) {  // (made again from the new code)
+        JitFree(ce);
+        ce->native = NULL;
+    }
+#endif
+    ce->bind_generation = ce->ctx->bind_generation_;
+}
+
+// returns NULL if out of memory
+static COMPILED_EXPR *GenProgram(PARSER_CONTEXT *ctx, int root)
+{
+    COMPILED_EXPR *ce;
+    bool reset_pi = false, reset_e = false;
+    int i;
+
+    // a postfix program needs at most four instructions (an if() with jumps,
+    // and its OP_TSTORE) and one constant per tree node, plus the "pi" and
+    // "e" reset below
+    if ((ce = calloc(1, sizeof(COMPILED_EXPR))) == NULL) return NULL;
+    ce->code = malloc((4 * ctx->num_nodes_ + 6) * sizeof(INSTR));
+    ce->consts = malloc((ctx->num_nodes_ + 2) * sizeof(double));
+    ce->syms = malloc((ctx->num_nodes_ + 2) * sizeof(int));
+    if (!ce->code || !ce->consts || !ce->syms) {
+        FreeCompiled(ce);
+        return NULL;
+    }
+
+    // Evaluate() resets "pi" and "e" each time, so do the same on every
+    // run if the expression assigns to them
+    for (i = 0; i < ctx->num_nodes_; ++i) {
+        if (ctx->nodes_[i].op != OP_STORE)
+            continue;
+        if (ctx->nodes_[i].arg == ctx->pi_slot_)
+            reset_pi = true;
+        if (ctx->nodes_[i].arg == ctx->e_slot_)
+            reset_e = true;
+    }
+    if (reset_pi) {
+        Emit(ce, OP_CONST, EmitConst(ce, M_PI));
+        Emit(ce, OP_STORE, EmitSymbol(ce, ctx->pi_slot_));
+        Emit(ce, OP_POP, 0);
+    }
+    if (reset_e) {
+        Emit(ce, OP_CONST, EmitConst(ce, M_E));
+        Emit(ce, OP_STORE, EmitSymbol(ce, ctx->e_slot_));
+        Emit(ce, OP_POP, 0);
+    }
+    ce->max_stack = 1;
+    ce->num_temps = FindCommon(ctx, root);
+    if (!GenCode(ctx, ce, root)) {
+        FreeCompiled(ce);
+        return NULL;
+    }
+
+    ce->stack = malloc((ce->max_stack + ce->num_temps) * sizeof(double));
+    if (!ce->stack || !ListStores(ce)) {
+        FreeCompiled(ce);
+        return NULL;
+    }
+    ce->temps = ce->stack + ce->max_stack;
+    return ce;
+}
+
+// (for Evaluate()'s cache and programs; see Compile_r())
+static COMPILED_EXPR *CompileExpr(PARSER_CONTEXT *ctx, const char *expr)
+{
+    COMPILED_EXPR *ce;
+    int root;
+#ifdef HAVE_STATS
+    unsigned long long start = StatsClock();
+#endif
+
+    ctx->err_ = PARSER_OK;  // default to NULL error string
+
+    SaveSymbol_r(ctx, "pi", M_PI); // 3.1415926535897932385
+    SaveSymbol_r(ctx, "e",  M_E);  // 2.7182818284590452354
+    ctx->pi_slot_ = SymbolSlot(ctx, "pi", 2);
+    ctx->e_slot_ = SymbolSlot(ctx, "e", 1);
+
+    ctx->num_nodes_ = 0;
+    ctx->pWord_ = expr;
+    ctx->type_ = NONE;
+    if (ctx->err_ == PARSER_OK) {
+        root = CompileCommaList(ctx);
+        if (ctx->type_ != END)
+            runtime_error(ctx, PARSER_ERR_TRAILING_TEXT, ctx->pWordStart_, 0);
+    }
+    if (ctx->err_ != PARSER_OK) {
+        STAT_ADD(ctx->stats_.errors[ctx->err_], 1);
+        return NULL;  // syntax error (see GetParserErr())
+    }
+
+    Optimize(ctx);
+    if ((ce = GenProgram(ctx, root)) == NULL) {
+        runtime_error(ctx, PARSER_ERR_NO_MEMORY, NULL, 0);
+        STAT_ADD(ctx->stats_.errors[PARSER_ERR_NO_MEMORY], 1);
+    } else {
+        ce->ctx = ctx;
+        ce->sym_generation = ctx->sym_generation_;
+        BindCompiled(ce);
+    }
+#ifdef HAVE_STATS
+    STAT_ADD(ctx->stats_.compile_ns, StatsClock() - start);
+    if (ce)
+        ce->stats_.compile_ns = StatsClock() - start;
+#endif
+    return ce;
+}
+
+// the caller may give the result to EvaluateBatch(), so make sure there's
+// scratch memory for that too
+COMPILED_EXPR *Compile_r(PARSER_CONTEXT *ctx, const char *expr)
+{
+    COMPILED_EXPR *ce = CompileExpr(ctx, expr);
+
+    if (ce && !WarmScratch(ctx, BatchStateSize(ce))) {
+        FreeCompiled(ce);
+        runtime_error(ctx, PARSER_ERR_NO_MEMORY, NULL, 0);
+        STAT_ADD(ctx->stats_.errors[PARSER_ERR_NO_MEMORY], 1);
+        return NULL;
+    }
+    return ce;
+}
+
+COMPILED_EXPR *Compile(const char *expr)  // returns NULL on error
+{
+    return Compile_r(&default_ctx_, expr);
+}
+
+static double RunCompiled(COMPILED_EXPR *ce)
+{
+    PARSER_CONTEXT *ctx = ce->ctx;
+    const INSTR *ip = ce->code;
+    const INSTR *end = ip + ce->code_len;
+    const int *syms = ce->syms;
+    double *vars = ctx->vars_rhs;
+    double *temps = ce->temps;
+    double *sp = ce->stack;  // next free operand stack entry
+
+    for (; ip < end; ++ip) {
+        switch (ip->op) {
+        case OP_CONST:
+            *sp++ = ce->consts[ip->arg];
+            break;
+        case OP_LOAD:
+            *sp++ = vars[syms[ip->arg]];
+            break;
+        case OP_STORE:
+            vars[syms[ip->arg]] = sp[-1];
+            break;
+        case OP_LOADP:
+            *sp++ = *ctx->vars_ptr[syms[ip->arg]];
+            break;
+        case OP_STOREP:
+            *ctx->vars_ptr[syms[ip->arg]] = sp[-1];
+            break;
+        case OP_POP:
+            --sp;
+            break;
+        case OP_TIME:
+            *sp++ = TimeSecs();
+            break;
+#if !defined(WIN32) || defined(HAVE_GETTIMEOFDAY)
+        case OP_TIMEMS:
+            *sp++ = TimeMsecs();
+            break;
+#endif
+        case OP_CLOCK:
+            *sp++ = ctx->clock_[ip->arg];
+            break;
+        case OP_NEG:
+            sp[-1] = -sp[-1];
+            break;
+        case OP_NOT:
+            sp[-1] = (sp[-1] == 0.0) ? 1.0 : 0.0;
+            break;
+        case OP_ADD:
+            --sp;
+            sp[-1] += sp[0];
+            break;
+        case OP_SUB:
+            --sp;
+            sp[-1] -= sp[0];
+            break;
+        case OP_MUL:
+            --sp;
+            sp[-1] *= sp[0];
+            break;
+        case OP_DIV:
+            --sp;
+            if (sp[0] == 0.0) {
+                runtime_error(cur_ctx_, PARSER_ERR_DIVIDE_BY_ZERO, NULL, 0);
+                return PARSE_ERROR;
+            }
+            sp[-1] /= sp[0];
+            break;
+        case OP_DIVNZ:
+            --sp;
+            sp[-1] /= sp[0];
+            break;
+        case OP_POW:
+            --sp;
+            sp[-1] = pow(sp[-1], sp[0]);
+            break;
+        case OP_POWI:
+            sp[-1] = PowInt(sp[-1], ip->arg);
+            break;
+        case OP_MOD:
+            --sp;
+            if (sp[0] == 0.0) {
+                runtime_error(cur_ctx_, PARSER_ERR_MOD_BY_ZERO, NULL, 0);
+                return PARSE_ERROR;
+            }
+            sp[-1] = fmod(sp[-1], sp[0]);
+            break;
+        case OP_MODNZ:
+            --sp;
+            sp[-1] = fmod(sp[-1], sp[0]);
+            break;
+        case OP_LT:
+            --sp;
+            sp[-1] = sp[-1] < sp[0] ? 1.0 : 0.0;
+            break;
+        case OP_GT:
+            --sp;
+            sp[-1] = sp[-1] > sp[0] ? 1.0 : 0.0;
+            break;
+        case OP_LE:
+            --sp;
+            sp[-1] = sp[-1] <= sp[0] ? 1.0 : 0.0;
+            break;
+        case OP_GE:
+            --sp;
+            sp[-1] = sp[-1] >= sp[0] ? 1.0 : 0.0;
+            break;
+        case OP_EQ:
+            --sp;
+            sp[-1] = sp[-1] == sp[0] ? 1.0 : 0.0;
+            break;
+        case OP_NE:
+            --sp;
+            sp[-1] = sp[-1] != sp[0] ? 1.0 : 0.0;
+            break;
+        case OP_AND:
+            --sp;
+            sp[-1] = (sp[-1] != 0.0) && (sp[0] != 0.0);
+            break;
+        case OP_OR:
+            --sp;
+            sp[-1] = (sp[-1] != 0.0) || (sp[0] != 0.0);
+            break;
+        case OP_CALL1:
+            STAT_ADD(ctx->fun_calls_[ip->arg], 1);
+            STAT_ADD(ce->stats_.calls, 1);
+            sp[-1] = fun_table[ip->arg].fun1(sp[-1]);
+            break;
+        case OP_CALL2:
+            STAT_ADD(ctx->fun_calls_[ip->arg], 1);
+            STAT_ADD(ce->stats_.calls, 1);
+            --sp;
+            sp[-1] = fun_table[ip->arg].fun2(sp[-1], sp[0]);
+            break;
+        case OP_CALL3:
+            STAT_ADD(ctx->fun_calls_[ip->arg], 1);
+            STAT_ADD(ce->stats_.calls, 1);
+            sp -= 2;
+            sp[-1] = fun_table[ip->arg].fun3(sp[-1], sp[0], sp[1]);
+            break;
+        case OP_UCALL:
+            {
+                USER_FUN *uf = &ctx->funs_[ip->arg];
+
+                STAT_ADD(*uf->calls, 1);
+                STAT_ADD(ce->stats_.calls, 1);
+                sp -= uf->nargs;  // arguments are in place on the stack
+                *sp = uf->fun(sp, uf->data);
+                ++sp;
+            }
+            break;
+        case OP_ANDJ:
+            if (sp[-1] == 0.0) {
+                sp[-1] = 0.0;  // (not -0)
+                ip = ce->code + ip->arg - 1;
+            }
+            break;
+        case OP_ORJ:
+            if (sp[-1] != 0.0) {
+                sp[-1] = 1.0;
+                ip = ce->code + ip->arg - 1;
+            }
+            break;
+        case OP_IFJ:
+            if (*--sp == 0.0)
+                ip = ce->code + ip->arg - 1;
+            break;
+        case OP_ELSEJ:
+            ip = ce->code + ip->arg - 1;
+            break;
+        case OP_IFEND:
+            break;
+        case OP_TSTORE:
+            temps[ip->arg] = sp[-1];
+            break;
+        case OP_TLOAD:
+            *sp++ = temps[ip->arg];
+            break;
+        }
+    }
+    return sp[-1];
+}
+
+#ifdef HAVE_JIT
+
+/******************************************************************************
+
+Native code
+-----------
+
+With HAVE_JIT defined (the default in the Makefile; "make JIT=0" leaves it
+out for systems that can't make memory executable), an expression that has
+been run JIT_THRESHOLD times by EvaluateCompiled() is translated into
+machine code, which is then used from then on. Only x86-64 (System V, ie.
+not Windows) is done so far; elsewhere the postfix program is always used.
+
+The translation keeps operand stack entry i in register xmm<i>, so
+programs needing more than JIT_REGS stack entries stay interpreted.
+Operators become the matching SSE2 instructions (which round exactly as the
+C operators do), and pow, fmod, the clock and the function table entries
+are called directly, saving live stack registers around the call (user
+functions get their arguments where the registers were saved). The
+generated function is double f(double *vars), vars being the context's
+symbol values, with rbx holding vars (bound symbols' pointers are fetched
+from the context each time). The constant pool follows the code,
+addressed relative to rip. Short-circuit jumps become conditional jumps,
+fixed up once every instruction's code offset is known. Temps are kept
+in the stack frame, after the spill area.
+
+******************************************************************************/
+
+#define JIT_THRESHOLD 100  /* EvaluateCompiled() calls before native code */
+
+#ifdef JIT_X86_64
+
+#define JIT_REGS 14   /* xmm0 to xmm13 hold the stack, xmm14/15 are scratch */
+#define JIT_TMP 14
+#define JIT_ZERO 15
+
+typedef struct _jit_buf {
+    unsigned char *code;
+    size_t len;
+    size_t size;
+    int *fixups;        // code offsets of rip relative constant references
+    int *fixup_const;   // constant referred to by each
+    int num_fixups;
+    int *exits;         // code offsets of jumps to the epilogue (on error)
+    int num_exits;
+    int *offsets;       // code offset of each instruction of the program
+    int *label_sp;      // stack depth at each jump target
+    int *jumps;         // code offsets of short-circuit jumps
+    int *jump_to;       // instruction each one jumps to
+    int num_jumps;
+} JIT_BUF;
+
+static void JitError(int code)  // called from native code
+{
+    runtime_error(cur_ctx_, (enum ParserErrCode)code, NULL, 0);
+}
+
+static void JitByte(JIT_BUF *jb, int byte)
+{
+    jb->code[jb->len++] = (unsigned char)byte;
+}
+
+static void JitInt32(JIT_BUF *jb, int32_t v)
+{
+    memcpy(jb->code + jb->len, &v, sizeof(v));
+    jb->len += sizeof(v);
+}
+
+static void JitPtr(JIT_BUF *jb, const void *p)
+{
+    memcpy(jb->code + jb->len, &p, sizeof(p));
+    jb->len += sizeof(p);
+}
+
+// prefix, then REX if either register is xmm8-15, then 0F op
+static void JitSseOp(JIT_BUF *jb, int prefix, int op, int reg, int rm)
+{
+    JitByte(jb, prefix);
+    if (reg >= 8 || rm >= 8)
+        JitByte(jb, 0x40 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0));
+    JitByte(jb, 0x0F);
+    JitByte(jb, op);
+}
+
+// register to register SSE2 instruction: op reg, rm
+static void JitSse(JIT_BUF *jb, int prefix, int op, int reg, int rm)
+{
+    JitSseOp(jb, prefix, op, reg, rm);
+    JitByte(jb, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// movsd (op 0x10 load, 0x11 store) to or from [rbx + disp]
+static void JitMovVar(JIT_BUF *jb, int op, int reg, int32_t disp)
+{
+    JitSseOp(jb, 0xF2, op, reg, 0);
+    JitByte(jb, 0x80 | (reg & 7) << 3 | 3);
+    JitInt32(jb, disp);
+}
+
+// movsd (op 0x10 load, 0x11 store) to or from bound symbol slot's value,
+// at ctx->vars_ptr[slot] (read each time, as it moves with SetBoundRow_r())
+static void JitMovBound(JIT_BUF *jb, int op, int reg, PARSER_CONTEXT *ctx,
+                        int slot)
+{
+    JitByte(jb, 0x48);  // mov rax, &ctx->vars_ptr
+    JitByte(jb, 0xB8);
+    JitPtr(jb, &ctx->vars_ptr);
+    JitByte(jb, 0x48);  // mov rax, [rax]
+    JitByte(jb, 0x8B);
+    JitByte(jb, 0x00);
+    JitByte(jb, 0x48);  // mov rax, [rax + 8 * slot]
+    JitByte(jb, 0x8B);
+    JitByte(jb, 0x80);
+    JitInt32(jb, 8 * slot);
+    JitSseOp(jb, 0xF2, op, reg, 0);  // movsd to or from [rax]
+    JitByte(jb, (reg & 7) << 3);
+}
+
+// movsd (op 0x10 load, 0x11 store) to or from the double at p
+static void JitMovAbs(JIT_BUF *jb, int op, int reg, const void *p)
+{
+    JitByte(jb, 0x48);  // mov rax, p
+    JitByte(jb, 0xB8);
+    JitPtr(jb, p);
+    JitSseOp(jb, 0xF2, op, reg, 0);  // movsd to or from [rax]
+    JitByte(jb, (reg & 7) << 3);
+}
+
+// movsd (op 0x10 load, 0x11 store) to or from [rsp + disp]
+static void JitMovSpill(JIT_BUF *jb, int op, int reg, int32_t disp)
+{
+    JitSseOp(jb, 0xF2, op, reg, 0);
+    JitByte(jb, 0x84 | (reg & 7) << 3);
+    JitByte(jb, 0x24);
+    JitInt32(jb, disp);
+}
+
+// movsd reg, consts[i] (fixed up once the code length is known)
+static void JitLoadConst(JIT_BUF *jb, int reg, int i)
+{
+    JitSseOp(jb, 0xF2, 0x10, reg, 0);
+    JitByte(jb, 0x05 | (reg & 7) << 3);
+    jb->fixups[jb->num_fixups] = (int)jb->len;
+    jb->fixup_const[jb->num_fixups++] = i;
+    JitInt32(jb, 0);
+}
+
+#ifdef HAVE_STATS
+static void JitCount(JIT_BUF *jb, unsigned long *counter)  // atomic ++
+{
+    JitByte(jb, 0x48);  // mov rax, counter
+    JitByte(jb, 0xB8);
+    JitPtr(jb, counter);
+    JitByte(jb, 0xF0);  // lock add qword [rax], 1
+    JitByte(jb, 0x48);
+    JitByte(jb, 0x83);
+    JitByte(jb, 0x00);
+    JitByte(jb, 0x01);
+}
+#endif
+
+// call fun with nargs stack entries from base as arguments, leaving the
+// result in entry base
+static void JitCall(JIT_BUF *jb, const void *fun, int base, int nargs)
+{
+    int i;
+
+    for (i = 0; i < base; ++i)  // everything is caller saved
+        JitMovSpill(jb, 0x11, i, 8 * i);
+    for (i = 0; i < nargs; ++i) {
+        if (base + i != i)
+            JitSse(jb, 0x66, 0x28, i, base + i);  // movapd
+    }
+    JitByte(jb, 0x48);  // mov rax, fun
+    JitByte(jb, 0xB8);
+    JitPtr(jb, fun);
+    JitByte(jb, 0xFF);  // call rax
+    JitByte(jb, 0xD0);
+    if (base != 0)
+        JitSse(jb, 0x66, 0x28, base, 0);
+    for (i = 0; i < base; ++i)
+        JitMovSpill(jb, 0x10, i, 8 * i);
+}
+
+// call user function uf with the nargs stack entries from base as its
+// args[] (in the spill area), leaving the result in entry base
+static void JitUserCall(JIT_BUF *jb, const USER_FUN *uf, int base, int nargs)
+{
+    int i;
+
+    for (i = 0; i < base + nargs; ++i)
+        JitMovSpill(jb, 0x11, i, 8 * i);
+    JitByte(jb, 0x48);  // lea rdi, [rsp + 8 * base]
+    JitByte(jb, 0x8D);
+    JitByte(jb, 0xBC);
+    JitByte(jb, 0x24);
+    JitInt32(jb, 8 * base);
+    JitByte(jb, 0x48);  // mov rsi, data
+    JitByte(jb, 0xBE);
+    JitPtr(jb, uf->data);
+    JitByte(jb, 0x48);  // mov rax, fun
+    JitByte(jb, 0xB8);
+    JitPtr(jb, (const void *)uf->fun);
+    JitByte(jb, 0xFF);  // call rax
+    JitByte(jb, 0xD0);
+    if (base != 0)
+        JitSse(jb, 0x66, 0x28, base, 0);
+    for (i = 0; i < base; ++i)
+        JitMovSpill(jb, 0x10, i, 8 * i);
+}
+
+// if stack register reg is zero, report error code and return
+static void JitZeroCheck(JIT_BUF *jb, int reg, int code)
+{
+    JitSse(jb, 0x66, 0x57, JIT_ZERO, JIT_ZERO);   // xorpd
+    JitSse(jb, 0x66, 0x2E, reg, JIT_ZERO);        // ucomisd
+    JitByte(jb, 0x7A);  // jp (NaN isn't zero)
+    JitByte(jb, 24);
+    JitByte(jb, 0x75);  // jne
+    JitByte(jb, 22);
+    JitByte(jb, 0xBF);  // mov edi, code
+    JitInt32(jb, code);
+    JitByte(jb, 0x48);  // mov rax, JitError
+    JitByte(jb, 0xB8);
+    JitPtr(jb, (const void *)JitError);
+    JitByte(jb, 0xFF);  // call rax
+    JitByte(jb, 0xD0);
+    JitByte(jb, 0xE9);  // jmp epilogue (fixed up at the end)
+    jb->exits[jb->num_exits++] = (int)jb->len;
+    JitInt32(jb, 0);
+}
+
+// 8 bit jump (op being its opcode) to be aimed by JitLanding()
+static int JitShortJump(JIT_BUF *jb, int op)
+{
+    JitByte(jb, op);
+    JitByte(jb, 0);
+    return (int)jb->len - 1;
+}
+
+static void JitLanding(JIT_BUF *jb, int jump)  // jump lands here
+{
+    jb->code[jump] = (unsigned char)(jb->len - (jump + 1));
+}
+
+// jump (op 0xE9 jmp, 0x84 je) to instruction target, at sp stack entries
+static void JitJump(JIT_BUF *jb, int op, int target, int sp)
+{
+    if (op != 0xE9)
+        JitByte(jb, 0x0F);
+    JitByte(jb, op);
+    jb->jumps[jb->num_jumps] = (int)jb->len;
+    jb->jump_to[jb->num_jumps++] = target;
+    jb->label_sp[target] = sp;
+    JitInt32(jb, 0);
+}
+
+// comparison: a = (a pred b) ? 1.0 : 0.0, pred being a cmpsd predicate
+static void JitCompare(JIT_BUF *jb, int one, int a, int b, int pred, bool swap)
+{
+    if (swap) {  // b pred a
+        JitSse(jb, 0x66, 0x28, JIT_TMP, b);
+        JitSseOp(jb, 0xF2, 0xC2, JIT_TMP, a);
+        JitByte(jb, 0xC0 | (JIT_TMP & 7) << 3 | (a & 7));
+        JitByte(jb, pred);
+        JitSse(jb, 0x66, 0x28, a, JIT_TMP);
+    } else {
+        JitSseOp(jb, 0xF2, 0xC2, a, b);
+        JitByte(jb, 0xC0 | (a & 7) << 3 | (b & 7));
+        JitByte(jb, pred);
+    }
+    JitLoadConst(jb, JIT_TMP, one);
+    JitSse(jb, 0x66, 0x54, a, JIT_TMP);  // andpd: mask -> 1.0 or 0.0
+}
+
+// a = (a != 0) ? 1.0 : 0.0, like the C truth value
+static void JitTruth(JIT_BUF *jb, int a)
+{
+    JitSse(jb, 0x66, 0x57, JIT_ZERO, JIT_ZERO);
+    JitSseOp(jb, 0xF2, 0xC2, a, JIT_ZERO);
+    JitByte(jb, 0xC0 | (a & 7) << 3 | (JIT_ZERO & 7));
+    JitByte(jb, 4);  // cmpneqsd (NaN is true)
+}
+
+// translate the program into jb, returns false if it can't be done
+static bool JitProgram(COMPILED_EXPR *ce, JIT_BUF *jb, int one, int sign)
+{
+    PARSER_CONTEXT *ctx = ce->ctx;
+    const INSTR *ip;
+    // spill area, then the temps (keeping rsp aligned)
+    int frame = (8 * (JIT_REGS + ce->num_temps) + 15) & ~15;
+    int sp = 0, a, b, i, j, k;
+
+    JitByte(jb, 0x53);                  // push rbx
+    JitByte(jb, 0x48);                  // sub rsp, frame
+    JitByte(jb, 0x81);
+    JitByte(jb, 0xEC);
+    JitInt32(jb, frame);
+    JitByte(jb, 0x48);                  // mov rbx, rdi (vars)
+    JitByte(jb, 0x89);
+    JitByte(jb, 0xFB);
+
+    for (ip = ce->code; ip < ce->code + ce->code_len; ++ip) {
+        jb->offsets[ip - ce->code] = (int)jb->len;
+        a = sp - 2;     // operands of a binary operator
+        b = sp - 1;
+#ifdef HAVE_STATS
+        if (ip->op == OP_CALL1 || ip->op == OP_CALL2 || ip->op == OP_CALL3) {
+            JitCount(jb, &ce->stats_.calls);
+            JitCount(jb, &ctx->fun_calls_[ip->arg]);
+        } else if (ip->op == OP_UCALL) {
+            JitCount(jb, &ce->stats_.calls);
+            JitCount(jb, ctx->funs_[ip->arg].calls);
+        }
+#endif
+        switch (ip->op) {
+        case OP_CONST:
+            JitLoadConst(jb, sp++, ip->arg);
+            break;
+        case OP_LOAD:
+            JitMovVar(jb, 0x10, sp++, 8 * ce->syms[ip->arg]);
+            break;
+        case OP_STORE:
+            JitMovVar(jb, 0x11, sp - 1, 8 * ce->syms[ip->arg]);
+            break;
+        case OP_LOADP:
+            JitMovBound(jb, 0x10, sp++, ctx, ce->syms[ip->arg]);
+            break;
+        case OP_STOREP:
+            JitMovBound(jb, 0x11, sp - 1, ctx, ce->syms[ip->arg]);
+            break;
+        case OP_POP:
+            --sp;
+            break;
+        case OP_TIME:
+            JitCall(jb, (const void *)TimeSecs, sp++, 0);
+            break;
+#if !defined(WIN32) || defined(HAVE_GETTIMEOFDAY)
+        case OP_TIMEMS:
+            JitCall(jb, (const void *)TimeMsecs, sp++, 0);
+            break;
+#endif
+        case OP_CLOCK:
+            JitMovAbs(jb, 0x10, sp++, &ctx->clock_[ip->arg]);
+            break;
+        case OP_NEG:
+            JitLoadConst(jb, JIT_TMP, sign);
+            JitSse(jb, 0x66, 0x57, b, JIT_TMP);  // xorpd
+            break;
+        case OP_NOT:
+            JitSse(jb, 0x66, 0x57, JIT_ZERO, JIT_ZERO);
+            JitCompare(jb, one, b, JIT_ZERO, 0, false);  // cmpeqsd
+            break;
+        case OP_ADD:
+            JitSse(jb, 0xF2, 0x58, a, b);
+            --sp;
+            break;
+        case OP_SUB:
+            JitSse(jb, 0xF2, 0x5C, a, b);
+            --sp;
+            break;
+        case OP_MUL:
+            JitSse(jb, 0xF2, 0x59, a, b);
+            --sp;
+            break;
+        case OP_DIV:
+            JitZeroCheck(jb, b, PARSER_ERR_DIVIDE_BY_ZERO);
+            // fall through
+        case OP_DIVNZ:
+            JitSse(jb, 0xF2, 0x5E, a, b);
+            --sp;
+            break;
+        case OP_POW:
+            JitCall(jb, (const void *)pow, a, 2);
+            --sp;
+            break;
+        case OP_POWI:
+            JitSse(jb, 0x66, 0x28, JIT_TMP, b);
+            for (i = 1; i < ip->arg; ++i)
+                JitSse(jb, 0xF2, 0x59, b, JIT_TMP);
+            break;
+        case OP_MOD:
+            JitZeroCheck(jb, b, PARSER_ERR_MOD_BY_ZERO);
+            // fall through
+        case OP_MODNZ:
+            JitCall(jb, (const void *)fmod, a, 2);
+            --sp;
+            break;
+        case OP_LT:
+            JitCompare(jb, one, a, b, 1, false);
+            --sp;
+            break;
+        case OP_GT:
+            JitCompare(jb, one, a, b, 1, true);
+            --sp;
+            break;
+        case OP_LE:
+            JitCompare(jb, one, a, b, 2, false);
+            --sp;
+            break;
+        case OP_GE:
+            JitCompare(jb, one, a, b, 2, true);
+            --sp;
+            break;
+        case OP_EQ:
+            JitCompare(jb, one, a, b, 0, false);
+            --sp;
+            break;
+        case OP_NE:
+            JitCompare(jb, one, a, b, 4, false);
+            --sp;
+            break;
+        case OP_AND:
+        case OP_OR:
+            JitTruth(jb, a);
+            JitTruth(jb, b);
+            JitSse(jb, 0x66, ip->op == OP_AND ? 0x54 : 0x56, a, b);
+            JitLoadConst(jb, JIT_TMP, one);
+            JitSse(jb, 0x66, 0x54, a, JIT_TMP);
+            --sp;
+            break;
+        case OP_CALL1:
+            JitCall(jb, (const void *)fun_table[ip->arg].fun1, b, 1);
+            break;
+        case OP_CALL2:
+            JitCall(jb, (const void *)fun_table[ip->arg].fun2, a, 2);
+            --sp;
+            break;
+        case OP_CALL3:
+            JitCall(jb, (const void *)fun_table[ip->arg].fun3, sp - 3, 3);
+            sp -= 2;
+            break;
+        case OP_UCALL:
+            sp -= ctx->funs_[ip->arg].nargs;
+            JitUserCall(jb, &ctx->funs_[ip->arg], sp, ctx->funs_[ip->arg].nargs);
+            ++sp;
+            break;
+        case OP_ANDJ:   // false (but not NaN): 0, and on past the OP_AND
+            JitSse(jb, 0x66, 0x57, JIT_ZERO, JIT_ZERO);
+            JitSse(jb, 0x66, 0x2E, b, JIT_ZERO);    // ucomisd
+            j = JitShortJump(jb, 0x7A);             // jp
+            k = JitShortJump(jb, 0x75);             // jne
+            JitSse(jb, 0x66, 0x57, b, b);
+            JitJump(jb, 0xE9, ip->arg, sp);
+            JitLanding(jb, j);
+            JitLanding(jb, k);
+            break;
+        case OP_ORJ:    // true: 1, and on past the OP_OR
+            JitSse(jb, 0x66, 0x57, JIT_ZERO, JIT_ZERO);
+            JitSse(jb, 0x66, 0x2E, b, JIT_ZERO);
+            j = JitShortJump(jb, 0x7A);             // jp (NaN is true)
+            k = JitShortJump(jb, 0x74);             // je
+            JitLanding(jb, j);
+            JitLoadConst(jb, b, one);
+            JitJump(jb, 0xE9, ip->arg, sp);
+            JitLanding(jb, k);
+            break;
+        case OP_IFJ:
+            JitSse(jb, 0x66, 0x57, JIT_ZERO, JIT_ZERO);
+            JitSse(jb, 0x66, 0x2E, b, JIT_ZERO);
+            j = JitShortJump(jb, 0x7A);
+            JitJump(jb, 0x84, ip->arg, --sp);       // je false side
+            JitLanding(jb, j);
+            break;
+        case OP_ELSEJ:  // the false side starts where the condition was
+            JitJump(jb, 0xE9, ip->arg, sp);
+            sp = jb->label_sp[ip + 1 - ce->code];
+            break;
+        case OP_IFEND:
+            break;
+        case OP_TSTORE:
+            JitMovSpill(jb, 0x11, b, 8 * (JIT_REGS + ip->arg));
+            break;
+        case OP_TLOAD:
+            JitMovSpill(jb, 0x10, sp++, 8 * (JIT_REGS + ip->arg));
+            break;
+        default:
+            return false;
+        }
+    }
+    jb->offsets[ce->code_len] = (int)jb->len;
+
+    for (i = 0; i < jb->num_jumps; ++i) {  // all forward
+        int32_t rel = (int32_t)(jb->offsets[jb->jump_to[i]] -
+                                    (jb->jumps[i] + (int)sizeof(int32_t)));
+
+        memcpy(jb->code + jb->jumps[i], &rel, sizeof(rel));
+    }
+
+    for (i = 0; i < jb->num_exits; ++i) {
+        int32_t rel = (int32_t)(jb->len - (jb->exits[i] + sizeof(int32_t)));
+
+        memcpy(jb->code + jb->exits[i], &rel, sizeof(rel));
+    }
+    JitByte(jb, 0x48);                  // add rsp, frame
+    JitByte(jb, 0x81);
+    JitByte(jb, 0xC4);
+    JitInt32(jb, frame);
+    JitByte(jb, 0x5B);                  // pop rbx
+    JitByte(jb, 0xC3);                  // ret (result in xmm0)
+    return true;
+}
+
+// most bytes any one instruction of the program needs (a call saving and
+// restoring every register, and counting itself for the stats, or a 64th
+// power)
+#define JIT_MAX_INSTR 352
+
+static void JitCompile(COMPILED_EXPR *ce)
+{
+    JIT_BUF jb;
+    size_t pool, size;
+    double *consts;
+    void *mem;
+    int i, one, sign;
+
+    ce->native_failed = true;  // unless we get to the end
+    if (ce->max_stack > JIT_REGS)
+        return;
+
+    memset(&jb, 0, sizeof(jb));
+    jb.size = (size_t)(ce->code_len + 2) * JIT_MAX_INSTR;
+    jb.code = malloc(jb.size);
+    // each instruction refers to at most one constant
+    jb.fixups = malloc((ce->code_len + 1) * sizeof(int));
+    jb.fixup_const = malloc((ce->code_len + 1) * sizeof(int));
+    jb.exits = malloc((ce->code_len + 1) * sizeof(int));
+    jb.offsets = malloc((ce->code_len + 1) * sizeof(int));
+    jb.label_sp = malloc((ce->code_len + 1) * sizeof(int));
+    jb.jumps = malloc((ce->code_len + 1) * sizeof(int));
+    jb.jump_to = malloc((ce->code_len + 1) * sizeof(int));
+    one = ce->num_consts;       // extra constants after the pool
+    sign = ce->num_consts + 1;
+    if (jb.code && jb.fixups && jb.fixup_const && jb.exits && jb.offsets &&
+                jb.label_sp && jb.jumps && jb.jump_to &&
+                                        JitProgram(ce, &jb, one, sign)) {
+        pool = (jb.len + 15) & ~(size_t)15;
+        size = pool + (ce->num_consts + 2) * sizeof(double);
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) {
+            for (i = 0; i < jb.num_fixups; ++i) {
+                int32_t disp = (int32_t)(pool + jb.fixup_const[i] * sizeof(double)
+                                    - (jb.fixups[i] + sizeof(int32_t)));
+
+                memcpy(jb.code + jb.fixups[i], &disp, sizeof(disp));
+            }
+            memcpy(mem, jb.code, jb.len);
+            consts = (double *)((unsigned char *)mem + pool);
+            memcpy(consts, ce->consts, ce->num_consts * sizeof(double));
+            consts[one] = 1.0;
+            consts[sign] = -0.0;
+            if (mprotect(mem, size, PROT_READ | PROT_EXEC) == 0) {
+                ce->native = (double (*)(double *))mem;
+                ce->native_size = size;
+                ce->native_failed = false;
+            } else
+                munmap(mem, size);
+        }
+    }
+    free(jb.code);
+    free(jb.fixups);
+    free(jb.fixup_const);
+    free(jb.exits);
+    free(jb.offsets);
+    free(jb.label_sp);
+    free(jb.jumps);
+    free(jb.jump_to);
+}
+
+static void JitFree(COMPILED_EXPR *ce)
+{
+    if (ce->native)
+        munmap((void *)ce->native, ce->native_size);
+}
+
+#else // no native code for this system
+
+static void JitCompile(COMPILED_EXPR *ce)
+{
+    ce->native_failed = true;
+}
+
+static void JitFree(COMPILED_EXPR *ce)
+{
+}
+
+#endif // JIT_X86_64
+
+
+#endif // HAVE_JIT
+
+// run ce, with run-time errors going to err_ctx (normally ce->ctx)
+static double RunExpr(COMPILED_EXPR *ce, PARSER_CONTEXT *err_ctx)
+{
+    PARSER_CONTEXT *ctx = ce->ctx;
+    PARSER_CONTEXT *prev_ctx = cur_ctx_;
+    double v;
+#ifdef HAVE_STATS
+    unsigned long long start = StatsClock(), ns;
+#endif
+
+    err_ctx->err_ = PARSER_OK;  // default to NULL error string
+    cur_ctx_ = err_ctx;  // (where RunCompiled() and native code report)
+
+    if (ce->sym_generation != ctx->sym_generation_) {
+        runtime_error(err_ctx, PARSER_ERR_SYMBOLS_RESET, NULL, 0);
+        v = PARSE_ERROR;
+    } else {
+        if (ce->bind_generation != ctx->bind_generation_)
+            BindCompiled(ce);  // symbols were bound or unbound since
+#ifdef HAVE_JIT
+        if (!ce->native && !ce->native_failed && ctx->jit_threshold_ >= 0 &&
+                ++ce->runs >= (ctx->jit_threshold_ ? (unsigned)ctx->jit_threshold_
+                                                   : JIT_THRESHOLD))
+            JitCompile(ce);
+        if (ce->native)
+            v = ce->native(ctx->vars_rhs);
+        else
+#endif
+        v = RunCompiled(ce);
+        if (err_ctx->err_ != PARSER_OK)
+            v = sqrt(-1.0); // error, return NaN silently
+    }
+#ifdef HAVE_STATS
+    ns = StatsClock() - start;
+    CountEvals(&ce->stats_, 1, ns);
+    CountEvals(&ctx->stats_, 1, ns);
+    if (err_ctx->err_ != PARSER_OK) {
+        STAT_ADD(ce->stats_.errors[err_ctx->err_], 1);
+        STAT_ADD(ctx->stats_.errors[err_ctx->err_], 1);
+    }
+#endif
+    cur_ctx_ = prev_ctx;
+    return v;
+}
+
+double EvaluateCompiled(COMPILED_EXPR *ce)  // get result
+{
+    PARSER_CONTEXT *ctx = ce->ctx;
+    bool note = ctx->programs_ && ce->sym_generation == ctx->sym_generation_;
+    double v;
+    int i, slot;
+
+    ClockEnter(ctx);
+    for (i = 0; note && i < ce->num_stores; ++i)
+        ce->old[i] = *SymbolValue(ctx, ce->syms[ce->stores[i]]);
+    v = RunExpr(ce, ctx);
+    for (i = 0; note && i < ce->num_stores; ++i) {
+        slot = ce->syms[ce->stores[i]];
+        if (memcmp(&ce->old[i], SymbolValue(ctx, slot), sizeof(double)))
+            SymbolChanged(ctx, slot);  // (as SaveSymbol() would)
+    }
+    ClockLeave(ctx);
+    return v;
+}
+
+int SetJitThreshold_r(PARSER_CONTEXT *ctx, int runs)  // 0: never
+{
+    ctx->jit_threshold_ = runs > 0 ? runs : -1;
+#ifdef JIT_X86_64
+    return 1;
+#else
+    return 0;  // there's no native code for this system
+#endif
+}
+
+int SetJitThreshold(int runs)
+{
+    return SetJitThreshold_r(&default_ctx_, runs);
+}
+
+int CompiledIsNative(COMPILED_EXPR *ce)  // 1 if running native code
+{
+#ifdef HAVE_JIT
+    return ce->native != NULL;
+#else
+    return 0;
+#endif
+}
+
+int CompiledSymbolCount(COMPILED_EXPR *ce)  // symbols used by expression
+{
+    return ce->num_syms;
+}
+
+const char *CompiledSymbolName(COMPILED_EXPR *ce, int i)  // NULL if none
+{
+    if (i < 0 || i >= ce->num_syms ||
+                        ce->sym_generation != ce->ctx->sym_generation_)
+        return NULL;
+    return ce->ctx->vars_lhs[ce->syms[i]];
+}
+
+/******************************************************************************
+
+Saved compiled expressions
+--------------------------
+
+SaveCompiled() writes a compiled expression out as a block of bytes that
+LoadCompiled_r() turns back into one without parsing, so a program loading
+many expressions at startup can save them once and then just map the file.
+The block is a SAVED_HEADER, then the constant pool, the code, the symbols
+and functions the code refers to (by the offsets of their names in the
+name table that follows, as table slots and function numbers differ from
+one context, or build, to the next) and the names, each part starting 8
+byte aligned. Numbers are in the saving machine's byte order (the magic
+number tells), and jump targets are already instruction numbers, so loading
+only has to look up the names and copy the rest. The code refers to
+functions by their number in the saved table, and SAVED_VERSION must go up
+whenever the layout or the opcodes change. The checksum catches damaged
+blocks, but isn't a seal (anyone can work it out again), so LoadCompiled_r()
+checks the code as well: every reference must be in range, every jump go
+forward, every temp be stored before it's loaded, and the stack hold what
+each instruction needs, on every path (and when EvaluateBatch() does every
+part), within the saved depth, ending with the one result. Code that
+passes can't run outside the memory loading gives it, or loop.
+
+******************************************************************************/
+
+#define SAVED_MAGIC 0x43584541u  /* "AEXC" on little endian machines */
+#define SAVED_VERSION 1
+
+typedef struct _saved_header {
+    uint32_t magic;         // SAVED_MAGIC
+    uint32_t version;       // SAVED_VERSION
+    uint32_t size;          // bytes in all (a multiple of 8)
+    uint32_t check;         // SavedCheck() of the whole block
+    uint32_t code_len;
+    uint32_t num_consts;
+    uint32_t num_syms;
+    uint32_t num_funs;      // functions called
+    uint32_t names_len;     // bytes of names in the name table
+    uint32_t max_stack;
+    uint32_t num_temps;
+    uint32_t flags;         // SAVED_BY_ROW (keeps the header 8 byte aligned)
+} SAVED_HEADER;
+
+#define SAVED_BY_ROW 1  /* batch_by_row */
+
+typedef struct _saved_fun {
+    uint32_t name;          // offset in the name table
+    int32_t nargs;          // -1: built-in
+} SAVED_FUN;
+
+// FNV-1a (as HashName(), but a word at a time) of a block that starts with
+// h, its check taken as 0
+static uint32_t SavedCheck(const SAVED_HEADER *h, const unsigned char *block)
+{
+    SAVED_HEADER copy = *h;
+    uint32_t hash = 2166136261u, word;
+    size_t i;
+
+    copy.check = 0;
+    for (i = 0; i < h->size; i += sizeof(word)) {
+        memcpy(&word, i < sizeof(copy) ? (unsigned char *)&copy + i
+                                       : block + i, sizeof(word));
+        hash = (hash ^ word) * 16777619u;
+    }
+    return hash;
+}
+
+#define SAVED_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+// layout of a block with h's counts: byte offsets of each part
+typedef struct _saved_layout {
+    size_t consts, code, syms, funs, names, size;
+} SAVED_LAYOUT;
+
+static void SavedLayout(const SAVED_HEADER *h, SAVED_LAYOUT *lay)
+{
+    lay->consts = sizeof(SAVED_HEADER);
+    lay->code = lay->consts + (size_t)h->num_consts * sizeof(double);
+    lay->syms = lay->code + (size_t)h->code_len * 2 * sizeof(int32_t);
+    lay->funs = SAVED_ALIGN(lay->syms + (size_t)h->num_syms * sizeof(uint32_t));
+    lay->names = lay->funs + (size_t)h->num_funs * sizeof(SAVED_FUN);
+    lay->size = SAVED_ALIGN(lay->names + h->names_len);
+}
+
+static bool IsCall(int op)  // arg is a function number
+{
+    return op == OP_CALL1 || op == OP_CALL2 || op == OP_CALL3 || op == OP_UCALL;
+}
+
+// the name of the function ip calls
+static const char *CallName(COMPILED_EXPR *ce, const INSTR *ip)
+{
+    return ip->op == OP_UCALL ? ce->ctx->funs_[ip->arg].name
+                              : fun_table[ip->arg].name;
+}
+
+// save ce into buf (if size is big enough); returns bytes needed, 0 if ce's
+// symbols were reset since it was compiled (or it's too big to save)
+size_t SaveCompiled(COMPILED_EXPR *ce, void *buf, size_t size)
+{
+    PARSER_CONTEXT *ctx = ce->ctx;
+    SAVED_HEADER h;
+    SAVED_LAYOUT lay;
+    SAVED_FUN *funs;
+    unsigned char *out = buf;
+    size_t names_len = 0, n;
+    int32_t code[2];
+    uint32_t off;
+    int i, j;
+
+    if (ce->sym_generation != ctx->sym_generation_)
+        return 0;
+    memset(&h, 0, sizeof(h));
+    h.magic = SAVED_MAGIC;
+    h.version = SAVED_VERSION;
+    h.code_len = ce->code_len;
+    h.num_consts = ce->num_consts;
+    h.num_syms = ce->num_syms;
+    h.max_stack = ce->max_stack;
+    h.num_temps = ce->num_temps;
+    h.flags = ce->batch_by_row ? SAVED_BY_ROW : 0;
+    for (i = 0; i < ce->num_syms; ++i)
+        names_len += strlen(ctx->vars_lhs[ce->syms[i]]) + 1;
+    for (i = 0; i < ce->code_len; ++i) {  // each call refers to a new entry
+        if (IsCall(ce->code[i].op)) {
+            ++h.num_funs;
+            names_len += strlen(CallName(ce, &ce->code[i])) + 1;
+        }
+    }
+    if (names_len > UINT32_MAX / 2)
+        return 0;
+    h.names_len = (uint32_t)names_len;
+    SavedLayout(&h, &lay);
+    if (lay.size > UINT32_MAX)
+        return 0;
+    h.size = (uint32_t)lay.size;
+    if (size < lay.size)
+        return lay.size;
+
+    memset(out, 0, lay.size);  // (so the padding is the same every time)
+    memcpy(out + lay.consts, ce->consts, ce->num_consts * sizeof(double));
+    off = 0;
+    for (i = 0; i < ce->num_syms; ++i) {
+        const char *name = ctx->vars_lhs[ce->syms[i]];
+
+        n = strlen(name) + 1;
+        memcpy(out + lay.names + off, name, n);
+        memcpy(out + lay.syms + i * sizeof(uint32_t), &off, sizeof(off));
+        off += (uint32_t)n;
+    }
+    funs = (SAVED_FUN *)(out + lay.funs);
+    for (i = j = 0; i < ce->code_len; ++i) {
+        const INSTR *ip = &ce->code[i];
+
+        code[0] = ip->op == OP_LOADP ? OP_LOAD :  // (bindings aren't saved)
+                  ip->op == OP_STOREP ? OP_STORE : ip->op;
+        code[1] = ip->arg;
+        if (ip->op == OP_CLOCK) {  // (nor is the clock mode)
+            code[0] = ip->arg ? OP_TIMEMS : OP_TIME;
+            code[1] = 0;
+        }
+        if (IsCall(ip->op)) {
+            SAVED_FUN sf;
+
+            n = strlen(CallName(ce, ip)) + 1;
+            memcpy(out + lay.names + off, CallName(ce, ip), n);
+            sf.name = off;
+            sf.nargs = ip->op == OP_UCALL ? ctx->funs_[ip->arg].nargs : -1;
+            memcpy(&funs[j], &sf, sizeof(sf));
+            off += (uint32_t)n;
+            code[1] = j++;
+        }
+        memcpy(out + lay.code + i * sizeof(code), code, sizeof(code));
+    }
+    h.check = SavedCheck(&h, out);
+    memcpy(out, &h, sizeof(h));
+    return lay.size;
+}
+
+// the name at offset off of the name table (NULL if it isn't in it)
+static const char *SavedName(const unsigned char *in, const SAVED_LAYOUT *lay,
+                             uint32_t off)
+{
+    const char *name = (const char *)in + lay->names + off;
+
+    if (off >= lay->size - lay->names ||
+                    !memchr(name, '\0', lay->size - lay->names - off))
+        return NULL;
+    return name;
+}
+
+// is saved instruction ip (of h's expression, with function numbers
+// already looked up) within range, and one that Compile() makes?
+static bool SavedInstrOk(PARSER_CONTEXT *ctx, const SAVED_HEADER *h,
+                         const INSTR *ip)
+{
+    switch (ip->op) {
+    case OP_CONST:
+        return ip->arg >= 0 && (uint32_t)ip->arg < h->num_consts;
+    case OP_LOAD:
+    case OP_STORE:
+        return ip->arg >= 0 && (uint32_t)ip->arg < h->num_syms;
+    case OP_TSTORE:
+    case OP_TLOAD:
+        return ip->arg >= 0 && (uint32_t)ip->arg < h->num_temps;
+    case OP_ANDJ:
+    case OP_ORJ:
+    case OP_IFJ:
+    case OP_ELSEJ:
+        return ip->arg >= 0 && (uint32_t)ip->arg <= h->code_len;
+    case OP_CALL1:
+    case OP_CALL2:
+    case OP_CALL3:  // (CallNode() always makes mod() an OP_MOD)
+        return ip->arg >= 0 && ip->arg < NUM_FUNS &&
+                    fun_table[ip->arg].args == ip->op - OP_CALL1 + 1 &&
+                    (ip->op != OP_CALL2 || fun_table[ip->arg].fun2 != DoFmod);
+    case OP_UCALL:
+        return ip->arg >= 0 && ip->arg < ctx->num_funs_;
+    case OP_POWI:
+        return ip->arg > 0 && ip->arg <= 64;  // (as Optimize() makes them)
+    case OP_COMMA:
+    case OP_ARG:
+    case OP_LOADP:
+    case OP_STOREP:
+    case OP_CLOCK:
+        return false;  // (never saved)
+    default:
+        return ip->op >= 0 && ip->op < OP_LOADP;
+    }
+}
+
+// operands instruction ip takes off the stack (*push: values it leaves
+// there), as RunCompiled() runs it or (batch) EvaluateBatch() does
+static int SavedStackUse(PARSER_CONTEXT *ctx, const INSTR *ip, bool batch,
+                         int *push)
+{
+    *push = 1;
+    switch (ip->op) {
+    case OP_CONST:
+    case OP_LOAD:
+    case OP_TIME:
+    case OP_TIMEMS:
+    case OP_TLOAD:
+        return 0;
+    case OP_STORE:
+    case OP_TSTORE:
+    case OP_NEG:
+    case OP_NOT:
+    case OP_POWI:
+    case OP_CALL1:
+    case OP_ANDJ:
+    case OP_ORJ:
+        return 1;
+    case OP_POP:
+        *push = 0;
+        return 1;
+    case OP_IFJ:  // (pops the condition, unless every part is done)
+        *push = batch;
+        return 1;
+    case OP_ELSEJ:
+        *push = 0;
+        return 0;
+    case OP_IFEND:  // (picks a side, if every part is done)
+        *push = batch;
+        return batch ? 3 : 0;
+    case OP_CALL3:
+        return 3;
+    case OP_UCALL:
+        return ctx->funs_[ip->arg].nargs;
+    default:
+        return 2;
+    }
+}
+
+// note that code[to] is reached with d values on the stack; returns false
+// if it's reached with another depth too
+static bool SavedReach(int *depth, int to, int d)
+{
+    if (depth[to] >= 0 && depth[to] != d)
+        return false;
+    depth[to] = d;
+    return true;
+}
+
+// load an expression saved by SaveCompiled() from the size bytes at buf,
+// using ctx's symbols and functions; used (if not NULL) gets the bytes it
+// took. Returns NULL if buf doesn't hold one (see GetParserErr()).
+COMPILED_EXPR *LoadCompiled_r(PARSER_CONTEXT *ctx, const void *buf, size_t size,
+                              size_t *used)
+{
+    const unsigned char *in = buf;
+    COMPILED_EXPR *ce;
+    SAVED_HEADER h;
+    SAVED_LAYOUT lay;
+    SAVED_FUN sf;
+    const char *name;
+    USER_FUN *uf;
+    FUN_ENTRY *f;
+    int32_t code[2];
+    uint32_t off;
+    int *depth = NULL;  // stack depth at each instruction (-1: not reached)
+    bool *stored;       // (after it) temps stored already
+    int i, j, d, push, flat = 0;  // (flat: depth doing every part)
+
+    ctx->err_ = PARSER_OK;
+    if (used)
+        *used = 0;
+    if (size < sizeof(h))
+        goto bad;
+    memcpy(&h, in, sizeof(h));
+    if (h.magic != SAVED_MAGIC || h.version != SAVED_VERSION || h.size > size)
+        goto bad;
+    if (h.code_len > h.size / 8 || h.num_consts > h.size / 8 ||
+                    h.num_syms > h.size / 4 || h.num_funs > h.size / 8 ||
+                    h.names_len > h.size)
+        goto bad;  // (so the layout can't overflow)
+    SavedLayout(&h, &lay);
+    if (lay.size != h.size || h.max_stack < 1 || h.max_stack > h.code_len + 1 ||
+                h.num_temps > h.code_len || SavedCheck(&h, in) != h.check)
+        goto bad;
+
+    SaveSymbol_r(ctx, "pi", M_PI);  // (as CompileExpr() does)
+    SaveSymbol_r(ctx, "e",  M_E);
+    ctx->pi_slot_ = SymbolSlot(ctx, "pi", 2);
+    ctx->e_slot_ = SymbolSlot(ctx, "e", 1);
+    if (ctx->err_ != PARSER_OK)
+        return NULL;
+    if ((ce = calloc(1, sizeof(COMPILED_EXPR))) == NULL) {
+        runtime_error(ctx, PARSER_ERR_NO_MEMORY, NULL, 0);
+        return NULL;
+    }
+    ce->ctx = ctx;
+    ce->sym_generation = ctx->sym_generation_;
+    ce->code = malloc((h.code_len + 1) * sizeof(INSTR));
+    ce->consts = malloc((h.num_consts + 1) * sizeof(double));
+    ce->syms = malloc((h.num_syms + 1) * sizeof(int));
+    ce->stack = malloc((h.max_stack + h.num_temps) * sizeof(double));
+    depth = malloc((h.code_len + 1 + h.num_temps + 1) * sizeof(int));
+    if (!ce->code || !ce->consts || !ce->syms || !ce->stack || !depth) {
+        FreeCompiled(ce);
+        free(depth);
+        runtime_error(ctx, PARSER_ERR_NO_MEMORY, NULL, 0);
+        return NULL;
+    }
+    for (i = 0; i <= (int)h.code_len; ++i)
+        depth[i] = i ? -1 : 0;
+    stored = (bool *)(depth + h.code_len + 1);
+    memset(stored, 0, (h.num_temps + 1) * sizeof(bool));
+    ce->code_len = h.code_len;
+    ce->num_consts = h.num_consts;
+    ce->num_syms = h.num_syms;
+    ce->max_stack = h.max_stack;
+    ce->num_temps = h.num_temps;
+    ce->temps = ce->stack + ce->max_stack;
+    ce->batch_by_row = (h.flags & SAVED_BY_ROW) != 0;
+    memcpy(ce->consts, in + lay.consts, h.num_consts * sizeof(double));
+
+    for (i = 0; i < ce->num_syms; ++i) {
+        memcpy(&off, in + lay.syms + i * sizeof(uint32_t), sizeof(off));
+        if ((name = SavedName(in, &lay, off)) == NULL)
+            goto bad_ce;
+        if ((ce->syms[i] = SymbolSlot(ctx, name, (int)strlen(name))) < 0) {
+            FreeCompiled(ce);
+            free(depth);
+            return NULL;  // (out of memory)
+        }
+    }
+    for (i = 0; i < ce->code_len; ++i) {
+        INSTR *ip = &ce->code[i];
+
+        memcpy(code, in + lay.code + i * sizeof(code), sizeof(code));
+        ip->op = code[0];
+        ip->arg = code[1];
+        if (IsCall(ip->op)) {  // saved function number -> this context's
+            if (code[1] < 0 || (uint32_t)code[1] >= h.num_funs)
+                goto bad_ce;
+            memcpy(&sf, in + lay.funs + code[1] * sizeof(sf), sizeof(sf));
+            if ((name = SavedName(in, &lay, sf.name)) == NULL)
+                goto bad_ce;
+            j = (int)strlen(name);
+            if (ip->op == OP_UCALL) {
+                uf = FindUserFun(ctx, name, j);
+                if (!uf || uf->nargs != sf.nargs) {
+                    runtime_error(ctx, PARSER_ERR_UNKNOWN_FUNCTION, name, 0);
+                    FreeCompiled(ce);
+                    free(depth);
+                    return NULL;
+                }
+                ip->arg = (int)(uf - ctx->funs_);
+                if (!(uf->flags & (PARSER_FUN_PURE | PARSER_FUN_VECTOR)))
+                    ce->batch_by_row = true;  // (as GenStep() decides)
+            } else {
+                if ((f = LookupFun(name, j)) == NULL) {
+                    runtime_error(ctx, PARSER_ERR_UNKNOWN_FUNCTION, name, 0);
+                    FreeCompiled(ce);
+                    free(depth);
+                    return NULL;
+                }
+                ip->arg = (int)(f - fun_table);
+            }
+        }
+        if (!SavedInstrOk(ctx, &h, ip))
+            goto bad_ce;
+
+        // the stack, as run (jumps go forward, so every way here is known)
+        j = SavedStackUse(ctx, ip, false, &push);
+        if ((d = depth[i]) < j || (d += push - j) > (int)h.max_stack)
+            goto bad_ce;  // (depth[i] < 0: never reached)
+        if ((ip->op == OP_ANDJ || ip->op == OP_ORJ || ip->op == OP_IFJ ||
+                                                        ip->op == OP_ELSEJ) &&
+                (ip->arg <= i || !SavedReach(depth, ip->arg, d)))
+            goto bad_ce;
+        if (ip->op != OP_ELSEJ && !SavedReach(depth, i + 1, d))
+            goto bad_ce;
+        // and doing every part, as EvaluateBatch() does
+        j = SavedStackUse(ctx, ip, true, &push);
+        if (flat < j || (flat += push - j) > (int)h.max_stack)
+            goto bad_ce;
+        if (ip->op == OP_TSTORE)
+            stored[ip->arg] = true;
+        else if (ip->op == OP_TLOAD && !stored[ip->arg])
+            goto bad_ce;
+    }
+    if (depth[ce->code_len] != 1 || flat != 1)
+        goto bad_ce;  // (the result, and nothing else, left)
+    free(depth);
+    depth = NULL;
+
+    BindCompiled(ce);
+    if (!ListStores(ce) || !WarmScratch(ctx, BatchStateSize(ce))) {
+        // (as Compile_r() does)
+        FreeCompiled(ce);
+        runtime_error(ctx, PARSER_ERR_NO_MEMORY, NULL, 0);
+        return NULL;
+    }
+    if (used)
+        *used = lay.size;
+    return ce;
+
+bad_ce:
+    FreeCompiled(ce);
+    free(depth);
+bad:
+    runtime_error(ctx, PARSER_ERR_BAD_SAVED, NULL, 0);
+    return NULL;
+}
+
+COMPILED_EXPR *LoadCompiled(const void *buf, size_t size, size_t *used)
+{
+    return LoadCompiled_r(&default_ctx_, buf, size, used);
+}
+
+/******************************************************************************
+
+Expression cache
+----------------
+
+So that callers who only have the expression text still get the benefit
+of compiling, Evaluate() keeps the compiled form of the expressions it is
+given, looked up by their text (with a hash table, like the symbol table).
+An expression is only compiled the second time it is seen, so one-off
+expressions cost little more than before. The cache is limited to a number
+of entries and a number of bytes (set by SetEvalCache_r()), and the least
+recently used entries are dropped to keep within them. Expressions that
+don't compile are remembered too, so they go straight to the parser (which
+reports the error exactly as before).
+
+Compiled expressions refer to symbol table slots, so ResetSymbols_r()
+makes them all useless; the cache is emptied the next time it is used.
+
+******************************************************************************/
+
+#define EVAL_CACHE_ENTRIES 256        /* default limits */
+#define EVAL_CACHE_BYTES (1024 * 1024)
+
+struct _cache_entry {
+    CACHE_ENTRY *next;      // in hash bucket
+    CACHE_ENTRY *newer;     // in most recently used list
+    CACHE_ENTRY *older;
+    COMPILED_EXPR *ce;      // NULL until seen twice (or if parse_only)
+    bool parse_only;        // doesn't compile, or is too big to keep
+    unsigned hash;
+    size_t bytes;           // memory used, including text
+    char text[1];           // expression (allocated to fit)
+};
+
+// memory used by a compiled expression (roughly)
+static size_t CompiledSize(COMPILED_EXPR *ce)
+{
+    return sizeof(COMPILED_EXPR) + ce->code_len * sizeof(INSTR) +
+           ce->num_consts * sizeof(double) + ce->num_syms * sizeof(int) +
+           ce->max_stack * sizeof(double);
+}
+
+static void Unlink(EVAL_CACHE *cache, CACHE_ENTRY *entry)  // from LRU list
+{
+    if (entry->newer) entry->newer->older = entry->older;
+    else cache->newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer;
+    else cache->oldest = entry->newer;
+}
+
+static void MakeNewest(EVAL_CACHE *cache, CACHE_ENTRY *entry)
+{
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest) cache->newest->newer = entry;
+    else cache->oldest = entry;
+    cache->newest = entry;
+}
+
+static void DropEntry(EVAL_CACHE *cache, CACHE_ENTRY *entry)
+{
+    CACHE_ENTRY **p = &cache->buckets[entry->hash & (cache->num_buckets - 1)];
+
+    while (*p != entry)
+        p = &(*p)->next;
+    *p = entry->next;
+    Unlink(cache, entry);
+    --cache->entries;
+    cache->bytes -= entry->bytes;
+    FreeCompiled(entry->ce);
+    free(entry);
+}
+
+static void FlushCache(EVAL_CACHE *cache)
+{
+    while (cache->oldest)
+        DropEntry(cache, cache->oldest);
+}
+
+// drop least recently used entries until within the limits
+static void TrimCache(EVAL_CACHE *cache)
+{
+    while (cache->oldest && (cache->entries > cache->max_entries ||
+                             cache->bytes > cache->max_bytes)) {
+        DropEntry(cache, cache->oldest);
+        ++cache->evictions;
+    }
+}
+
+// compiled form of expr, if it's been seen before (and compiles)
+static COMPILED_EXPR *CachedCompile(PARSER_CONTEXT *ctx, const char *expr)
+{
+    EVAL_CACHE *cache = &ctx->cache_;
+    CACHE_ENTRY *entry, **bucket;
+    COMPILED_EXPR *ce;
+    unsigned hash;
+    size_t len;
+
+    if (!cache->configured) {
+        cache->max_entries = EVAL_CACHE_ENTRIES;
+        cache->max_bytes = EVAL_CACHE_BYTES;
+        cache->configured = true;
+    }
+    if (cache->max_entries <= 0)
+        return NULL;
+    if (cache->generation != ctx->sym_generation_) {  // symbols were reset
+        FlushCache(cache);
+        cache->generation = ctx->sym_generation_;
+    }
+    if (!cache->buckets) {  // at least twice the entries, so chains are short
+        unsigned n = 16;
+
+        while (n < 2u * (unsigned)cache->max_entries)
+            n *= 2;
+        if ((cache->buckets = calloc(n, sizeof(CACHE_ENTRY *))) == NULL)
+            return NULL;
+        cache->num_buckets = n;
+    }
+
+    hash = HashName(expr, strlen(expr));
+    bucket = &cache->buckets[hash & (cache->num_buckets - 1)];
+    for (entry = *bucket; entry; entry = entry->next) {
+        if (entry->hash == hash && !strcmp(entry->text, expr))
+            break;
+    }
+
+    if (entry) {
+        Unlink(cache, entry);
+        MakeNewest(cache, entry);
+        if (entry->ce) {
+            ++cache->hits;
+            return entry->ce;
+        }
+        ++cache->misses;
+        if (entry->parse_only)
+            return NULL;
+        // second time: worth compiling
+        if ((ce = CompileExpr(ctx, expr)) == NULL ||
+                            entry->bytes + CompiledSize(ce) > cache->max_bytes) {
+            FreeCompiled(ce);
+            entry->parse_only = true;
+            return NULL;
+        }
+        entry->ce = ce;
+        entry->bytes += CompiledSize(ce);
+        cache->bytes += CompiledSize(ce);
+        TrimCache(cache);  // (this entry is newest, and fits on its own)
+        return ce;
+    }
+
+    // first time: just remember it
+    ++cache->misses;
+    len = strlen(expr);
+    if ((entry = malloc(sizeof(CACHE_ENTRY) + len)) == NULL)
+        return NULL;
+    memcpy(entry->text, expr, len + 1);
+    entry->ce = NULL;
+    entry->parse_only = false;
+    entry->hash = hash;
+    entry->bytes = sizeof(CACHE_ENTRY) + len;
+    entry->next = *bucket;
+    *bucket = entry;
+    MakeNewest(cache, entry);
+    ++cache->entries;
+    cache->bytes += entry->bytes;
+    TrimCache(cache);
+    return NULL;
+}
+
+void SetEvalCache_r(PARSER_CONTEXT *ctx, int max_entries, size_t max_bytes)
+{
+    EVAL_CACHE *cache = &ctx->cache_;
+
+    FlushCache(cache);  // (the hash table is sized for the old limit)
+    free(cache->buckets);
+    cache->buckets = NULL;
+    cache->configured = true;
+    cache->max_entries = max_entries;
+    cache->max_bytes = max_bytes;
+}
+
+void SetEvalCache(int max_entries, size_t max_bytes)  // 0 entries: off
+{
+    SetEvalCache_r(&default_ctx_, max_entries, max_bytes);
+}
+
+void GetEvalCacheStats_r(PARSER_CONTEXT *ctx, EVAL_CACHE_STATS *stats)
+{
+    stats->hits = ctx->cache_.hits;
+    stats->misses = ctx->cache_.misses;
+    stats->evictions = ctx->cache_.evictions;
+    stats->entries = ctx->cache_.entries;
+    stats->bytes = ctx->cache_.bytes;
+}
+
+void GetEvalCacheStats(EVAL_CACHE_STATS *stats)
+{
+    GetEvalCacheStats_r(&default_ctx_, stats);
+}
+
+/******************************************************************************
+
+Thread pool
+-----------
+
+A pool's threads wait for RunPool() to give them a job, which they run at
+the same time as the thread that called RunPool(); it returns once they've
+all finished. Jobs share out their own work (eg. by taking chunks from a
+counter with __sync_fetch_and_add()), each thread knowing which it is by
+its worker number. The threads are only woken for a job and are otherwise
+idle, so a pool costs nothing between jobs.
+
+******************************************************************************/
+
+#ifdef HAVE_THREADS
+
+static void *PoolThread(void *arg)
+{
+    POOL_THREAD *t = arg;
+    THREAD_POOL *pool = t->pool;
+    unsigned round = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->round == round && !pool->quit)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->quit)
+            break;
+        round = pool->round;
+        pthread_mutex_unlock(&pool->lock);
+        pool->job(pool->arg, t->worker);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void StopPool(THREAD_POOL *pool)
+{
+    int i;
+
+    if (!pool->threads)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->num_threads; ++i)
+        pthread_join(pool->threads[i].thread, NULL);
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->num_threads = 0;
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+}
+
+// start n threads (besides the one calling RunPool()); false if they
+// couldn't be
+static bool StartPool(THREAD_POOL *pool, int n)
+{
+    int i;
+
+    if ((pool->threads = calloc(n, sizeof(POOL_THREAD))) == NULL)
+        return false;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->round = 0;
+    pool->quit = false;
+    for (i = 0; i < n; ++i) {
+        pool->threads[i].pool = pool;
+        pool->threads[i].worker = i + 1;
+        if (pthread_create(&pool->threads[i].thread, NULL, PoolThread,
+                           &pool->threads[i]) != 0) {
+            pool->num_threads = i;  // (the ones running)
+            StopPool(pool);
+            return false;
+        }
+    }
+    pool->num_threads = n;
+    return true;
+}
+
+// run job(arg, worker) on every thread of the pool and this one (worker 0)
+static void RunPool(THREAD_POOL *pool, POOL_JOB job, void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->arg = arg;
+    ++pool->round;
+    pool->busy = pool->num_threads;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    job(arg, 0);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+#endif // HAVE_THREADS
+
+/******************************************************************************
+
+Batch evaluation
+----------------
+
+EvaluateBatch() applies a compiled expression to every row of a set of
+input columns. Rather than running the whole program once per row, it runs
+each instruction over a block of BATCH_BLOCK rows at a time, so the
+interpreter dispatch is paid once per block and each operator becomes a
+simple loop. The common operators and functions are done by hand-written
+vector kernels (see simd.c) for the best instruction set the CPU supports.
+
+The operand stack holds pointers to columns. Symbols are pushed by pointing
+at their column (no copying); constants and operator results are written
+to the column owned by their stack entry.
+
+Symbol i of the expression (see CompiledSymbolName()) reads columns[i]; if
+that is NULL, the symbol's current value is used for every row. Assignments
+only affect the rest of the row they are made in, and the symbol table is
+left unchanged. Rows with a run-time error (eg. divide by zero) get NaN.
+
+Functions added by AddFunction_r() are called for each row of the block,
+or once for the whole block if they have a batch version. If any of them
+isn't pure or PARSER_FUN_VECTOR, the rows are run one at a time instead.
+Short-circuit jumps are ignored (both sides are done, and the right one is
+picked for each row), unless a side that might be skipped could have side
+effects or errors, in which case the rows are run one at a time too.
+
+With SetBatchThreads_r(), a large batch is shared out among the context's
+thread pool, BATCH_CHUNK rows at a time. Each thread has its own stack
+columns and writes its own part of out (whole blocks, so separate cache
+lines if out is aligned); the compiled expression is only read. Each keeps
+the first error of its earliest chunk, so the error reported is the one
+for the lowest row in error, as it would be without threads.
+
+******************************************************************************/
+
+#define BATCH_BLOCK 256  /* rows per column-at-a-time block */
+#define BATCH_CHUNK (16 * BATCH_BLOCK)  /* rows a thread takes at a time */
+
+typedef struct _batch_state {
+    const BATCH_KERNELS *kernels;
+    const double **col;     // operand stack (columns)
+    double *stack;          // storage for stack columns
+    const double **sym;     // current column of each symbol
+    const double **input;   // input column of each symbol (for this block)
+    double *work;           // writable column for each assigned symbol
+    double *temps;          // column for each temp
+    bool *stored;           // symbol is assigned to by the expression
+    unsigned char *err;     // error code of each row (or 0)
+    enum ParserErrCode first_err;  // of the rows run (PARSER_OK: none)
+    size_t row;             // batch row the block starts at
+    unsigned long long rng_seed;   // ctx's generator (see simd.h), and the
+    unsigned long long rng_first;  // value of it row 0 starts with
+    int rng_step;           // values each row takes (its rand()s, percent()s)
+} BATCH_STATE;
+
+#define STACK_COL(i) (bs->stack + (size_t)(i) * BATCH_BLOCK)
+
+static void SetBatchErr(PARSER_CONTEXT *ctx, enum ParserErrCode code)
+{
+    runtime_error(ctx, code, NULL, 0);  // reports the first error only
+}
+
+static void BlockErr(BATCH_STATE *bs, enum ParserErrCode code)
+{
+    if (bs->first_err == PARSER_OK)
+        bs->first_err = code;
+}
+
+// run program over rows [0, n) of the block, leaving result in bs->col[0]
+static void RunBatchBlock(COMPILED_EXPR *ce, BATCH_STATE *bs, int n)
+{
+    PARSER_CONTEXT *ctx = ce->ctx;
+    const BATCH_KERNELS *k = bs->kernels;
+    const INSTR *ip = ce->code;
+    const INSTR *end = ip + ce->code_len;
+    const double **col = bs->col;
+    const double *a, *b, *c;
+    double *dst, t, args[PARSER_MAX_ARGS];
+    int sp = 0;  // next free operand stack entry
+    int i, j, nargs;
+    bool bad;
+    USER_FUN *uf;
+    // generator value of the next rand() or percent() in the block's first
+    // row (each row takes rng_step, as it would run one at a time)
+    unsigned long long rng = bs->rng_first + bs->row * bs->rng_step;
+
+    for (i = 0; i < ce->num_syms; ++i)
+        bs->sym[i] = bs->input[i];
+
+    for (; ip < end; ++ip) {
+        switch (ip->op) {
+        case OP_CONST:
+            t = ce->consts[ip->arg];
+            dst = STACK_COL(sp);
+            for (i = 0; i < n; ++i) dst[i] = t;
+            col[sp++] = dst;
+            continue;
+        case OP_LOAD:
+        case OP_LOADP:
+            if (bs->stored[ip->arg]) {  // may change, so take a copy
+                dst = STACK_COL(sp);
+                memcpy(dst, bs->sym[ip->arg], n * sizeof(double));
+                col[sp++] = dst;
+            } else
+                col[sp++] = bs->sym[ip->arg];
+            continue;
+        case OP_STORE:
+        case OP_STOREP:
+            dst = bs->work + (size_t)ip->arg * BATCH_BLOCK;
+            memcpy(dst, col[sp - 1], n * sizeof(double));
+            bs->sym[ip->arg] = dst;
+            continue;
+        case OP_POP:
+            --sp;
+            continue;
+        case OP_TSTORE:
+            memcpy(bs->temps + (size_t)ip->arg * BATCH_BLOCK, col[sp - 1],
+                   n * sizeof(double));
+            continue;
+        case OP_TLOAD:
+            col[sp++] = bs->temps + (size_t)ip->arg * BATCH_BLOCK;
+            continue;
+        case OP_ANDJ:   // all the parts are done
+        case OP_ORJ:
+        case OP_IFJ:
+        case OP_ELSEJ:
+            continue;
+        case OP_TIME:
+        case OP_TIMEMS:
+        case OP_CLOCK:
+            // live clock is sampled once per block
+            t = ClockValue(ctx, ip->op == OP_CLOCK ? ip->arg
+                                                   : ip->op == OP_TIMEMS);
+            dst = STACK_COL(sp);
+            for (i = 0; i < n; ++i) dst[i] = t;
+            col[sp++] = dst;
+            continue;
+        case OP_UCALL:
+            uf = &ctx->funs_[ip->arg];
+            STAT_ADD(*uf->calls, n);
+            STAT_ADD(ce->stats_.calls, n);
+            sp -= uf->nargs;
+            dst = STACK_COL(sp);
+            if (uf->batch)
+                uf->batch(col + sp, n, dst, uf->data);
+            else {
+                for (i = 0; i < n; ++i) {
+                    for (j = 0; j < uf->nargs; ++j)
+                        args[j] = col[sp + j][i];
+                    dst[i] = uf->fun(args, uf->data);
+                }
+            }
+            col[sp++] = dst;
+            continue;
+        }
+
+        // operators replace their first operand with the result
+        switch (ip->op) {
+        case OP_NEG:
+        case OP_NOT:
+        case OP_POWI:
+        case OP_CALL1:
+            nargs = 1;
+            break;
+        case OP_CALL3:
+        case OP_IFEND:
+            nargs = 3;
+            break;
+        default:
+            nargs = 2;
+            break;
+        }
+        sp -= nargs - 1;
+        dst = STACK_COL(sp - 1);
+        a = col[sp - 1];
+        if (ip->op == OP_CALL1 || ip->op == OP_CALL2 || ip->op == OP_CALL3) {
+            STAT_ADD(ctx->fun_calls_[ip->arg], n);
+            STAT_ADD(ce->stats_.calls, n);
+        }
+        b = nargs > 1 ? col[sp] : NULL;
+        c = nargs > 2 ? col[sp + 1] : NULL;
+        col[sp - 1] = dst;
+
+        switch (ip->op) {
+        case OP_NEG:
+            k->neg(dst, a, n);
+            break;
+        case OP_NOT:
+            k->lnot(dst, a, n);
+            break;
+        case OP_ADD:
+            k->add(dst, a, b, n);
+            break;
+        case OP_SUB:
+            k->sub(dst, a, b, n);
+            break;
+        case OP_MUL:
+            k->mul(dst, a, b, n);
+            break;
+        case OP_DIV:
+            if (k->div(dst, a, b, n)) {  // (rare) find the rows with errors
+                for (i = 0; i < n; ++i)
+                    if (b[i] == 0.0 && !bs->err[i])
+                        bs->err[i] = PARSER_ERR_DIVIDE_BY_ZERO;
+                BlockErr(bs, PARSER_ERR_DIVIDE_BY_ZERO);
+            }
+            break;
+        case OP_DIVNZ:
+            k->fdiv(dst, a, b, n);
+            break;
+        case OP_MOD:
+            bad = false;
+            for (i = 0; i < n; ++i) {
+                if (b[i] == 0.0) {
+                    if (!bs->err[i])
+                        bs->err[i] = PARSER_ERR_MOD_BY_ZERO;
+                    bad = true;
+                }
+                dst[i] = fmod(a[i], b[i]);
+            }
+            if (bad)
+                BlockErr(bs, PARSER_ERR_MOD_BY_ZERO);
+            break;
+        case OP_MODNZ:
+            for (i = 0; i < n; ++i) dst[i] = fmod(a[i], b[i]);
+            break;
+        case OP_POW:
+            for (i = 0; i < n; ++i) dst[i] = pow(a[i], b[i]);
+            break;
+        case OP_POWI:  // (x*x*x... as PowInt(), unless dst is x)
+            if (ip->arg == 2 || dst != a) {
+                k->mul(dst, a, a, n);
+                for (i = 2; i < ip->arg; ++i)
+                    k->mul(dst, dst, a, n);
+            } else
+                for (i = 0; i < n; ++i) dst[i] = PowInt(a[i], ip->arg);
+            break;
+        case OP_LT:
+            k->lt(dst, a, b, n);
+            break;
+        case OP_GT:
+            k->gt(dst, a, b, n);
+            break;
+        case OP_LE:
+            k->le(dst, a, b, n);
+            break;
+        case OP_GE:
+            k->ge(dst, a, b, n);
+            break;
+        case OP_EQ:
+            k->eq(dst, a, b, n);
+            break;
+        case OP_NE:
+            k->ne(dst, a, b, n);
+            break;
+        case OP_AND:
+            k->land(dst, a, b, n);
+            break;
+        case OP_OR:
+            k->lor(dst, a, b, n);
+            break;
+        case OP_CALL1:
+            {
+                double (*fun)(double) = fun_table[ip->arg].fun1;
+
+                if (fun == sqrt)
+                    k->vsqrt(dst, a, n);
+                else if (fun == fabs)
+                    k->vfabs(dst, a, n);
+                else if (fun == floor)
+                    k->vfloor(dst, a, n);
+                else if (fun == ceil)
+                    k->vceil(dst, a, n);
+                else if (fun == DoInt)
+                    k->vint(dst, a, n);
+                else if (fun == DoRandom)
+                    k->vrand(dst, a, n, bs->rng_seed, rng++, bs->rng_step);
+                else if (fun == DoPercent)
+                    k->vpercent(dst, a, n, bs->rng_seed, rng++, bs->rng_step);
+                else
+                    for (i = 0; i < n; ++i) dst[i] = fun(a[i]);
+            }
+            break;
+        case OP_CALL2:
+            {
+                double (*fun)(double, double) = fun_table[ip->arg].fun2;
+
+                if (fun == DoMin)
+                    k->vmin(dst, a, b, n);
+                else if (fun == DoMax)
+                    k->vmax(dst, a, b, n);
+                else
+                    for (i = 0; i < n; ++i) dst[i] = fun(a[i], b[i]);
+            }
+            break;
+        case OP_CALL3:
+            {
+                double (*fun)(double, double, double) = fun_table[ip->arg].fun3;
+
+                if (fun == DoIf)
+                    k->vif(dst, a, b, c, n);
+                else
+                    for (i = 0; i < n; ++i) dst[i] = fun(a[i], b[i], c[i]);
+            }
+            break;
+        case OP_IFEND:
+            k->vif(dst, a, b, c, n);
+            break;
+        }
+    }
+}
+
+// rand()s and percent()s in ce (the most generator values a run takes)
+static int CountRandoms(const COMPILED_EXPR *ce)
+{
+    int i, n = 0;
+
+    for (i = 0; i < ce->code_len; ++i) {
+        if (ce->code[i].op == OP_CALL1 &&
+                (fun_table[ce->code[i].arg].fun1 == DoRandom ||
+                 fun_table[ce->code[i].arg].fun1 == DoPercent))
+            ++n;
+    }
+    return n;
+}
+
+// one row at a time, for expressions calling functions that must see the
+// rows in order (see AddFunction_r())
+static size_t EvaluateRows(COMPILED_EXPR *ce, const double *const *columns,
+                           size_t nrows, double *out, ARENA *scratch)
+{
+    PARSER_CONTEXT *ctx = ce->ctx;
+    enum ParserErrCode first = PARSER_OK;
+    double *saved;
+    size_t row, failed = 0;
+    int i;
+
+    saved = ArenaAlloc(scratch, (ce->num_syms + 1) * sizeof(double));
+    if (!saved) {
+        SetBatchErr(ctx, PARSER_ERR_NO_MEMORY);
+        for (row = 0; row < nrows; ++row) out[row] = sqrt(-1.0);
+        return nrows;
+    }
+    for (i = 0; i < ce->num_syms; ++i)
+        saved[i] = *SymbolValue(ctx, ce->syms[i]);
+
+    for (row = 0; row < nrows; ++row) {
+        for (i = 0; i < ce->num_syms; ++i)
+            *SymbolValue(ctx, ce->syms[i]) =
+                        columns && columns[i] ? columns[i][row] : saved[i];
+        out[row] = RunExpr(ce, ctx);  // (programs needn't hear: see below)
+        if (ctx->err_ != PARSER_OK) {
+            out[row] = sqrt(-1.0);
+            ++failed;
+            if (first == PARSER_OK)
+                first = ctx->err_;
+        }
+    }
+    ctx->err_ = first;
+
+    for (i = 0; i < ce->num_syms; ++i)  // leave the symbol table unchanged
+        *SymbolValue(ctx, ce->syms[i]) = saved[i];
+    return failed;
+}
+
+// bytes of column storage and bookkeeping NewBatchState() needs for ce
+// (EvaluateRows() needs less)
+static size_t BatchStateSize(COMPILED_EXPR *ce)
+{
+    size_t nsyms = ce->num_syms;
+
+    return ((size_t)ce->max_stack + 2 * nsyms + ce->num_temps)
+                                    * BATCH_BLOCK * sizeof(double)
+            + ((size_t)ce->max_stack + 2 * nsyms) * sizeof(double *)
+            + nsyms * sizeof(bool) + BATCH_BLOCK;
+}
+
+// set up bs to run ce over the columns, with memory from scratch; returns
+// false if out of memory
+static bool NewBatchState(COMPILED_EXPR *ce, const double *const *columns,
+                          BATCH_STATE *bs, ARENA *scratch)
+{
+    PARSER_CONTEXT *ctx = ce->ctx;
+    double *fill;       // columns of unbound symbols
+    void *mem;
+    int nsyms = ce->num_syms;
+    int i, j;
+
+    // one block holds all the column storage and bookkeeping
+    if ((mem = ArenaAlloc(scratch, BatchStateSize(ce))) == NULL)
+        return false;
+    bs->stack = mem;
+    fill = bs->stack + (size_t)ce->max_stack * BATCH_BLOCK;
+    bs->work = fill + (size_t)nsyms * BATCH_BLOCK;
+    bs->temps = bs->work + (size_t)nsyms * BATCH_BLOCK;
+    bs->col = (const double **)(bs->temps + (size_t)ce->num_temps * BATCH_BLOCK);
+    bs->sym = bs->col + ce->max_stack;
+    bs->input = bs->sym + nsyms;
+    bs->stored = (bool *)(bs->input + nsyms);
+    bs->err = (unsigned char *)(bs->stored + nsyms);
+    bs->kernels = ctx->kernels_ ? ctx->kernels_ : BestBatchKernels();
+    bs->first_err = PARSER_OK;
+
+    for (i = 0; i < nsyms; ++i, fill += BATCH_BLOCK) {
+        if (!columns || !columns[i]) {  // unbound: use current value
+            for (j = 0; j < BATCH_BLOCK; ++j)
+                fill[j] = *SymbolValue(ctx, ce->syms[i]);
+            bs->input[i] = fill;
+        }
+        bs->stored[i] = false;
+    }
+    for (i = 0; i < ce->code_len; ++i) {
+        if (ce->code[i].op == OP_STORE || ce->code[i].op == OP_STOREP)
+            bs->stored[ce->code[i].arg] = true;
+    }
+    if ((bs->rng_step = CountRandoms(ce)) != 0)
+        SeedRandom(ctx);
+    bs->rng_seed = ctx->rng_seed_;
+    bs->rng_first = ctx->rng_counter_;
+    return true;
+}
+
+// run rows [row, end) into out; returns number with errors
+static size_t BatchRows(COMPILED_EXPR *ce, BATCH_STATE *bs,
+                        const double *const *columns, size_t row, size_t end,
+                        double *out)
+{
+    size_t failed = 0;
+    int i, j, n;
+
+    for (; row < end; row += n) {
+        n = end - row < BATCH_BLOCK ? (int)(end - row) : BATCH_BLOCK;
+        for (i = 0; i < ce->num_syms; ++i)
+            if (columns && columns[i]) bs->input[i] = columns[i] + row;
+        memset(bs->err, 0, n);
+        bs->row = row;
+
+        RunBatchBlock(ce, bs, n);
+
+        for (j = 0; j < n; ++j) {
+            if (bs->err[j]) {
+                out[row + j] = sqrt(-1.0);
+                ++failed;
+                STAT_ADD(ce->stats_.errors[bs->err[j]], 1);
+                STAT_ADD(ce->ctx->stats_.errors[bs->err[j]], 1);
+            } else
+                out[row + j] = bs->col[0][j];
+        }
+    }
+    return failed;
+}
+
+#ifdef HAVE_THREADS
+
+// what each thread of a threaded EvaluateBatch() did
+typedef struct _batch_part {
+    size_t failed;          // rows in error
+    size_t err_row;         // start of its first chunk with an error
+    enum ParserErrCode err; // that chunk's first error (PARSER_OK: none)
+} BATCH_PART;
+
+typedef struct _batch_job {
+    COMPILED_EXPR *ce;
+    const double *const *columns;
+    size_t nrows;
+    double *out;
+    size_t next;            // first row not yet taken (atomically)
+    BATCH_STATE *states;    // by worker (stack NULL: no memory for it)
+    BATCH_PART *parts;      // by worker
+} BATCH_JOB;
+
+static void BatchJob(void *arg, int worker)
+{
+    BATCH_JOB *job = arg;
+    BATCH_PART *part = &job->parts[worker];
+    BATCH_STATE *bs = &job->states[worker];
+    size_t row, end;
+
+    if (!bs->stack)
+        return;  // (the others do its share)
+    while ((row = __sync_fetch_and_add(&job->next, BATCH_CHUNK)) < job->nrows) {
+        end = job->nrows - row < BATCH_CHUNK ? job->nrows : row + BATCH_CHUNK;
+        bs->first_err = PARSER_OK;
+        part->failed += BatchRows(job->ce, bs, job->columns, row, end, job->out);
+        if (bs->first_err != PARSER_OK && part->err == PARSER_OK) {
+            part->err = bs->first_err;
+            part->err_row = row;
+        }
+    }
+}
+
+// take what BatchThreads() needs from scratch: bookkeeping, and the state
+// of each worker but the first (set up for job->ce, or if that's NULL just
+// need bytes); returns false if there's no room for the bookkeeping
+static bool BatchThreadsScratch(ARENA *scratch, int threads, size_t need,
+                                BATCH_JOB *job)
+{
+    int i;
+
+    job->parts = ArenaAlloc(scratch, (threads + 1) * sizeof(BATCH_PART));
+    job->states = ArenaAlloc(scratch, (threads + 1) * sizeof(BATCH_STATE));
+    if (!job->parts || !job->states)
+        return false;
+    memset(job->parts, 0, (threads + 1) * sizeof(BATCH_PART));
+    for (i = 1; i <= threads; ++i) {
+        if (!job->ce) {
+            if (!ArenaAlloc(scratch, need))
+                return false;
+        } else if (!NewBatchState(job->ce, job->columns, &job->states[i],
+                                  scratch))
+            job->states[i].stack = NULL;
+    }
+    return true;
+}
+
+// share the rows among ctx's thread pool (bs is set up for worker 0)
+static size_t BatchThreads(COMPILED_EXPR *ce, BATCH_STATE *bs,
+                           const double *const *columns, size_t nrows,
+                           double *out, ARENA *scratch)
+{
+    THREAD_POOL *pool = &ce->ctx->batch_pool_;
+    BATCH_JOB job;
+    size_t failed = 0, err_row = 0;
+    int i;
+
+    job.ce = ce;
+    job.columns = columns;
+    if (!BatchThreadsScratch(scratch, pool->num_threads, 0, &job))
+        return BatchRows(ce, bs, columns, 0, nrows, out);
+    job.states[0] = *bs;
+    job.columns = columns;
+    job.nrows = nrows;
+    job.out = out;
+    job.next = 0;
+    RunPool(pool, BatchJob, &job);
+
+    bs->first_err = PARSER_OK;
+    for (i = 0; i <= pool->num_threads; ++i) {
+        failed += job.parts[i].failed;
+        if (job.parts[i].err != PARSER_OK && (bs->first_err == PARSER_OK ||
+                                            job.parts[i].err_row < err_row)) {
+            bs->first_err = job.parts[i].err;  // (lowest row so far)
+            err_row = job.parts[i].err_row;
+        }
+    }
+    return failed;
+}
+
+#endif // HAVE_THREADS
+
+// returns number of rows with errors (their result is NaN)
+size_t EvaluateBatch(COMPILED_EXPR *ce, const double *const *columns,
+                     size_t nrows, double *out)
+{
+    PARSER_CONTEXT *ctx = ce->ctx;
+    BATCH_STATE bs;
+    ARENA own = { NULL, NULL }, *scratch = &ctx->scratch_;
+    size_t row, failed;
+#ifdef HAVE_STATS
+    unsigned long long start = StatsClock();
+#endif
+
+    ctx->err_ = PARSER_OK;  // default to NULL error string
+    if (ce->sym_generation != ctx->sym_generation_) {
+        SetBatchErr(ctx, PARSER_ERR_SYMBOLS_RESET);
+        for (row = 0; row < nrows; ++row) out[row] = sqrt(-1.0);
+        return nrows;
+    }
+    ClockEnter(ctx);
+    if (ctx->scratch_busy_)
+        scratch = &own;  // (called by a user function of an EvaluateBatch())
+    else {
+        ctx->scratch_busy_ = true;
+        ArenaReset(scratch);
+    }
+
+    if (ce->batch_by_row)
+        failed = EvaluateRows(ce, columns, nrows, out, scratch);
+    else if (!NewBatchState(ce, columns, &bs, scratch)) {
+        SetBatchErr(ctx, PARSER_ERR_NO_MEMORY);
+        for (row = 0; row < nrows; ++row) out[row] = sqrt(-1.0);
+        failed = nrows;
+    } else {
+#ifdef HAVE_THREADS
+        if (ctx->batch_pool_.threads && nrows >= 2 * BATCH_CHUNK)
+            failed = BatchThreads(ce, &bs, columns, nrows, out, scratch);
+        else
+#endif
+        failed = BatchRows(ce, &bs, columns, 0, nrows, out);
+        ctx->rng_counter_ += nrows * bs.rng_step;  // (the values rows took)
+        if (bs.first_err != PARSER_OK)
+            SetBatchErr(ctx, bs.first_err);
+#ifdef HAVE_STATS
+        start = StatsClock() - start;
+        CountEvals(&ce->stats_, nrows, start);  // (one latency for the batch)
+        CountEvals(&ctx->stats_, nrows, start);
+#endif
+    }
+
+    if (scratch == &own)
+        ArenaFree(&own);
+    else
+        ctx->scratch_busy_ = false;
+    ClockLeave(ctx);
+    return failed;
+}
+
+// Once Compile_r() (or SetBatchThreads_r()) has done this, EvaluateBatch()
+// runs in memory taken from the chunks ctx's scratch arena already has: it
+// replays the most EvaluateBatch() takes from it (need bytes, or as many as
+// the largest expression compiled before needs, for each thread, plus the
+// threads' bookkeeping). Smaller requests, in the same order, never need
+// the arena to get more chunks. Returns false if out of memory.
+static bool WarmScratch(PARSER_CONTEXT *ctx, size_t need)
+{
+    ARENA *scratch = &ctx->scratch_;
+
+    if (need > ctx->scratch_need_)
+        ctx->scratch_need_ = need;
+    else if (need)
+        return true;  // warm already
+    if (ctx->scratch_busy_ || ctx->scratch_need_ == 0)
+        return true;  // (if busy, EvaluateBatch() gets what it needs)
+    ArenaReset(scratch);
+    if (!ArenaAlloc(scratch, ctx->scratch_need_))
+        return false;
+#ifdef HAVE_THREADS
+    if (ctx->batch_pool_.threads) {
+        BATCH_JOB job;
+
+        job.ce = NULL;
+        return BatchThreadsScratch(scratch, ctx->batch_pool_.num_threads,
+                                   ctx->scratch_need_, &job);
+    }
+#endif
+    return true;
+}
+
+// (re)start ctx's batch thread pool; returns 0 if it couldn't be
+int SetBatchThreads_r(PARSER_CONTEXT *ctx, int threads)
+{
+#ifdef HAVE_THREADS
+    StopPool(&ctx->batch_pool_);
+    if (threads > 1 && !StartPool(&ctx->batch_pool_, threads - 1))
+        return 0;
+    return WarmScratch(ctx, 0);
+#else
+    return threads <= 1;
+#endif
+}
+
+int SetBatchThreads(int threads)
+{
+    return SetBatchThreads_r(&default_ctx_, threads);
+}
+
+// choose EvaluateBatch() instruction set ("c", "sse2", "avx2", "avx512" or
+// "neon"), or NULL for the best available; returns 0 if not supported
+int SetBatchIsa_r(PARSER_CONTEXT *ctx, const char *isa)
+{
+    const BATCH_KERNELS *k = NULL;
+
+    if (isa && (k = FindBatchKernels(isa)) == NULL)
+        return 0;
+    ctx->kernels_ = k;
+    return 1;
+}
+
+int SetBatchIsa(const char *isa)
+{
+    return SetBatchIsa_r(&default_ctx_, isa);
+}
+
+const char *GetBatchIsa_r(PARSER_CONTEXT *ctx)  // instruction set in use
+{
+    return (ctx->kernels_ ? ctx->kernels_ : BestBatchKernels())->name;
+}
+
+const char *GetBatchIsa(void)
+{
+    return GetBatchIsa_r(&default_ctx_);
+}
+
+/******************************************************************************
+
+Programs
+--------
+
+A program is a set of formulas (eg. the cells of a spreadsheet) compiled
+together, so that when symbols they read change, only the formulas that
+depend on the change are run again:
+
+    const char *formulas[] = {
+        "total = net + tax", "tax = net * rate", "net = price * qty"
+    };
+    PARSER_PROGRAM *prog = CompileProgram(formulas, 3);
+
+    SaveSymbol("price", 10);
+    ...
+    RunProgram(prog);       // runs all three (net, then tax, then total)
+    SaveSymbol("rate", 0.2);
+    RunProgram(prog);       // runs tax and total
+    ...
+    FreeProgram(prog);
+
+Each formula is compiled on its own. A formula depends on the one that
+assigns a symbol it reads (each symbol can be assigned by one formula
+only, and the dependencies can't loop), and the formulas are kept sorted so
+each comes after the ones it depends on. SaveSymbol() of a symbol a formula
+reads (or an assignment to it by Evaluate()) queues the formulas reading
+it. RunProgram() runs the queued formulas in order, and a formula whose
+results change queues the formulas that read them in turn, so the work
+done is proportional to what actually changed. A formula reading a symbol
+that it assigns itself doesn't depend on itself.
+
+The formulas are sorted by level: a formula's level is one more than the
+highest of those it depends on, so formulas of the same level don't depend
+on each other. RunProgram() runs the queued formulas a level at a time, and
+with SetProgramThreads() the formulas of a level are shared among worker
+threads, grain at a time, from a counter each thread takes from. Each
+worker has a context of its own for errors, which compiled code reports to
+cur_ctx_ rather than its own context for that reason.
+
+******************************************************************************/
+
+typedef struct _formula {
+    COMPILED_EXPR *ce;
+    int first_write;    // symbols it assigns: writes[first_write ...]
+    int num_writes;
+    int level;          // 0, or 1 + highest level of those it depends on
+    enum ParserErrCode err;  // of its last run
+    bool queued;        // waiting to be run by RunProgram()
+    unsigned long long rng_first;  // generator values it takes, past rng_base
+} FORMULA;
+
+#define PROGRAM_GRAIN 16  /* default formulas a thread takes at a time */
+
+#ifdef HAVE_THREADS
+typedef struct _program_worker {
+    PARSER_CONTEXT *ctx;    // just for its errors
+    double *old;            // (as prog->old)
+} PROGRAM_WORKER;
+#endif
+
+struct _parser_program {
+    PARSER_CONTEXT *ctx;
+    PARSER_PROGRAM *next;   // next of ctx's programs
+    unsigned sym_generation;  // ctx->sym_generation_ when compiled
+    FORMULA *formulas;      // in dependency order
+    int num_formulas;
+    int *writes;            // symbol slots assigned by the formulas
+    bool *changed;          // writes[i] changed when its formula last ran
+    double *old;            // their values before a formula is run
+    int max_writes;         // most any formula has
+    int num_slots;          // symbol slots when compiled
+    int *first_reader;      // formulas reading slot s are readers[
+    int *readers;           //   first_reader[s] ... first_reader[s + 1])
+    int *queue;             // heap of queued formulas (lowest first)
+    int queue_len;
+    int *batch;             // queued formulas of the level being run
+    int batch_len;
+    int grain;              // formulas a thread takes at a time
+    unsigned long long rng_base;  // ctx's generator value this run starts at
+    unsigned long long rng_step;  // values each run takes (all the formulas')
+#ifdef HAVE_THREADS
+    THREAD_POOL pool;       // threads helping RunProgram() (if started)
+    PROGRAM_WORKER *workers;  // by pool worker number - 1
+    int next_batch;         // of batch, to be taken next (atomically)
+#endif
+};
+
+static void QueueFormula(PARSER_PROGRAM *prog, int f)
+{
+    int i, parent;
+
+    if (prog->formulas[f].queued)
+        return;
+    prog->formulas[f].queued = true;
+    i = prog->queue_len++;
+    for (; i > 0 && prog->queue[parent = (i - 1) / 2] > f; i = parent)
+        prog->queue[i] = prog->queue[parent];
+    prog->queue[i] = f;
+}
+
+static int NextFormula(PARSER_PROGRAM *prog)  // queue mustn't be empty
+{
+    int f = prog->queue[0], last = prog->queue[--prog->queue_len];
+    int i = 0, kid;
+
+    while ((kid = 2 * i + 1) < prog->queue_len) {
+        if (kid + 1 < prog->queue_len && prog->queue[kid + 1] < prog->queue[kid])
+            ++kid;
+        if (prog->queue[kid] >= last)
+            break;
+        prog->queue[i] = prog->queue[kid];
+        i = kid;
+    }
+    prog->queue[i] = last;
+    prog->formulas[f].queued = false;
+    return f;
+}
+
+static void QueueReaders(PARSER_PROGRAM *prog, int slot)
+{
+    int i;
+
+    for (i = prog->first_reader[slot]; i < prog->first_reader[slot + 1]; ++i)
+        QueueFormula(prog, prog->readers[i]);
+}
+
+static void SymbolChanged(PARSER_CONTEXT *ctx, int slot)
+{
+    PARSER_PROGRAM *prog;
+
+    for (prog = ctx->programs_; prog; prog = prog->next) {
+        if (slot < prog->num_slots && prog->sym_generation == ctx->sym_generation_)
+            QueueReaders(prog, slot);
+    }
+}
+
+static void StopWorkers(PARSER_PROGRAM *prog);
+
+void FreeProgram(PARSER_PROGRAM *prog)
+{
+    PARSER_PROGRAM **pp;
+    int i;
+
+    if (!prog) return;
+    StopWorkers(prog);
+    for (pp = &prog->ctx->programs_; *pp; pp = &(*pp)->next) {
+        if (*pp == prog) {
+            *pp = prog->next;
+            break;
+        }
+    }
+    for (i = 0; i < prog->num_formulas; ++i)
+        FreeCompiled(prog->formulas[i].ce);
+    free(prog->formulas);
+    free(prog->writes);
+    free(prog->changed);
+    free(prog->old);
+    free(prog->first_reader);
+    free(prog->readers);
+    free(prog->queue);
+    free(prog->batch);
+    free(prog);
+}
+
+// symbols formula ce reads (use bit 1) and assigns (bit 2), by slot
+static void FormulaUses(COMPILED_EXPR *ce, unsigned char *use)
+{
+    int i;
+
+    for (i = 0; i < ce->num_syms; ++i)
+        use[ce->syms[i]] = 0;
+    for (i = 0; i < ce->code_len; ++i) {
+        if (ce->code[i].op == OP_LOAD || ce->code[i].op == OP_LOADP)
+            use[ce->syms[ce->code[i].arg]] |= 1;
+        else if (ce->code[i].op == OP_STORE || ce->code[i].op == OP_STOREP)
+            use[ce->syms[ce->code[i].arg]] |= 2;
+    }
+}
+
+// put the formulas (and their writes) in order of level, given the readers
+// of each slot by (unsorted) formula number in prog
+static bool SortFormulas(PARSER_PROGRAM *prog, COMPILED_EXPR **ces,
+                         const int *writer, unsigned char *use)
+{
+    PARSER_CONTEXT *ctx = prog->ctx;
+    int n = prog->num_formulas;
+    int *wait = calloc(n, sizeof(int));     // unsorted formulas depended on
+    int *order = malloc(n * sizeof(int));   // unsorted formulas, as freed
+    int *level = calloc(n, sizeof(int));    // of each unsorted formula
+    int *start = calloc(n + 1, sizeof(int));  // of each level, when sorted
+    int *rank = malloc(n * sizeof(int));    // unsorted formula -> sorted one
+    int *writes = malloc((prog->num_slots + 1) * sizeof(int));
+    int head = 0, tail = 0, f, i, j, k = 0, r, num_writes = 0;
+    bool ok = false;
+
+    if (!wait || !order || !level || !start || !rank || !writes) {
+        runtime_error(ctx, PARSER_ERR_NO_MEMORY, NULL, 0);
+        goto done;
+    }
+    for (i = 0; i < prog->num_slots; ++i) {
+        for (j = prog->first_reader[i]; writer[i] >= 0 &&
+                                    j < prog->first_reader[i + 1]; ++j)
+            ++wait[prog->readers[j]];
+    }
+    for (f = 0; f < n; ++f)
+        if (!wait[f])
+            order[tail++] = f;
+    while (head < tail) {  // take the formulas that can go next in turn
+        f = order[head++];
+        FormulaUses(ces[f], use);
+        for (i = 0; i < ces[f]->num_syms; ++i) {
+            if (!(use[k = ces[f]->syms[i]] & 2))
+                continue;
+            for (j = prog->first_reader[k]; j < prog->first_reader[k + 1]; ++j) {
+                r = prog->readers[j];
+                if (level[r] <= level[f])
+                    level[r] = level[f] + 1;
+                if (--wait[r] == 0)
+                    order[tail++] = r;
+            }
+        }
+    }
+    if (tail < n) {  // the rest are waiting for each other
+        for (f = 0; f < n && !wait[f]; ++f)
+            ;
+        FormulaUses(ces[f], use);
+        for (i = 0; i < ces[f]->num_syms; ++i) {
+            k = ces[f]->syms[i];
+            if ((use[k] & 1) && writer[k] >= 0 && writer[k] != f && wait[writer[k]])
+                break;
+        }
+        runtime_error(ctx, PARSER_ERR_CYCLE, ctx->vars_lhs[k], 0);
+        goto done;
+    }
+
+    // (stable) counting sort by level
+    for (f = 0; f < n; ++f)
+        ++start[level[f] + 1];
+    for (i = 0; i < n; ++i)
+        start[i + 1] += start[i];
+    for (head = 0; head < n; ++head) {
+        f = order[head];
+        rank[f] = start[level[f]]++;
+        wait[rank[f]] = f;  // (wait is free now: sorted formula -> unsorted)
+    }
+    for (i = 0; i < n; ++i) {
+        FORMULA *fm = &prog->formulas[i];
+
+        f = wait[i];
+        fm->ce = ces[f];
+        fm->level = level[f];
+        fm->first_write = num_writes;
+        FormulaUses(ces[f], use);
+        for (j = 0; j < ces[f]->num_syms; ++j)
+            if (use[k = ces[f]->syms[j]] & 2)
+                writes[num_writes++] = k;
+        fm->num_writes = num_writes - fm->first_write;
+    }
+    for (i = 0; i < prog->first_reader[prog->num_slots]; ++i)
+        prog->readers[i] = rank[prog->readers[i]];
+    prog->writes = writes;
+    writes = NULL;
+    ok = true;
+done:
+    free(wait);
+    free(order);
+    free(level);
+    free(start);
+    free(rank);
+    free(writes);
+    return ok;
+}
+
+// compile the n formulas as a program; returns NULL on error (see
+// GetParserErr())
+PARSER_PROGRAM *CompileProgram_r(PARSER_CONTEXT *ctx,
+                                 const char *const *formulas, int n)
+{
+    PARSER_PROGRAM *prog = calloc(1, sizeof(PARSER_PROGRAM));
+    COMPILED_EXPR **ces = calloc(n > 0 ? n : 1, sizeof(COMPILED_EXPR *));
+    unsigned char *use = NULL;
+    int *writer = NULL;
+    int f, i, k, slots, max_writes = 0;
+
+    ctx->err_ = PARSER_OK;
+    if (!prog || !ces) {
+        runtime_error(ctx, PARSER_ERR_NO_MEMORY, NULL, 0);
+        free(prog);
+        free(ces);
+        return NULL;
+    }
+    prog->ctx = ctx;
+    prog->grain = PROGRAM_GRAIN;
+    for (f = 0; f < n; ++f)
+        if ((ces[f] = CompileExpr(ctx, formulas[f])) == NULL)
+            goto fail;  // (error set by CompileExpr())
+    prog->sym_generation = ctx->sym_generation_;
+    prog->num_slots = slots = ctx->num_vars;
+
+    // which formula assigns each slot, and which read it
+    prog->formulas = calloc(n > 0 ? n : 1, sizeof(FORMULA));
+    prog->queue = malloc((n > 0 ? n : 1) * sizeof(int));
+    prog->batch = malloc((n > 0 ? n : 1) * sizeof(int));
+    prog->first_reader = calloc(slots + 2, sizeof(int));
+    prog->changed = calloc(slots + 1, sizeof(bool));
+    use = malloc(slots + 1);
+    writer = malloc((slots + 1) * sizeof(int));
+    if (!prog->formulas || !prog->queue || !prog->batch ||
+            !prog->first_reader || !prog->changed || !use || !writer) {
+        runtime_error(ctx, PARSER_ERR_NO_MEMORY, NULL, 0);
+        goto fail;
+    }
+    prog->num_formulas = n;
+    for (i = 0; i < slots; ++i)
+        writer[i] = -1;
+    for (f = 0; f < n; ++f) {
+        int writes = 0;
+
+        FormulaUses(ces[f], use);
+        for (i = 0; i < ces[f]->num_syms; ++i) {
+            k = ces[f]->syms[i];
+            if (use[k] & 2) {
+                if (writer[k] >= 0) {
+                    runtime_error(ctx, PARSER_ERR_ASSIGNED_TWICE,
+                                  ctx->vars_lhs[k], 0);
+                    goto fail;
+                }
+                writer[k] = f;
+                ++writes;
+            } else if (use[k] & 1)
+                ++prog->first_reader[k + 2];  // counted, then made starts
+        }
+        if (writes > max_writes)
+            max_writes = writes;
+    }
+    for (i = 0; i < slots; ++i)
+        prog->first_reader[i + 2] += prog->first_reader[i + 1];
+    prog->readers = malloc((prog->first_reader[slots + 1] + 1) * sizeof(int));
+    prog->old = malloc((max_writes + 1) * sizeof(double));
+    prog->max_writes = max_writes;
+    if (!prog->readers || !prog->old) {
+        runtime_error(ctx, PARSER_ERR_NO_MEMORY, NULL, 0);
+        goto fail;
+    }
+    for (f = 0; f < n; ++f) {  // formulas in order for each slot
+        FormulaUses(ces[f], use);
+        for (i = 0; i < ces[f]->num_syms; ++i) {
+            k = ces[f]->syms[i];
+            if (use[k] == 1)
+                prog->readers[prog->first_reader[k + 1]++] = f;
+        }
+    }
+
+    if (!SortFormulas(prog, ces, writer, use))
+        goto fail;
+    for (f = 0; f < n; ++f) {  // each formula's own rand() values
+        prog->formulas[f].rng_first = prog->rng_step;
+        prog->rng_step += CountRandoms(prog->formulas[f].ce);
+    }
+    free(ces);
+    free(use);
+    free(writer);
+    for (f = 0; f < n; ++f)  // nothing's been worked out yet
+        QueueFormula(prog, f);
+    prog->next = ctx->programs_;
+    ctx->programs_ = prog;
+    return prog;
+
+fail:
+    for (f = 0; ces && f < n; ++f)
+        FreeCompiled(ces[f]);
+    if (prog)
+        prog->num_formulas = 0;  // (their compiled forms are freed already)
+    FreeProgram(prog);
+    free(ces);
+    free(use);
+    free(writer);
+    return NULL;
+}
+
+PARSER_PROGRAM *CompileProgram(const char *const *formulas, int n)
+{
+    return CompileProgram_r(&default_ctx_, formulas, n);
+}
+
+// run formula fm, with its errors going to err_ctx (old holds the values it
+// assigns, from before)
+static void RunFormula(PARSER_PROGRAM *prog, FORMULA *fm,
+                       PARSER_CONTEXT *err_ctx, double *old)
+{
+    PARSER_CONTEXT *ctx = prog->ctx;
+    const int *writes = prog->writes + fm->first_write;
+    int i;
+
+    for (i = 0; i < fm->num_writes; ++i)
+        old[i] = *SymbolValue(ctx, writes[i]);
+    if (prog->rng_step) {  // (the same values whichever thread runs it)
+        err_ctx->rng_seed_ = ctx->rng_seed_;
+        err_ctx->rng_counter_ = prog->rng_base + fm->rng_first;
+        err_ctx->rng_seeded_ = true;
+    }
+    RunExpr(fm->ce, err_ctx);
+    if ((fm->err = err_ctx->err_) != PARSER_OK) {
+        for (i = 0; i < fm->num_writes; ++i)
+            *SymbolValue(ctx, writes[i]) = sqrt(-1.0);
+    }
+    for (i = 0; i < fm->num_writes; ++i)
+        prog->changed[fm->first_write + i] = memcmp(&old[i],
+                            SymbolValue(ctx, writes[i]), sizeof(double)) != 0;
+}
+
+#ifdef HAVE_THREADS
+
+// run formulas of the batch, grain at a time, until they're all taken
+static void LevelJob(void *arg, int worker)
+{
+    PARSER_PROGRAM *prog = arg;
+    PARSER_CONTEXT *err_ctx = worker ? prog->workers[worker - 1].ctx : prog->ctx;
+    double *old = worker ? prog->workers[worker - 1].old : prog->old;
+    int i, end;
+
+    while ((i = __sync_fetch_and_add(&prog->next_batch, prog->grain)) <
+                                                            prog->batch_len) {
+        end = i + prog->grain < prog->batch_len ? i + prog->grain
+                                                : prog->batch_len;
+        for (; i < end; ++i)
+            RunFormula(prog, &prog->formulas[prog->batch[i]], err_ctx, old);
+    }
+}
+
+static void StopWorkers(PARSER_PROGRAM *prog)
+{
+    int i;
+
+    if (!prog->workers)
+        return;
+    StopPool(&prog->pool);
+    for (i = 0; prog->workers[i].ctx || prog->workers[i].old; ++i) {
+        FreeParserContext(prog->workers[i].ctx);
+        free(prog->workers[i].old);
+    }
+    free(prog->workers);
+    prog->workers = NULL;
+}
+
+// start n workers (the thread calling RunProgram() makes one more)
+static bool StartWorkers(PARSER_PROGRAM *prog, int n)
+{
+    int i;
+
+    // (the one past the end stays empty)
+    if ((prog->workers = calloc(n + 1, sizeof(PROGRAM_WORKER))) == NULL)
+        return false;
+    for (i = 0; i < n; ++i) {
+        prog->workers[i].ctx = NewParserContext();
+        prog->workers[i].old = malloc((prog->max_writes + 1) * sizeof(double));
+        if (!prog->workers[i].ctx || !prog->workers[i].old) {
+            StopWorkers(prog);
+            return false;
+        }
+    }
+    if (!StartPool(&prog->pool, n)) {
+        StopWorkers(prog);
+        return false;
+    }
+    return true;
+}
+
+#else // no threads in this build
+
+static void StopWorkers(PARSER_PROGRAM *prog)
+{
+}
+
+#endif // HAVE_THREADS
+
+// run the queued formulas of one level (which don't depend on each other)
+static void RunLevel(PARSER_PROGRAM *prog)
+{
+    int i;
+
+#ifdef HAVE_THREADS
+    if (prog->workers && prog->batch_len > prog->grain) {
+        prog->next_batch = 0;
+        RunPool(&prog->pool, LevelJob, prog);
+        return;
+    }
+#endif
+    for (i = 0; i < prog->batch_len; ++i)
+        RunFormula(prog, &prog->formulas[prog->batch[i]], prog->ctx, prog->old);
+}
+
+// the caller may change bound symbols' values without telling us, so note
+// them, queueing the formulas reading those that changed since last noted
+static void NoteBindings(PARSER_CONTEXT *ctx, bool queue)
+{
+    BINDING *b;
+    double v;
+
+    for (b = ctx->bindings_; b < ctx->bindings_ + ctx->num_bindings_; ++b) {
+        v = *ctx->vars_ptr[b->slot];
+        if (queue && memcmp(&v, &b->seen, sizeof(v)))
+            SymbolChanged(ctx, b->slot);
+        b->seen = v;
+    }
+}
+
+// run the formulas needing it; returns number in error (their symbols are
+// set to NaN, and GetParserErr() describes the first error)
+int RunProgram(PARSER_PROGRAM *prog)
+{
+    PARSER_CONTEXT *ctx = prog->ctx;
+    enum ParserErrCode first = PARSER_OK;
+    int failed = 0, level, b, i;
+
+    if (prog->sym_generation != ctx->sym_generation_) {
+        ctx->err_ = PARSER_OK;
+        runtime_error(ctx, PARSER_ERR_SYMBOLS_RESET, NULL, 0);
+        return prog->num_formulas;
+    }
+    NoteBindings(ctx, true);
+    ClockEnter(ctx);
+    if (prog->rng_step)
+        SeedRandom(ctx);
+    prog->rng_base = ctx->rng_counter_;
+    while (prog->queue_len) {  // a level at a time
+        level = prog->formulas[prog->queue[0]].level;
+        prog->batch_len = 0;
+        while (prog->queue_len && prog->formulas[prog->queue[0]].level == level)
+            prog->batch[prog->batch_len++] = NextFormula(prog);
+        RunLevel(prog);
+        for (b = 0; b < prog->batch_len; ++b) {
+            FORMULA *fm = &prog->formulas[prog->batch[b]];
+
+            if (fm->err != PARSER_OK) {
+                if (first == PARSER_OK)
+                    first = fm->err;
+                ++failed;
+            }
+            for (i = fm->first_write; i < fm->first_write + fm->num_writes; ++i)
+                if (prog->changed[i])
+                    SymbolChanged(ctx, prog->writes[i]);  // (other programs too)
+        }
+    }
+    if (prog->rng_step)  // (a run takes them all, whichever formulas ran)
+        ctx->rng_counter_ = prog->rng_base + prog->rng_step;
+    ClockLeave(ctx);
+    NoteBindings(ctx, false);  // (formulas' changes were seen to already)
+    ctx->err_ = first;
+    return failed;
 }
 
+// run formulas on this many threads (including the one calling RunProgram()),
+// each taking grain of a level's formulas at a time (0: the default); returns
+// 0 if this build has no threads or they couldn't be started
+int SetProgramThreads(PARSER_PROGRAM *prog, int threads, int grain)
+{
+    prog->grain = grain > 0 ? grain : PROGRAM_GRAIN;
+    StopWorkers(prog);
+    if (threads <= 1)
+        return 1;
+#ifdef HAVE_THREADS
+    return StartWorkers(prog, threads - 1);
+#else
+    return 0;
+#endif
+}
+
+/******************************************************************************
+
+Profiling
+---------
+
+Builds made with HAVE_STATS defined ("make STATS=1") count evaluations, the
+time they take, symbol lookups, function calls and errors, both for each
+context and for each compiled expression. Every EvaluateCompiled() etc. call
+reads the clock twice, and Evaluate() reads it for every token too, so the
+tokenizer's share can be told apart. Native code counts its calls with
+"lock add" instructions of its own. The counters are updated atomically,
+since worker threads (see SetProgramThreads() and SetBatchThreads()) share
+them. In other builds the STAT_ADD()s and the fields they'd update aren't
+there at all, and the functions below just report zeros.
+
+Calls are counted by function for the context (so a function's count
+doesn't depend on where the call came from) and as a total for each
+compiled expression. Latencies are kept as a histogram with a bucket per
+power of two nanoseconds, so ParserStatsLatency() is only good to within a
+factor of two, but costs a few increments to keep.
+
+******************************************************************************/
+
+#ifdef HAVE_STATS
+typedef char FUN_CALLS_FIT[NUM_FUNS <= MAX_BUILTIN_FUNS ? 1 : -1];
+
+static void CopyStats(PARSER_STATS *out, const STATS *stats)
+{
+    int i;
+
+    out->evals = stats->evals;
+    out->lookups = stats->lookups;
+    out->calls = stats->calls;
+    out->eval_secs = stats->eval_ns * 1e-9;
+    out->token_secs = stats->token_ns * 1e-9;
+    out->compile_secs = stats->compile_ns * 1e-9;
+    for (i = 0; i < PARSER_LATENCY_BUCKETS; ++i)
+        out->latency[i] = stats->latency[i];
+    for (i = 0; i < PARSER_NUM_ERRS; ++i)
+        out->errors[i] = stats->errors[i];
+}
+#endif
+
+// everything done in ctx so far; returns 0 if this build doesn't count
+int GetParserStats_r(PARSER_CONTEXT *ctx, PARSER_STATS *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+#ifdef HAVE_STATS
+    {
+        int i;
+
+        CopyStats(stats, &ctx->stats_);
+        for (i = 0; i < NUM_FUNS; ++i)
+            stats->calls += ctx->fun_calls_[i];
+        for (i = 0; i < ctx->num_funs_; ++i)
+            stats->calls += *ctx->funs_[i].calls;
+    }
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+int GetParserStats(PARSER_STATS *stats)
+{
+    return GetParserStats_r(&default_ctx_, stats);
+}
+
+// just ce's evaluations (its compile_secs is how long it took to compile)
+int GetCompiledStats(COMPILED_EXPR *ce, PARSER_STATS *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+#ifdef HAVE_STATS
+    CopyStats(stats, &ce->stats_);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void ResetParserStats_r(PARSER_CONTEXT *ctx)  // (not its compiled ones')
+{
+#ifdef HAVE_STATS
+    int i;
+
+    memset(&ctx->stats_, 0, sizeof(ctx->stats_));
+    memset(ctx->fun_calls_, 0, sizeof(ctx->fun_calls_));
+    for (i = 0; i < ctx->num_funs_; ++i)
+        *ctx->funs_[i].calls = 0;
+#endif
+}
+
+void ResetParserStats(void)
+{
+    ResetParserStats_r(&default_ctx_);
+}
+
+void ResetCompiledStats(COMPILED_EXPR *ce)
+{
+#ifdef HAVE_STATS
+    memset(&ce->stats_, 0, sizeof(ce->stats_));
+#endif
+}
+
+// calls made in ctx of the function (built-in or added) called name
+unsigned long GetFunctionCalls_r(PARSER_CONTEXT *ctx, const char *name)
+{
+#ifdef HAVE_STATS
+    FUN_ENTRY *f = LookupFun(name, (int)strlen(name));
+    USER_FUN *uf;
+
+    if (f)
+        return ctx->fun_calls_[f - fun_table];
+    if ((uf = FindUserFun(ctx, name, strlen(name))) != NULL)
+        return *uf->calls;
+#endif
+    return 0;
+}
+
+unsigned long GetFunctionCalls(const char *name)
+{
+    return GetFunctionCalls_r(&default_ctx_, name);
+}
+
+// seconds that fraction (eg. 0.99) of the calls took at most, roughly (the
+// top of the latency bucket holding that call)
+double ParserStatsLatency(const PARSER_STATS *stats, double fraction)
+{
+    unsigned long total = 0, seen = 0;
+    int i;
+
+    for (i = 0; i < PARSER_LATENCY_BUCKETS; ++i)
+        total += stats->latency[i];
+    if (total == 0)
+        return 0.0;
+    for (i = 0; i < PARSER_LATENCY_BUCKETS - 1; ++i) {
+        if ((seen += stats->latency[i]) >= fraction * total)
+            break;
+    }
+    return ldexp(1.0, i + 1) * 1e-9;
+}
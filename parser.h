@@ -3,15 +3,228 @@
 #ifndef PARSER_H
 #define PARSER_H
 
-#ifndef MAX_PARSE_SYMBOLS
-#define MAX_PARSE_SYMBOLS (100)  /* maxium parser symbols allowed */
-#endif
+#include <stddef.h>
 
 #define PARSE_ERROR (sqrt(-1)) /* indicates Evaluate()/LookupSymbol failure */
 
+// what went wrong (see GetParserErrCode(); GetParserErr() gives the message)
+enum ParserErrCode {
+    PARSER_OK,
+    PARSER_ERR_NO_MEMORY,
+    PARSER_ERR_DIVIDE_BY_ZERO,
+    PARSER_ERR_MOD_BY_ZERO,         // mod(x, 0)
+    PARSER_ERR_EXPECTED,            // missing ')' or ','
+    PARSER_ERR_END,                 // unexpected end of expression
+    PARSER_ERR_BAD_NUMBER,
+    PARSER_ERR_BAD_CHARACTER,
+    PARSER_ERR_UNKNOWN_FUNCTION,
+    PARSER_ERR_UNEXPECTED_TOKEN,
+    PARSER_ERR_TRAILING_TEXT,       // unexpected text at end of expression
+    PARSER_ERR_SYMBOLS_RESET,       // compiled before ResetSymbols()
+    PARSER_ERR_ASSIGNED_TWICE,      // CompileProgram(): by two formulas
+    PARSER_ERR_CYCLE,               // CompileProgram(): formulas in a loop
+    PARSER_ERR_BAD_SAVED,           // LoadCompiled(): not SaveCompiled() data
+    PARSER_NUM_ERRS                 // (number of codes)
+};
+
 int SaveSymbol(char *lhs, double rhs); // returns 1:success, 0:malloc() failed
 double LookupSymbol(char *lhs); // returns NO_LHS_MATCH if lookup fails
+void ResetSymbols(void); // forget all symbols (invalidates Compile() results)
 char *GetParserErr(void); // returns non-empty error string on Evaluate() fails
+int GetParserErrCode(void); // returns PARSER_OK, or why Evaluate() failed
 double Evaluate(char *string); // returns result (or NO_LHS_MATCH if error)
+// (Evaluate() compiles expressions nesting more than 32 deep instead of
+// parsing them; given a syntax error, one of those still does the comma
+// list's expressions before the one in error, but none of that one's
+// assignments, which parsing would have done up to the error)
+
+// reentrant interface: each context has its own symbol table and error
+// state, so separate contexts may be used concurrently by separate threads
+typedef struct _parser_context PARSER_CONTEXT; // opaque parser state
+
+PARSER_CONTEXT *NewParserContext(void); // returns NULL if malloc() failed
+void FreeParserContext(PARSER_CONTEXT *ctx); // also frees its symbols
+int SaveSymbol_r(PARSER_CONTEXT *ctx, char *lhs, double rhs);
+double LookupSymbol_r(PARSER_CONTEXT *ctx, char *lhs);
+void ResetSymbols_r(PARSER_CONTEXT *ctx);
+char *GetParserErr_r(PARSER_CONTEXT *ctx);
+int GetParserErrCode_r(PARSER_CONTEXT *ctx);
+double Evaluate_r(PARSER_CONTEXT *ctx, char *string);
+
+// bound symbols: the value of symbol name is kept in the caller's memory at
+// value, read there whenever it's used and written there when it's assigned
+// (until it's bound again, or unbound by value NULL, keeping its value, or
+// ResetSymbols()); returns 0 if name isn't a valid symbol name, is a
+// built-in ("pi", "e", "time", "timems") or malloc() failed
+int BindSymbol(const char *name, double *value);
+int BindSymbol_r(PARSER_CONTEXT *ctx, const char *name, double *value);
+// bind to a column of values stride bytes apart from first (eg. a field of
+// an array of structs), the one SetBoundRow() picks (row 0 at first) being used
+int BindSymbolColumn(const char *name, double *first, size_t stride);
+int BindSymbolColumn_r(PARSER_CONTEXT *ctx, const char *name, double *first,
+                       size_t stride);
+void SetBoundRow(size_t row); // now use this row of every column bound
+void SetBoundRow_r(PARSER_CONTEXT *ctx, size_t row);
+
+// promise that symbol name's values will be from lo to hi (or NaN), so
+// expressions compiled from now on can leave out checks that then can't
+// fail (eg. for a divide by zero); if the symbol is assigned (other than by
+// the expression itself) a value outside the range, such errors may not be
+// reported. Returns 0 if lo > hi (or either is NaN), or malloc() failed.
+int SetSymbolRange(const char *name, double lo, double hi);
+int SetSymbolRange_r(PARSER_CONTEXT *ctx, const char *name, double lo,
+                     double hi);
+
+// rand() and percent() use a fast generator each context has of its own
+// (so contexts on separate threads don't wait for each other), seeded from
+// the clock unless this seeds it: the same seed then gives the same numbers
+// again, an EvaluateBatch() row the same ones as it would evaluated alone
+// (until a row in error, which evaluated alone stops using them at the
+// error), and a program's formulas the same ones on any number of threads
+void SetRandomSeed(unsigned long long seed);
+void SetRandomSeed_r(PARSER_CONTEXT *ctx, unsigned long long seed);
+
+// when the "time" and "timems" built-ins read the clock
+#define PARSER_CLOCK_LIVE 0  // every time they're used (the default)
+#define PARSER_CLOCK_ONCE 1  // once per Evaluate(), EvaluateCompiled(),
+                             // EvaluateBatch() or RunProgram() call
+#define PARSER_CLOCK_FIXED 2 // never: SetClock() gives their value
+
+int SetClockMode(int mode); // LIVE or ONCE; returns 0 if mode is neither
+int SetClockMode_r(PARSER_CONTEXT *ctx, int mode);
+// logical clock: time and timems give msecs since the 1970 epoch (and its
+// whole seconds) until it's set again or SetClockMode() is called
+void SetClock(double msecs);
+void SetClock_r(PARSER_CONTEXT *ctx, double msecs);
+
+// compile-once, evaluate-many interface
+typedef struct _compiled_expr COMPILED_EXPR; // opaque compiled expression
+
+COMPILED_EXPR *Compile(const char *string); // returns NULL on error
+COMPILED_EXPR *Compile_r(PARSER_CONTEXT *ctx, const char *string);
+double EvaluateCompiled(COMPILED_EXPR *ce); // returns result (or PARSE_ERROR)
+void FreeCompiled(COMPILED_EXPR *ce); // release Compile() result
+int CompiledSymbolCount(COMPILED_EXPR *ce); // number of symbols used
+const char *CompiledSymbolName(COMPILED_EXPR *ce, int i); // i'th symbol
+
+// compiled expressions saved as bytes (eg. in a file, to load at startup
+// without parsing): returns the bytes needed, saving them in buf if size is
+// at least that (0: ce's symbols were reset since)
+size_t SaveCompiled(COMPILED_EXPR *ce, void *buf, size_t size);
+// load what SaveCompiled() saved from the size bytes at buf (eg. a file
+// mapped with mmap(); it's copied, so may be unmapped after), using the
+// symbols and functions of the same names (add functions first); used (if
+// not NULL) gets the bytes taken, so saved expressions can follow each
+// other. Returns NULL on error, eg. buf wasn't saved by this version.
+COMPILED_EXPR *LoadCompiled(const void *buf, size_t size, size_t *used);
+COMPILED_EXPR *LoadCompiled_r(PARSER_CONTEXT *ctx, const void *buf,
+                              size_t size, size_t *used);
+
+// native code is made after "runs" EvaluateCompiled() calls (0: never);
+// returns 0 if this build can't make native code
+int SetJitThreshold(int runs);
+int SetJitThreshold_r(PARSER_CONTEXT *ctx, int runs);
+int CompiledIsNative(COMPILED_EXPR *ce); // 1 if native code is in use
+
+// column-at-a-time evaluation: symbol i reads columns[i] (or, if NULL, its
+// current value); returns number of rows in error (out[row] is PARSE_ERROR)
+size_t EvaluateBatch(COMPILED_EXPR *ce, const double *const *columns,
+                     size_t nrows, double *out);
+int SetBatchIsa(const char *isa); // force "c", "sse2", "avx2", "avx512", etc.
+int SetBatchIsa_r(PARSER_CONTEXT *ctx, const char *isa); // 0: unsupported
+const char *GetBatchIsa(void); // instruction set EvaluateBatch() uses
+const char *GetBatchIsa_r(PARSER_CONTEXT *ctx);
+// large batches are shared among this many threads (1: just the caller's);
+// user functions may then be called from several threads at once. Returns
+// 0 if the threads couldn't be started (or this build has none).
+int SetBatchThreads(int threads);
+int SetBatchThreads_r(PARSER_CONTEXT *ctx, int threads);
+
+// Evaluate() keeps compiled forms of the expressions it's given (by text),
+// dropping the least recently used beyond max_entries or max_bytes
+typedef struct _eval_cache_stats {
+    unsigned long hits;       // cached compiled expression was run
+    unsigned long misses;     // expression was parsed (or compiled)
+    unsigned long evictions;  // entries dropped to keep within the limits
+    int entries;              // expressions in the cache now
+    size_t bytes;             // memory they use (roughly)
+} EVAL_CACHE_STATS;
+
+void SetEvalCache(int max_entries, size_t max_bytes); // 0 entries: off
+void SetEvalCache_r(PARSER_CONTEXT *ctx, int max_entries, size_t max_bytes);
+void GetEvalCacheStats(EVAL_CACHE_STATS *stats);
+void GetEvalCacheStats_r(PARSER_CONTEXT *ctx, EVAL_CACHE_STATS *stats);
+
+// short-circuit mode (default off): &&, || and if() only work out the parts
+// they need, skipping the others' assignments, calls and errors; expressions
+// compiled by Compile() keep the mode they were compiled in
+void SetShortCircuit(int on);
+void SetShortCircuit_r(PARSER_CONTEXT *ctx, int on);
+
+// user functions: fun gets its nargs (0 to PARSER_MAX_ARGS) arguments in
+// args[], and data is passed along as given to AddFunction()
+typedef double (*PARSER_FUN)(const double *args, void *data);
+// batch version (optional): out[row] = fun(args[0][row], ...) for n rows;
+// out may be the same column as one of the args
+typedef void (*PARSER_BATCH_FUN)(const double *const *args, size_t n,
+                                 double *out, void *data);
+
+#define PARSER_MAX_ARGS 16
+#define PARSER_FUN_PURE 1   // no side effects, same arguments -> same result
+#define PARSER_FUN_VECTOR 2 // rows may be done in any order (pure ones can)
+
+// add a function callable as name(arg, ...); returns 0 if the name is
+// already used (by a built-in too) or isn't valid, or malloc() failed
+int AddFunction(const char *name, int nargs, int flags, PARSER_FUN fun,
+                PARSER_BATCH_FUN batch, void *data);
+int AddFunction_r(PARSER_CONTEXT *ctx, const char *name, int nargs, int flags,
+                  PARSER_FUN fun, PARSER_BATCH_FUN batch, void *data);
+
+// programs: formulas (eg. "total = net + tax") compiled together, in the
+// order their dependencies need; RunProgram() only runs the formulas that
+// read symbols changed (by SaveSymbol(), an assignment Evaluate() or
+// EvaluateCompiled() ran, or another formula) since they were last run.
+// Free programs before their context.
+typedef struct _parser_program PARSER_PROGRAM;
+
+PARSER_PROGRAM *CompileProgram(const char *const *formulas, int n); // NULL on error
+PARSER_PROGRAM *CompileProgram_r(PARSER_CONTEXT *ctx,
+                                 const char *const *formulas, int n);
+int RunProgram(PARSER_PROGRAM *prog); // returns number of formulas in error
+void FreeProgram(PARSER_PROGRAM *prog);
+
+// RunProgram() runs formulas that don't depend on each other on this many
+// threads (1: just the caller's), grain formulas at a time (0: default); user
+// functions may then be called from several threads at once. Returns 0 if
+// the threads couldn't be started (or this build has none).
+int SetProgramThreads(PARSER_PROGRAM *prog, int threads, int grain);
+
+// profiling counters, kept by builds made with "make STATS=1" (in others
+// they're all 0, and cost nothing); contexts count everything done in them,
+// compiled expressions just their own evaluations
+#define PARSER_LATENCY_BUCKETS 40
+
+typedef struct _parser_stats {
+    unsigned long evals;    // evaluations (rows, for EvaluateBatch())
+    unsigned long lookups;  // symbols looked up by name
+    unsigned long calls;    // functions called (built-in and added)
+    double eval_secs;       // time taken by the evaluations
+    double token_secs;      // time in the tokenizer (Evaluate(), Compile())
+    double compile_secs;    // time in Compile()
+    unsigned long latency[PARSER_LATENCY_BUCKETS]; // calls taking 2^i ns to
+                                                   // 2^(i+1) (0: under 2)
+    unsigned long errors[PARSER_NUM_ERRS]; // by enum ParserErrCode
+} PARSER_STATS;
+
+int GetParserStats(PARSER_STATS *stats); // returns 0 if this build doesn't count
+int GetParserStats_r(PARSER_CONTEXT *ctx, PARSER_STATS *stats);
+int GetCompiledStats(COMPILED_EXPR *ce, PARSER_STATS *stats);
+void ResetParserStats(void);
+void ResetParserStats_r(PARSER_CONTEXT *ctx);
+void ResetCompiledStats(COMPILED_EXPR *ce);
+unsigned long GetFunctionCalls(const char *name); // calls of that function
+unsigned long GetFunctionCalls_r(PARSER_CONTEXT *ctx, const char *name);
+// seconds that fraction (eg. 0.99) of the calls took at most (roughly)
+double ParserStatsLatency(const PARSER_STATS *stats, double fraction);
 
 #endif // PARSER_H
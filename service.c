@@ -0,0 +1,445 @@
+// service.c - evaluation service: requests from many threads, run in batches
+//
+// Requests are queued (from a fixed pool, so queueing one never allocates)
+// and the service's thread takes the whole queue at a time: once max_batch
+// requests are waiting, or the oldest has waited the latency budget. The
+// requests it took are grouped by compiled expression, and each group is
+// run by one EvaluateBatch(), the values of each request being one row of
+// the columns. A batch only reports its first error, so a row in error is
+// run again on its own for its error code (errors being rare, that costs
+// little). Callbacks are made from the service's thread, with no lock held.
+//
+// Two locks: one for the queue, held only briefly, and one for the context,
+// held while compiling or running a group, so ServiceCompile() from other
+// threads doesn't get in the way of queueing.
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "service.h"
+
+#ifdef HAVE_THREADS
+
+#include <pthread.h>
+#include <time.h>
+
+typedef struct _service_request {
+    COMPILED_EXPR *ce;
+    const double *values;   // symbol i's value is values[i]
+    SERVICE_DONE done;
+    void *data;
+    unsigned long long queued_at;  // nanoseconds (see Now()), if it was first
+    struct _service_request *next;
+} SERVICE_REQUEST;
+
+typedef struct _service_expr {  // ServiceCompile() result
+    char *text;
+    COMPILED_EXPR *ce;
+    struct _service_expr *next;
+} SERVICE_EXPR;
+
+struct _parser_service {
+    PARSER_CONTEXT *ctx;
+    pthread_t thread;
+    unsigned long long latency_ns;  // longest a request waits for a batch
+    int max_batch;          // requests queued that start a batch at once
+    int max_queue;
+
+    pthread_mutex_t lock;   // for the rest of these, to the next comment
+    pthread_cond_t wake;    // first request queued, max_batch reached or quit
+    SERVICE_REQUEST *free_; // requests not in use
+    SERVICE_REQUEST *head;  // queued, oldest first
+    SERVICE_REQUEST **tail;
+    int queued;
+    bool quit;              // FreeParserService() was called
+    SERVICE_STATS stats;
+
+    pthread_mutex_t ctx_lock;  // for ctx and exprs
+    SERVICE_EXPR *exprs;
+
+    // the service thread's own
+    SERVICE_REQUEST *pool;  // max_queue requests
+    SERVICE_REQUEST **taken;   // requests taken from the queue
+    SERVICE_REQUEST **group;   // those of one expression
+    double *out;            // result of each of the group
+    int *err;               // and its error code
+    double *cols;           // symbol i's column is cols + i * group size
+    const double **columns; // each symbol's column
+    size_t cols_size;       // doubles cols has room for
+    int num_columns;        // entries columns has room for
+};
+
+static unsigned long long Now(void)  // nanoseconds
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// make room for m rows of nsyms columns; returns false if out of memory
+static bool GrowColumns(PARSER_SERVICE *svc, int nsyms, int m)
+{
+    size_t need = (size_t)nsyms * m;
+    void *p;
+
+    if (need > svc->cols_size) {
+        if ((p = realloc(svc->cols, need * sizeof(double))) == NULL)
+            return false;
+        svc->cols = p;
+        svc->cols_size = need;
+    }
+    if (nsyms > svc->num_columns) {
+        if ((p = realloc(svc->columns, nsyms * sizeof(double *))) == NULL)
+            return false;
+        svc->columns = p;
+        svc->num_columns = nsyms;
+    }
+    return true;
+}
+
+// run the m requests of svc->group (all for ce) by one EvaluateBatch(),
+// leaving their results in svc->out and error codes in svc->err
+static void RunGroup(PARSER_SERVICE *svc, COMPILED_EXPR *ce, int m)
+{
+    PARSER_CONTEXT *ctx = svc->ctx;
+    int nsyms = CompiledSymbolCount(ce);
+    int i, r;
+
+    if (!GrowColumns(svc, nsyms, m)) {
+        for (r = 0; r < m; ++r) {
+            svc->out[r] = PARSE_ERROR;
+            svc->err[r] = PARSER_ERR_NO_MEMORY;
+        }
+        return;
+    }
+    for (i = 0; i < nsyms; ++i) {
+        double *col = svc->cols + (size_t)i * m;
+
+        for (r = 0; r < m; ++r)
+            col[r] = svc->group[r]->values[i];
+        svc->columns[i] = col;
+    }
+    if (EvaluateBatch(ce, svc->columns, m, svc->out) == 0) {
+        for (r = 0; r < m; ++r)
+            svc->err[r] = PARSER_OK;
+        return;
+    }
+    for (r = 0; r < m; ++r) {  // find which rows failed, and why
+        svc->err[r] = PARSER_OK;
+        if (!isnan(svc->out[r]))
+            continue;
+        for (i = 0; i < nsyms; ++i)
+            svc->columns[i] = &svc->group[r]->values[i];
+        if (EvaluateBatch(ce, svc->columns, 1, &svc->out[r]))
+            svc->err[r] = GetParserErrCode_r(ctx);
+    }
+}
+
+// run the n requests in svc->taken and complete them, linking them into
+// *done (to be freed); returns the number of batches that took
+static int RunRequests(PARSER_SERVICE *svc, int n, SERVICE_REQUEST **done)
+{
+    COMPILED_EXPR *ce;
+    SERVICE_REQUEST *req;
+    int batches = 0, i, j, m;
+
+    for (i = 0; i < n; ++i) {
+        if (!svc->taken[i])
+            continue;  // (in an earlier group)
+        ce = svc->taken[i]->ce;
+        for (j = i, m = 0; j < n; ++j) {
+            if (svc->taken[j] && svc->taken[j]->ce == ce) {
+                svc->group[m++] = svc->taken[j];
+                svc->taken[j] = NULL;
+            }
+        }
+        pthread_mutex_lock(&svc->ctx_lock);
+        RunGroup(svc, ce, m);
+        pthread_mutex_unlock(&svc->ctx_lock);
+        ++batches;
+        for (j = 0; j < m; ++j) {
+            req = svc->group[j];
+            req->done(svc->err[j] == PARSER_OK ? svc->out[j] : PARSE_ERROR,
+                      svc->err[j], req->data);
+            req->next = *done;
+            *done = req;
+        }
+    }
+    return batches;
+}
+
+static void *ServiceThread(void *arg)
+{
+    PARSER_SERVICE *svc = arg;
+    SERVICE_REQUEST *req, *done;
+    unsigned long long deadline;
+    struct timespec ts;
+    int n, batches;
+
+    pthread_mutex_lock(&svc->lock);
+    while (true) {
+        if (!svc->head) {
+            if (svc->quit)
+                break;
+            pthread_cond_wait(&svc->wake, &svc->lock);
+            continue;
+        }
+        if (!svc->quit && svc->queued < svc->max_batch) {  // wait for more?
+            deadline = svc->head->queued_at + svc->latency_ns;
+            if (Now() < deadline) {
+                ts.tv_sec = deadline / 1000000000u;
+                ts.tv_nsec = deadline % 1000000000u;
+                pthread_cond_timedwait(&svc->wake, &svc->lock, &ts);
+                continue;
+            }
+        }
+        for (n = 0, req = svc->head; req; req = req->next)  // take them all
+            svc->taken[n++] = req;
+        svc->head = NULL;
+        svc->tail = &svc->head;
+        svc->queued = 0;
+        pthread_mutex_unlock(&svc->lock);
+
+        done = NULL;
+        batches = RunRequests(svc, n, &done);
+
+        pthread_mutex_lock(&svc->lock);
+        while ((req = done) != NULL) {  // free them
+            done = req->next;
+            req->next = svc->free_;
+            svc->free_ = req;
+        }
+        svc->stats.requests += n;
+        svc->stats.batches += batches;
+    }
+    pthread_mutex_unlock(&svc->lock);
+    return NULL;
+}
+
+static void FreeService(PARSER_SERVICE *svc)  // (its thread stopped)
+{
+    SERVICE_EXPR *se;
+
+    while ((se = svc->exprs) != NULL) {
+        svc->exprs = se->next;
+        FreeCompiled(se->ce);
+        free(se->text);
+        free(se);
+    }
+    FreeParserContext(svc->ctx);
+    pthread_mutex_destroy(&svc->lock);
+    pthread_mutex_destroy(&svc->ctx_lock);
+    pthread_cond_destroy(&svc->wake);
+    free(svc->pool);
+    free(svc->taken);
+    free(svc->group);
+    free(svc->out);
+    free(svc->err);
+    free(svc->cols);
+    free(svc->columns);
+    free(svc);
+}
+
+PARSER_SERVICE *NewParserService(PARSER_CONTEXT *ctx, int latency_us,
+                                 int max_batch, int max_queue)
+{
+    PARSER_SERVICE *svc;
+    pthread_condattr_t attr;
+    int i;
+
+    if (max_queue < 1 || (svc = calloc(1, sizeof(PARSER_SERVICE))) == NULL)
+        return NULL;
+    svc->ctx = ctx;
+    svc->latency_ns = latency_us > 0 ? latency_us * 1000ull : 0;
+    svc->max_batch = max_batch > 0 ? max_batch : 1;
+    svc->max_queue = max_queue;
+    svc->tail = &svc->head;
+    pthread_mutex_init(&svc->lock, NULL);
+    pthread_mutex_init(&svc->ctx_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);  // (as Now() is)
+    pthread_cond_init(&svc->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    svc->pool = malloc(max_queue * sizeof(SERVICE_REQUEST));
+    svc->taken = malloc(max_queue * sizeof(SERVICE_REQUEST *));
+    svc->group = malloc(max_queue * sizeof(SERVICE_REQUEST *));
+    svc->out = malloc(max_queue * sizeof(double));
+    svc->err = malloc(max_queue * sizeof(int));
+    if (svc->pool) {
+        for (i = 0; i < max_queue; ++i) {
+            svc->pool[i].next = svc->free_;
+            svc->free_ = &svc->pool[i];
+        }
+    }
+    if (!svc->pool || !svc->taken || !svc->group || !svc->out || !svc->err ||
+            pthread_create(&svc->thread, NULL, ServiceThread, svc)) {
+        svc->ctx = NULL;  // (left to the caller)
+        FreeService(svc);
+        return NULL;
+    }
+    return svc;
+}
+
+void FreeParserService(PARSER_SERVICE *svc)
+{
+    if (!svc) return;
+    pthread_mutex_lock(&svc->lock);
+    svc->quit = true;
+    pthread_cond_signal(&svc->wake);
+    pthread_mutex_unlock(&svc->lock);
+    pthread_join(svc->thread, NULL);
+    FreeService(svc);
+}
+
+COMPILED_EXPR *ServiceCompile(PARSER_SERVICE *svc, const char *expr, int *err)
+{
+    SERVICE_EXPR *se;
+    COMPILED_EXPR *ce = NULL;
+    int code = PARSER_OK;
+
+    pthread_mutex_lock(&svc->ctx_lock);
+    for (se = svc->exprs; se && strcmp(se->text, expr); se = se->next)
+        ;
+    if (se)
+        ce = se->ce;
+    else if ((ce = Compile_r(svc->ctx, expr)) == NULL)
+        code = GetParserErrCode_r(svc->ctx);
+    else if ((se = malloc(sizeof(SERVICE_EXPR))) == NULL ||
+             (se->text = strdup(expr)) == NULL) {
+        free(se);
+        FreeCompiled(ce);
+        ce = NULL;
+        code = PARSER_ERR_NO_MEMORY;
+    } else {
+        se->ce = ce;
+        se->next = svc->exprs;
+        svc->exprs = se;
+    }
+    pthread_mutex_unlock(&svc->ctx_lock);
+    if (err)
+        *err = code;
+    return ce;
+}
+
+int ServiceEvaluate(PARSER_SERVICE *svc, COMPILED_EXPR *ce,
+                    const double *values, SERVICE_DONE done, void *data)
+{
+    SERVICE_REQUEST *req;
+
+    pthread_mutex_lock(&svc->lock);
+    if (svc->quit || (req = svc->free_) == NULL) {
+        ++svc->stats.rejected;
+        pthread_mutex_unlock(&svc->lock);
+        return 0;
+    }
+    svc->free_ = req->next;
+    req->ce = ce;
+    req->values = values;
+    req->done = done;
+    req->data = data;
+    if (!svc->head)
+        req->queued_at = Now();  // (only the oldest's is needed)
+    req->next = NULL;
+    *svc->tail = req;
+    svc->tail = &req->next;
+    // the thread needs waking to start the latency budget, or the batch
+    if (++svc->queued == 1 || svc->queued == svc->max_batch)
+        pthread_cond_signal(&svc->wake);
+    pthread_mutex_unlock(&svc->lock);
+    return 1;
+}
+
+typedef struct _service_wait {  // ServiceEvaluateWait() in progress
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    bool finished;
+    double result;
+    int err;
+} SERVICE_WAIT;
+
+static void WaitDone(double result, int err, void *data)
+{
+    SERVICE_WAIT *w = data;
+
+    pthread_mutex_lock(&w->lock);
+    w->result = result;
+    w->err = err;
+    w->finished = true;
+    pthread_cond_signal(&w->done);
+    pthread_mutex_unlock(&w->lock);
+}
+
+double ServiceEvaluateWait(PARSER_SERVICE *svc, COMPILED_EXPR *ce,
+                           const double *values, int *err)
+{
+    SERVICE_WAIT w;
+
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.done, NULL);
+    w.finished = false;
+    w.result = PARSE_ERROR;
+    w.err = PARSER_ERR_NO_MEMORY;
+    if (ServiceEvaluate(svc, ce, values, WaitDone, &w)) {
+        pthread_mutex_lock(&w.lock);
+        while (!w.finished)
+            pthread_cond_wait(&w.done, &w.lock);
+        pthread_mutex_unlock(&w.lock);
+    }
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.done);
+    if (err)
+        *err = w.err;
+    return w.result;
+}
+
+void GetServiceStats(PARSER_SERVICE *svc, SERVICE_STATS *stats)
+{
+    pthread_mutex_lock(&svc->lock);
+    *stats = svc->stats;
+    pthread_mutex_unlock(&svc->lock);
+}
+
+#else // HAVE_THREADS
+
+// no threads: there's never a service
+PARSER_SERVICE *NewParserService(PARSER_CONTEXT *ctx, int latency_us,
+                                 int max_batch, int max_queue)
+{
+    return NULL;
+}
+
+void FreeParserService(PARSER_SERVICE *svc)
+{
+}
+
+COMPILED_EXPR *ServiceCompile(PARSER_SERVICE *svc, const char *expr, int *err)
+{
+    if (err)
+        *err = PARSER_ERR_NO_MEMORY;
+    return NULL;
+}
+
+int ServiceEvaluate(PARSER_SERVICE *svc, COMPILED_EXPR *ce,
+                    const double *values, SERVICE_DONE done, void *data)
+{
+    return 0;
+}
+
+double ServiceEvaluateWait(PARSER_SERVICE *svc, COMPILED_EXPR *ce,
+                           const double *values, int *err)
+{
+    if (err)
+        *err = PARSER_ERR_NO_MEMORY;
+    return PARSE_ERROR;
+}
+
+void GetServiceStats(PARSER_SERVICE *svc, SERVICE_STATS *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif // HAVE_THREADS
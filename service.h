@@ -0,0 +1,56 @@
+// service.h - evaluation service: requests from many threads, run in batches
+
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include "parser.h"
+
+// A service owns a parser context and a thread of its own. Requests to
+// evaluate a compiled expression are queued from any thread, and the
+// service runs the requests for the same expression together, by one
+// EvaluateBatch(), waiting for more (up to its latency budget) once the
+// first arrives. Each request is then completed by its callback.
+typedef struct _parser_service PARSER_SERVICE; // opaque service state
+
+// called by the service's thread when a request is done: result is its
+// value, or PARSE_ERROR with err its enum ParserErrCode (PARSER_OK if none)
+typedef void (*SERVICE_DONE)(double result, int err, void *data);
+
+// start a service for ctx (set up first, eg. with AddFunction_r(); from
+// now on only the service may use it, and it frees it): a batch is run once
+// max_batch requests are queued, or the oldest has waited latency_us
+// microseconds; at most max_queue requests may be queued at once. Returns
+// NULL if malloc() failed or the thread couldn't be started (or this build
+// has no threads).
+PARSER_SERVICE *NewParserService(PARSER_CONTEXT *ctx, int latency_us,
+                                 int max_batch, int max_queue);
+// runs the requests still queued, then stops the service and frees it,
+// its context and the expressions it compiled
+void FreeParserService(PARSER_SERVICE *svc);
+
+// compile expr in the service's context (from any thread); the same text
+// always gives the same expression, which lasts as long as the service.
+// Returns NULL on error (with err, if not NULL, set to why).
+COMPILED_EXPR *ServiceCompile(PARSER_SERVICE *svc, const char *expr, int *err);
+
+// queue ce to be evaluated with values[i] as symbol i (see
+// CompiledSymbolName()), which must be left as they are until done(result,
+// err, data) is called; returns 0 if the queue is full or the service is
+// being freed (done is then never called)
+int ServiceEvaluate(PARSER_SERVICE *svc, COMPILED_EXPR *ce,
+                    const double *values, SERVICE_DONE done, void *data);
+// the same, waiting for the result (err, if not NULL, gets the error code;
+// PARSER_ERR_NO_MEMORY if the request couldn't be queued)
+double ServiceEvaluateWait(PARSER_SERVICE *svc, COMPILED_EXPR *ce,
+                           const double *values, int *err);
+
+// what the service has done so far
+typedef struct _service_stats {
+    unsigned long requests;  // completed
+    unsigned long batches;   // EvaluateBatch() calls they took
+    unsigned long rejected;  // ServiceEvaluate() calls that returned 0
+} SERVICE_STATS;
+
+void GetServiceStats(PARSER_SERVICE *svc, SERVICE_STATS *stats);
+
+#endif // SERVICE_H
@@ -0,0 +1,365 @@
+// simd.c - vector kernels for EvaluateBatch(), chosen at run time
+//
+// The same kernels (see simd_ops.h) are built for plain C and for each
+// instruction set the compiler can target; BestBatchKernels() then picks
+// the widest one the CPU actually supports, so one binary runs well on
+// any machine.
+//
+// Only operations that can be done exactly are vectorized, so batch
+// results are identical to Evaluate(). Everything else (exp, log, pow,
+// etc.) is left to the C library.
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__)
+#define HAVE_NEON_SIMD
+#include <arm_neon.h>
+#endif
+
+// plain C: a "vector" of one double
+#define K(name) c_##name
+#define KERNELS_NAME "c"
+#define TARGET
+#define V double
+#define W 1
+#define LOAD(p) (*(p))
+#define STORE(p, v) (*(p) = (v))
+#define SPLAT(x) (x)
+#define ADD(a, b) ((a) + (b))
+#define SUB(a, b) ((a) - (b))
+#define MUL(a, b) ((a) * (b))
+#define DIV(a, b) ((a) / (b))
+#define NEG(a) (-(a))
+#define ABS(a) fabs(a)
+#define SQRT(a) sqrt(a)
+#define CMPLT(a, b) ((a) < (b))
+#define CMPLE(a, b) ((a) <= (b))
+#define CMPEQ(a, b) ((a) == (b))
+#define CMPNE(a, b) ((a) != (b))
+#define MAND(a, b) ((a) && (b))
+#define MOR(a, b) ((a) || (b))
+#define ONES(m) ((m) ? 1.0 : 0.0)
+#define SELECT(m, a, b) ((m) ? (a) : (b))
+#define ANY(m) (m)
+#define ALL(m) (m)
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define HAVE_ROUND
+#define FLOOR(a) floor(a)
+#define CEIL(a) ceil(a)
+#define TRUNC(a) trunc(a)
+#include "simd_ops.h"
+#undef K
+#undef KERNELS_NAME
+#undef TARGET
+#undef V
+#undef W
+#undef LOAD
+#undef STORE
+#undef SPLAT
+#undef ADD
+#undef SUB
+#undef MUL
+#undef DIV
+#undef NEG
+#undef ABS
+#undef SQRT
+#undef CMPLT
+#undef CMPLE
+#undef CMPEQ
+#undef CMPNE
+#undef MAND
+#undef MOR
+#undef ONES
+#undef SELECT
+#undef ANY
+#undef ALL
+#undef MIN
+#undef MAX
+#undef HAVE_ROUND
+#undef FLOOR
+#undef CEIL
+#undef TRUNC
+
+#ifdef HAVE_X86_SIMD
+
+// SSE2 (every x86-64 has it), but no rounding instructions
+#define K(name) sse2_##name
+#define KERNELS_NAME "sse2"
+#define TARGET __attribute__((target("sse2")))
+#define V __m128d
+#define W 2
+#define LOAD(p) _mm_loadu_pd(p)
+#define STORE(p, v) _mm_storeu_pd(p, v)
+#define SPLAT(x) _mm_set1_pd(x)
+#define ADD(a, b) _mm_add_pd(a, b)
+#define SUB(a, b) _mm_sub_pd(a, b)
+#define MUL(a, b) _mm_mul_pd(a, b)
+#define DIV(a, b) _mm_div_pd(a, b)
+#define NEG(a) _mm_xor_pd(a, _mm_set1_pd(-0.0))
+#define ABS(a) _mm_andnot_pd(_mm_set1_pd(-0.0), a)
+#define SQRT(a) _mm_sqrt_pd(a)
+#define CMPLT(a, b) _mm_cmplt_pd(a, b)
+#define CMPLE(a, b) _mm_cmple_pd(a, b)
+#define CMPEQ(a, b) _mm_cmpeq_pd(a, b)
+#define CMPNE(a, b) _mm_cmpneq_pd(a, b)
+#define MAND(a, b) _mm_and_pd(a, b)
+#define MOR(a, b) _mm_or_pd(a, b)
+#define ONES(m) _mm_and_pd(m, _mm_set1_pd(1.0))
+#define SELECT(m, a, b) _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b))
+#define ANY(m) (_mm_movemask_pd(m) != 0)
+#define ALL(m) (_mm_movemask_pd(m) == 0x3)
+#define MIN(a, b) _mm_min_pd(a, b)  // (minpd returns b if unordered)
+#define MAX(a, b) _mm_max_pd(a, b)
+#include "simd_ops.h"
+#undef K
+#undef KERNELS_NAME
+#undef TARGET
+#undef V
+#undef W
+#undef LOAD
+#undef STORE
+#undef SPLAT
+#undef ADD
+#undef SUB
+#undef MUL
+#undef DIV
+#undef NEG
+#undef ABS
+#undef SQRT
+#undef CMPLT
+#undef CMPLE
+#undef CMPEQ
+#undef CMPNE
+#undef MAND
+#undef MOR
+#undef ONES
+#undef SELECT
+#undef ANY
+#undef ALL
+#undef MIN
+#undef MAX
+
+// AVX2: four doubles, with rounding
+#define K(name) avx2_##name
+#define KERNELS_NAME "avx2"
+#define TARGET __attribute__((target("avx2")))
+#define V __m256d
+#define W 4
+#define LOAD(p) _mm256_loadu_pd(p)
+#define STORE(p, v) _mm256_storeu_pd(p, v)
+#define SPLAT(x) _mm256_set1_pd(x)
+#define ADD(a, b) _mm256_add_pd(a, b)
+#define SUB(a, b) _mm256_sub_pd(a, b)
+#define MUL(a, b) _mm256_mul_pd(a, b)
+#define DIV(a, b) _mm256_div_pd(a, b)
+#define NEG(a) _mm256_xor_pd(a, _mm256_set1_pd(-0.0))
+#define ABS(a) _mm256_andnot_pd(_mm256_set1_pd(-0.0), a)
+#define SQRT(a) _mm256_sqrt_pd(a)
+#define CMPLT(a, b) _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define CMPLE(a, b) _mm256_cmp_pd(a, b, _CMP_LE_OQ)
+#define CMPEQ(a, b) _mm256_cmp_pd(a, b, _CMP_EQ_OQ)
+#define CMPNE(a, b) _mm256_cmp_pd(a, b, _CMP_NEQ_UQ)
+#define MAND(a, b) _mm256_and_pd(a, b)
+#define MOR(a, b) _mm256_or_pd(a, b)
+#define ONES(m) _mm256_and_pd(m, _mm256_set1_pd(1.0))
+#define SELECT(m, a, b) _mm256_blendv_pd(b, a, m)
+#define ANY(m) (_mm256_movemask_pd(m) != 0)
+#define ALL(m) (_mm256_movemask_pd(m) == 0xf)
+#define MIN(a, b) _mm256_min_pd(a, b)
+#define MAX(a, b) _mm256_max_pd(a, b)
+#define HAVE_ROUND
+#define FLOOR(a) _mm256_round_pd(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)
+#define CEIL(a) _mm256_round_pd(a, _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC)
+#define TRUNC(a) _mm256_round_pd(a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC)
+#include "simd_ops.h"
+#undef K
+#undef KERNELS_NAME
+#undef TARGET
+#undef V
+#undef W
+#undef LOAD
+#undef STORE
+#undef SPLAT
+#undef ADD
+#undef SUB
+#undef MUL
+#undef DIV
+#undef NEG
+#undef ABS
+#undef SQRT
+#undef CMPLT
+#undef CMPLE
+#undef CMPEQ
+#undef CMPNE
+#undef MAND
+#undef MOR
+#undef ONES
+#undef SELECT
+#undef ANY
+#undef ALL
+#undef MIN
+#undef MAX
+#undef HAVE_ROUND
+#undef FLOOR
+#undef CEIL
+#undef TRUNC
+
+// AVX-512F: eight doubles, comparisons give bit masks
+#define K(name) avx512_##name
+#define KERNELS_NAME "avx512"
+#define TARGET __attribute__((target("avx512f")))
+#define V __m512d
+#define W 8
+#define LOAD(p) _mm512_loadu_pd(p)
+#define STORE(p, v) _mm512_storeu_pd(p, v)
+#define SPLAT(x) _mm512_set1_pd(x)
+#define ADD(a, b) _mm512_add_pd(a, b)
+#define SUB(a, b) _mm512_sub_pd(a, b)
+#define MUL(a, b) _mm512_mul_pd(a, b)
+#define DIV(a, b) _mm512_div_pd(a, b)
+#define NEG(a) _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(a), \
+                    _mm512_set1_epi64((long long)0x8000000000000000ULL)))
+#define ABS(a) _mm512_abs_pd(a)
+#define SQRT(a) _mm512_sqrt_pd(a)
+#define CMPLT(a, b) _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ)
+#define CMPLE(a, b) _mm512_cmp_pd_mask(a, b, _CMP_LE_OQ)
+#define CMPEQ(a, b) _mm512_cmp_pd_mask(a, b, _CMP_EQ_OQ)
+#define CMPNE(a, b) _mm512_cmp_pd_mask(a, b, _CMP_NEQ_UQ)
+#define MAND(a, b) ((__mmask8)((a) & (b)))
+#define MOR(a, b) ((__mmask8)((a) | (b)))
+#define ONES(m) _mm512_maskz_mov_pd(m, _mm512_set1_pd(1.0))
+#define SELECT(m, a, b) _mm512_mask_blend_pd(m, b, a)
+#define ANY(m) ((m) != 0)
+#define ALL(m) ((m) == 0xff)
+#define MIN(a, b) _mm512_min_pd(a, b)
+#define MAX(a, b) _mm512_max_pd(a, b)
+#define HAVE_ROUND
+#define FLOOR(a) _mm512_roundscale_pd(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)
+#define CEIL(a) _mm512_roundscale_pd(a, _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC)
+#define TRUNC(a) _mm512_roundscale_pd(a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC)
+#include "simd_ops.h"
+#undef K
+#undef KERNELS_NAME
+#undef TARGET
+#undef V
+#undef W
+#undef LOAD
+#undef STORE
+#undef SPLAT
+#undef ADD
+#undef SUB
+#undef MUL
+#undef DIV
+#undef NEG
+#undef ABS
+#undef SQRT
+#undef CMPLT
+#undef CMPLE
+#undef CMPEQ
+#undef CMPNE
+#undef MAND
+#undef MOR
+#undef ONES
+#undef SELECT
+#undef ANY
+#undef ALL
+#undef MIN
+#undef MAX
+#undef HAVE_ROUND
+#undef FLOOR
+#undef CEIL
+#undef TRUNC
+
+#endif // HAVE_X86_SIMD
+
+#ifdef HAVE_NEON_SIMD
+
+// NEON (every AArch64 has it): two doubles
+#define K(name) neon_##name
+#define KERNELS_NAME "neon"
+#define TARGET
+#define V float64x2_t
+#define W 2
+#define LOAD(p) vld1q_f64(p)
+#define STORE(p, v) vst1q_f64(p, v)
+#define SPLAT(x) vdupq_n_f64(x)
+#define ADD(a, b) vaddq_f64(a, b)
+#define SUB(a, b) vsubq_f64(a, b)
+#define MUL(a, b) vmulq_f64(a, b)
+#define DIV(a, b) vdivq_f64(a, b)
+#define NEG(a) vnegq_f64(a)
+#define ABS(a) vabsq_f64(a)
+#define SQRT(a) vsqrtq_f64(a)
+#define CMPLT(a, b) vcltq_f64(a, b)
+#define CMPLE(a, b) vcleq_f64(a, b)
+#define CMPEQ(a, b) vceqq_f64(a, b)
+#define CMPNE(a, b) veorq_u64(vceqq_f64(a, b), vdupq_n_u64(~0ULL))
+#define MAND(a, b) vandq_u64(a, b)
+#define MOR(a, b) vorrq_u64(a, b)
+#define ONES(m) vreinterpretq_f64_u64(vandq_u64(m, \
+                    vreinterpretq_u64_f64(vdupq_n_f64(1.0))))
+#define SELECT(m, a, b) vbslq_f64(m, a, b)
+#define ANY(m) ((vgetq_lane_u64(m, 0) | vgetq_lane_u64(m, 1)) != 0)
+#define ALL(m) ((vgetq_lane_u64(m, 0) & vgetq_lane_u64(m, 1)) != 0)
+#define MIN(a, b) vbslq_f64(vcltq_f64(a, b), a, b)  // (vminq gives NaN)
+#define MAX(a, b) vbslq_f64(vcgtq_f64(a, b), a, b)
+#define HAVE_ROUND
+#define FLOOR(a) vrndmq_f64(a)
+#define CEIL(a) vrndpq_f64(a)
+#define TRUNC(a) vrndq_f64(a)
+#include "simd_ops.h"
+
+#endif // HAVE_NEON_SIMD
+
+static int Supported(const BATCH_KERNELS *k)
+{
+#ifdef HAVE_X86_SIMD
+    if (k == &avx512_kernels) return __builtin_cpu_supports("avx512f");
+    if (k == &avx2_kernels) return __builtin_cpu_supports("avx2");
+    if (k == &sse2_kernels) return __builtin_cpu_supports("sse2");
+#endif
+    return 1;
+}
+
+static const BATCH_KERNELS *const all_kernels[] = {  // best first
+#ifdef HAVE_X86_SIMD
+    &avx512_kernels,
+    &avx2_kernels,
+    &sse2_kernels,
+#endif
+#ifdef HAVE_NEON_SIMD
+    &neon_kernels,
+#endif
+    &c_kernels,
+    NULL
+};
+
+const BATCH_KERNELS *BestBatchKernels(void)
+{
+    int i;
+
+    for (i = 0; !Supported(all_kernels[i]); ++i)
+        ;
+    return all_kernels[i];  // (plain C is always supported)
+}
+
+const BATCH_KERNELS *FindBatchKernels(const char *name)
+{
+    int i;
+
+    for (i = 0; all_kernels[i]; ++i) {
+        if (!strcmp(all_kernels[i]->name, name))
+            return Supported(all_kernels[i]) ? all_kernels[i] : NULL;
+    }
+    return NULL;
+}
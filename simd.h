@@ -0,0 +1,86 @@
+// simd.h - vector kernels used by EvaluateBatch()
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <math.h>
+
+// each kernel computes dst[i] = op(a[i], ...) for i = 0 .. n-1, giving
+// exactly the same result as the scalar operator or function
+typedef void (*KERNEL1)(double *dst, const double *a, int n);
+typedef void (*KERNEL2)(double *dst, const double *a, const double *b, int n);
+typedef void (*KERNEL3)(double *dst, const double *a, const double *b,
+                        const double *c, int n);
+// rand() and percent(): row i uses value counter + i * step of the generator
+typedef void (*RAND_KERNEL)(double *dst, const double *a, int n,
+                            unsigned long long seed, unsigned long long counter,
+                            unsigned long long step);
+
+// value n (0 up to 2^64 - 1) of the generator started with seed, from 0 up
+// to, but excluding 1: SplitMix64's output function of seed + n * (2^64 /
+// golden ratio), so each value is made without the ones before it (and the
+// kernels can make a column of them at once)
+static inline double RandomUnit(unsigned long long seed, unsigned long long n)
+{
+    unsigned long long z = seed + (n + 1) * 0x9E3779B97F4A7C15ull;
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    return (double)(long long)(z >> 11) * (1.0 / 9007199254740992.0);  // 2^-53
+}
+
+// rand(x) of unit value u: a whole number from 0 up to, but excluding x
+static inline double RandomBelow(double u, double x)
+{
+    if (!(x >= 1.0))
+        return 0.0;
+    return floor(u * floor(x < 2147483647.0 ? x : 2147483647.0));  // (an int)
+}
+
+// percent(x) of unit value u: 1 x% of the time (x a whole number), else 0
+static inline double RandomPercent(double u, double x)
+{
+    if (x >= 100.0)
+        return 1.0;
+    return u * 100.0 < floor(x) ? 1.0 : 0.0;
+}
+
+typedef struct _batch_kernels {
+    const char *name;       // instruction set, eg. "avx2"
+
+    KERNEL1 neg;            // -a
+    KERNEL1 lnot;           // !a
+    KERNEL1 vsqrt;          // sqrt(a)
+    KERNEL1 vfabs;          // abs(a)
+    KERNEL1 vfloor;         // floor(a)
+    KERNEL1 vceil;          // ceil(a)
+    KERNEL1 vint;           // int(a)
+
+    KERNEL2 add;
+    KERNEL2 sub;
+    KERNEL2 mul;
+    int (*div)(double *dst, const double *a, const double *b, int n);
+                            // returns non-zero if any b[i] is zero
+    KERNEL2 fdiv;           // a / b, with no check (b known not to be zero)
+    KERNEL2 lt;
+    KERNEL2 gt;
+    KERNEL2 le;
+    KERNEL2 ge;
+    KERNEL2 eq;
+    KERNEL2 ne;
+    KERNEL2 land;           // a && b
+    KERNEL2 lor;            // a || b
+    KERNEL2 vmin;           // min(a, b)
+    KERNEL2 vmax;           // max(a, b)
+
+    KERNEL3 vif;            // if(a, b, c)
+
+    RAND_KERNEL vrand;      // rand(a)
+    RAND_KERNEL vpercent;   // percent(a)
+} BATCH_KERNELS;
+
+const BATCH_KERNELS *BestBatchKernels(void); // fastest this CPU supports
+const BATCH_KERNELS *FindBatchKernels(const char *name); // NULL if unusable
+
+#endif // SIMD_H
@@ -0,0 +1,236 @@
+// simd_ops.h - kernel bodies, included by simd.c once per instruction set
+//
+// The includer defines:
+//
+//   K(name)        kernel function name for this instruction set
+//   TARGET         function attribute enabling the instruction set
+//   V, W           vector type, and doubles per vector
+//   M              comparison mask type
+//   LOAD, STORE    unaligned load/store of W doubles
+//   SPLAT(x)       vector of x
+//   ADD...DIV      arithmetic
+//   NEG, ABS, SQRT
+//   CMPLT...CMPNE  ordered comparisons (CMPNE is unordered, like C's !=)
+//   MAND, MOR      combine masks
+//   ONES(m)        1.0 where m is set, else 0.0
+//   SELECT(m,a,b)  a where m is set, else b
+//   ANY(m), ALL(m) test mask
+//   MIN, MAX       same as (a < b ? a : b) and (a > b ? a : b)
+//   FLOOR, CEIL, TRUNC  (only if HAVE_ROUND is defined)
+
+#define LOOP1(expr, scalar) \
+    int i = 0; \
+    for (; i + W <= n; i += W) { V va = LOAD(a + i); STORE(dst + i, expr); } \
+    for (; i < n; ++i) dst[i] = (scalar);
+
+#define LOOP2(expr, scalar) \
+    int i = 0; \
+    for (; i + W <= n; i += W) { \
+        V va = LOAD(a + i), vb = LOAD(b + i); STORE(dst + i, expr); } \
+    for (; i < n; ++i) dst[i] = (scalar);
+
+static TARGET void K(neg)(double *dst, const double *a, int n)
+{
+    LOOP1(NEG(va), -a[i])
+}
+
+static TARGET void K(lnot)(double *dst, const double *a, int n)
+{
+    LOOP1(ONES(CMPEQ(va, SPLAT(0.0))), (a[i] == 0.0) ? 1.0 : 0.0)
+}
+
+static TARGET void K(vsqrt)(double *dst, const double *a, int n)
+{
+    LOOP1(SQRT(va), sqrt(a[i]))
+}
+
+static TARGET void K(vfabs)(double *dst, const double *a, int n)
+{
+    LOOP1(ABS(va), fabs(a[i]))
+}
+
+#ifdef HAVE_ROUND
+static TARGET void K(vfloor)(double *dst, const double *a, int n)
+{
+    LOOP1(FLOOR(va), floor(a[i]))
+}
+
+static TARGET void K(vceil)(double *dst, const double *a, int n)
+{
+    LOOP1(CEIL(va), ceil(a[i]))
+}
+
+static TARGET void K(vint)(double *dst, const double *a, int n)
+{
+    V limit = SPLAT(9223372036854775808.0);  // 2^63
+    int i = 0, j;
+
+    for (; i + W <= n; i += W) {
+        V va = LOAD(a + i);
+        if (ALL(CMPLT(ABS(va), limit)))  // fits in int64_t: truncate
+            STORE(dst + i, ADD(TRUNC(va), SPLAT(0.0)));  // (-0 becomes 0)
+        else  // (NaN, infinity or huge) get C's conversion
+            for (j = i; j < i + W; ++j) dst[j] = (double)((int64_t)a[j]);
+    }
+    for (; i < n; ++i) dst[i] = (double)((int64_t)a[i]);
+}
+#endif
+
+static TARGET void K(add)(double *dst, const double *a, const double *b,
+                          int n)
+{
+    LOOP2(ADD(va, vb), a[i] + b[i])
+}
+
+static TARGET void K(sub)(double *dst, const double *a, const double *b,
+                          int n)
+{
+    LOOP2(SUB(va, vb), a[i] - b[i])
+}
+
+static TARGET void K(mul)(double *dst, const double *a, const double *b,
+                          int n)
+{
+    LOOP2(MUL(va, vb), a[i] * b[i])
+}
+
+static TARGET int K(div)(double *dst, const double *a, const double *b,
+                         int n)
+{
+    V zero = SPLAT(0.0);
+    int i = 0, bad = 0;
+
+    for (; i + W <= n; i += W) {
+        V va = LOAD(a + i), vb = LOAD(b + i);
+        bad |= ANY(CMPEQ(vb, zero)) ? 1 : 0;
+        STORE(dst + i, DIV(va, vb));
+    }
+    for (; i < n; ++i) {
+        bad |= (b[i] == 0.0);
+        dst[i] = a[i] / b[i];
+    }
+    return bad;
+}
+
+static TARGET void K(fdiv)(double *dst, const double *a, const double *b,
+                           int n)
+{
+    LOOP2(DIV(va, vb), a[i] / b[i])
+}
+
+static TARGET void K(lt)(double *dst, const double *a, const double *b,
+                         int n)
+{
+    LOOP2(ONES(CMPLT(va, vb)), a[i] < b[i] ? 1.0 : 0.0)
+}
+
+static TARGET void K(gt)(double *dst, const double *a, const double *b,
+                         int n)
+{
+    LOOP2(ONES(CMPLT(vb, va)), a[i] > b[i] ? 1.0 : 0.0)
+}
+
+static TARGET void K(le)(double *dst, const double *a, const double *b,
+                         int n)
+{
+    LOOP2(ONES(CMPLE(va, vb)), a[i] <= b[i] ? 1.0 : 0.0)
+}
+
+static TARGET void K(ge)(double *dst, const double *a, const double *b,
+                         int n)
+{
+    LOOP2(ONES(CMPLE(vb, va)), a[i] >= b[i] ? 1.0 : 0.0)
+}
+
+static TARGET void K(eq)(double *dst, const double *a, const double *b,
+                         int n)
+{
+    LOOP2(ONES(CMPEQ(va, vb)), a[i] == b[i] ? 1.0 : 0.0)
+}
+
+static TARGET void K(ne)(double *dst, const double *a, const double *b,
+                         int n)
+{
+    LOOP2(ONES(CMPNE(va, vb)), a[i] != b[i] ? 1.0 : 0.0)
+}
+
+static TARGET void K(land)(double *dst, const double *a, const double *b,
+                           int n)
+{
+    V zero = SPLAT(0.0);
+    LOOP2(ONES(MAND(CMPNE(va, zero), CMPNE(vb, zero))),
+          (a[i] != 0.0) && (b[i] != 0.0) ? 1.0 : 0.0)
+}
+
+static TARGET void K(lor)(double *dst, const double *a, const double *b,
+                          int n)
+{
+    V zero = SPLAT(0.0);
+    LOOP2(ONES(MOR(CMPNE(va, zero), CMPNE(vb, zero))),
+          (a[i] != 0.0) || (b[i] != 0.0) ? 1.0 : 0.0)
+}
+
+static TARGET void K(vmin)(double *dst, const double *a, const double *b,
+                           int n)
+{
+    LOOP2(MIN(va, vb), a[i] < b[i] ? a[i] : b[i])
+}
+
+static TARGET void K(vmax)(double *dst, const double *a, const double *b,
+                           int n)
+{
+    LOOP2(MAX(va, vb), a[i] > b[i] ? a[i] : b[i])
+}
+
+static TARGET void K(vif)(double *dst, const double *a, const double *b,
+                          const double *c, int n)
+{
+    V zero = SPLAT(0.0);
+    int i = 0;
+
+    for (; i + W <= n; i += W)
+        STORE(dst + i, SELECT(CMPNE(LOAD(a + i), zero),
+                              LOAD(b + i), LOAD(c + i)));
+    for (; i < n; ++i)
+        dst[i] = a[i] != 0.0 ? b[i] : c[i];
+}
+
+// (plain loops: the compiler vectorizes the integer steps of RandomUnit())
+static TARGET void K(vrand)(double *dst, const double *a, int n,
+                            unsigned long long seed, unsigned long long counter,
+                            unsigned long long step)
+{
+    int i;
+
+    for (i = 0; i < n; ++i)
+        dst[i] = RandomBelow(RandomUnit(seed, counter + i * step), a[i]);
+}
+
+static TARGET void K(vpercent)(double *dst, const double *a, int n,
+                               unsigned long long seed,
+                               unsigned long long counter,
+                               unsigned long long step)
+{
+    int i;
+
+    for (i = 0; i < n; ++i)
+        dst[i] = RandomPercent(RandomUnit(seed, counter + i * step), a[i]);
+}
+
+static const BATCH_KERNELS K(kernels) = {
+    KERNELS_NAME,
+    K(neg), K(lnot), K(vsqrt), K(vfabs),
+#ifdef HAVE_ROUND
+    K(vfloor), K(vceil), K(vint),
+#else
+    c_vfloor, c_vceil, c_vint,
+#endif
+    K(add), K(sub), K(mul), K(div), K(fdiv),
+    K(lt), K(gt), K(le), K(ge), K(eq), K(ne),
+    K(land), K(lor), K(vmin), K(vmax),
+    K(vif),
+    K(vrand), K(vpercent)
+};
+
+#undef LOOP1
+#undef LOOP2
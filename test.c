@@ -1,13 +1,420 @@
+// test.c - expression parser driver
+//
+// With no arguments, reads expressions from stdin, one per line, and prints
+// their values. Given formulas, streams records through them instead:
+//
+//   parser [-b] [-t threads] [-f file] formula ...
+//
+// The input (stdin, or the file, which is memory-mapped where possible)
+// starts with a line naming its columns, comma separated. A symbol a formula
+// reads takes its values from the column of the same name, or from the
+// result of an earlier formula assigning it (eg. "net = price * qty"); any
+// other symbol is NaN until assigned. The records are CSV lines, or with -b,
+// packed doubles (as this machine stores them), one after another. The
+// output has the same format: a line naming the formulas (by the symbol each
+// assigns, or its text), then a record of their results for each input
+// record. Rows in error come out as NaN. -t shares large batches among that
+// many threads.
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "parser.h"
 
-int main(void)
+#define STREAM_ROWS 4096        /* records per EvaluateBatch() call */
+#define IO_BUF_SIZE (1 << 20)   /* bytes read or written at a time */
+#define MAX_FIELD 64            /* longest number in a CSV field */
+
+// buffered input
+// --------------
+
+typedef struct _reader {
+    FILE *fp;           // NULL: all the input is in buf (eg. mapped)
+    char *buf;
+    size_t len;         // bytes in buf
+    size_t pos;         // next to be used
+    size_t size;        // allocated
+} READER;
+
+// make at least need bytes from r->pos available; false at end of input
+static bool Fill(READER *r, size_t need)
+{
+    size_t got;
+
+    while (r->len - r->pos < need) {
+        if (!r->fp)
+            return false;
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+        if (r->size - r->len < IO_BUF_SIZE / 2) {  // grow (for long lines)
+            char *p = realloc(r->buf, r->size * 2);
+
+            if (!p)
+                return false;
+            r->buf = p;
+            r->size *= 2;
+        }
+        if ((got = fread(r->buf + r->len, 1, r->size - r->len, r->fp)) == 0)
+            return false;
+        r->len += got;
+    }
+    return true;
+}
+
+// next line (without its end of line); NULL at end of input
+static char *ReadLine(READER *r, size_t *len)
+{
+    char *line, *nl;
+    size_t scanned = 0;
+
+    while ((nl = memchr(r->buf + r->pos + scanned, '\n',
+                        r->len - r->pos - scanned)) == NULL) {
+        scanned = r->len - r->pos;
+        if (!Fill(r, scanned + 1)) {
+            if (scanned == 0)
+                return NULL;
+            nl = r->buf + r->len;  // last line has no end of line
+            break;
+        }
+    }
+    line = r->buf + r->pos;
+    *len = nl - line;
+    r->pos = nl < r->buf + r->len ? (size_t)(nl + 1 - r->buf) : r->len;
+    if (*len && line[*len - 1] == '\r')
+        --*len;
+    return line;
+}
+
+static bool OpenInput(READER *r, const char *file)
+{
+    memset(r, 0, sizeof(*r));
+#ifndef WIN32
+    if (file) {  // map it, if we can
+        struct stat st;
+        int fd = open(file, O_RDONLY);
+        void *p;
+
+        if (fd < 0)
+            return false;
+        if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+                (p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+                                                            != MAP_FAILED) {
+            close(fd);
+            r->buf = p;
+            r->len = r->size = st.st_size;
+            return true;
+        }
+        close(fd);
+    }
+#endif
+    r->fp = file ? fopen(file, "rb") : stdin;
+    r->size = IO_BUF_SIZE;
+    return r->fp && (r->buf = malloc(r->size)) != NULL;
+}
+
+static void CloseInput(READER *r)
+{
+    if (!r->fp) {
+#ifndef WIN32
+        if (r->buf)
+            munmap(r->buf, r->size);
+#endif
+        return;
+    }
+    if (r->fp != stdin)
+        fclose(r->fp);
+    free(r->buf);
+}
+
+// buffered output
+// ---------------
+
+static char out_buf_[IO_BUF_SIZE];
+static size_t out_len_;
+
+static void Flush(void)
+{
+    fwrite(out_buf_, 1, out_len_, stdout);
+    out_len_ = 0;
+}
+
+static void Put(const void *data, size_t n)
+{
+    if (out_len_ + n > sizeof(out_buf_)) {
+        Flush();
+        if (n > sizeof(out_buf_)) {
+            fwrite(data, 1, n, stdout);
+            return;
+        }
+    }
+    memcpy(out_buf_ + out_len_, data, n);
+    out_len_ += n;
+}
+
+static void PutNumber(double x)  // (enough digits to read back the same)
+{
+    if (out_len_ + 32 > sizeof(out_buf_))
+        Flush();
+    out_len_ += sprintf(out_buf_ + out_len_, "%.17g", x);
+}
+
+static void PutName(const char *name)  // as a CSV field
+{
+    const char *p;
+
+    if (!strpbrk(name, ",\"")) {
+        Put(name, strlen(name));
+        return;
+    }
+    Put("\"", 1);
+    for (p = name; *p; ++p)
+        Put(*p == '"' ? "\"\"" : p, *p == '"' ? 2 : 1);  // (doubled)
+    Put("\"", 1);
+}
+
+// streaming
+// ---------
+
+// names in a header line; returns how many (or -1 if malloc() failed)
+static int SplitNames(const char *line, size_t len, char ***names)
+{
+    const char *end = line + len, *p, *q;
+    int n = 0;
+
+    *names = NULL;
+    for (p = line; p <= end; p = q + 1) {
+        char **more;
+
+        if ((q = memchr(p, ',', end - p)) == NULL)
+            q = end;
+        if ((more = realloc(*names, (n + 1) * sizeof(char *))) == NULL)
+            return -1;
+        *names = more;
+        while (p < q && (isspace((unsigned char)*p) || *p == '"'))
+            ++p;
+        len = q - p;
+        while (len && (isspace((unsigned char)p[len - 1]) || p[len - 1] == '"'))
+            --len;
+        if (((*names)[n] = malloc(len + 1)) == NULL)
+            return -1;
+        memcpy((*names)[n], p, len);
+        (*names)[n++][len] = '\0';
+    }
+    return n;
+}
+
+// the symbol formula assigns, if that's all it does (eg. "net" of "net = a
+// * b"), or its text
+static char *ResultName(const char *formula)
+{
+    const char *start = formula, *end, *p;
+    char *name;
+    int depth = 0;
+
+    for (p = formula; *p; ++p) {  // "a = 1, b" is b (so named by its text)
+        depth += (*p == '(') - (*p == ')');
+        if (*p == ',' && depth == 0)
+            return strdup(formula);
+    }
+
+    while (isspace((unsigned char)*start)) ++start;
+    for (end = start; isalnum((unsigned char)*end) || *end == '_'; ++end)
+        ;
+    for (p = end; isspace((unsigned char)*p); ++p)
+        ;
+    if (end == start || isdigit((unsigned char)*start) || p[0] != '=' ||
+                                                                p[1] == '=')
+        return strdup(formula);
+    if ((name = malloc(end - start + 1)) != NULL) {
+        memcpy(name, start, end - start);
+        name[end - start] = '\0';
+    }
+    return name;
+}
+
+// CSV record into row of the columns; false if the line isn't a record
+static bool ParseRecord(const char *line, size_t len, double **cols, int ncols,
+                        int row)
+{
+    const char *end = line + len, *p = line, *q;
+    char field[MAX_FIELD + 1], *stop;
+    int i;
+
+    if (len == 0)
+        return false;  // (blank line)
+    for (i = 0; i < ncols; ++i) {
+        size_t n;
+
+        if ((q = p <= end ? memchr(p, ',', end - p) : NULL) == NULL)
+            q = end;
+        n = p <= end ? (size_t)(q - p) : 0;
+        if (n > MAX_FIELD) n = MAX_FIELD;
+        memcpy(field, p, n);
+        field[n] = '\0';
+        cols[i][row] = strtod(field, &stop);
+        while (isspace((unsigned char)*stop)) ++stop;
+        if (stop == field || *stop)
+            cols[i][row] = PARSE_ERROR;  // empty or not a number
+        p = q + 1;
+    }
+    return true;
+}
+
+static int NoMemory(void)
+{
+    fprintf(stderr, "parser: out of memory\n");
+    return 1;
+}
+
+static int Stream(int argc, char *argv[])
+{
+    const char *file = NULL;
+    READER in;
+    COMPILED_EXPR **ces;
+    char **in_names, **out_names, *line;
+    double **in_cols, **out_cols;
+    const double ***bind;   // columns each formula's symbols read
+    bool binary = false, more = true;
+    size_t len, rec_size;
+    int nin, nout, rows, row, f, j, k, arg;
+
+    for (arg = 1; arg < argc && argv[arg][0] == '-' && argv[arg][1]; ++arg) {
+        if (!strcmp(argv[arg], "-b"))
+            binary = true;
+        else if (!strcmp(argv[arg], "-f") && arg + 1 < argc)
+            file = argv[++arg];
+        else if (!strcmp(argv[arg], "-t") && arg + 1 < argc) {
+            if (!SetBatchThreads(atoi(argv[++arg])))
+                fprintf(stderr, "parser: no threads, using one\n");
+        } else
+            break;
+    }
+    if (arg == argc) {
+        fprintf(stderr, "usage: parser [-b] [-t threads] [-f file] formula ...\n");
+        return 2;
+    }
+    if (!OpenInput(&in, file) || (line = ReadLine(&in, &len)) == NULL) {
+        fprintf(stderr, "parser: can't read %s\n", file ? file : "input");
+        return 1;
+    }
+    if ((nin = SplitNames(line, len, &in_names)) < 0)
+        return NoMemory();
+
+    nout = argc - arg;
+    ces = calloc(nout, sizeof(COMPILED_EXPR *));
+    out_names = calloc(nout, sizeof(char *));
+    out_cols = calloc(nout, sizeof(double *));
+    bind = calloc(nout, sizeof(const double **));
+    in_cols = calloc(nin, sizeof(double *));
+    if (!ces || !out_names || !out_cols || !bind || !in_cols)
+        return NoMemory();
+    for (j = 0; j < nin; ++j)
+        if ((in_cols[j] = malloc(STREAM_ROWS * sizeof(double))) == NULL)
+            return NoMemory();
+    for (f = 0; f < nout; ++f) {
+        if ((ces[f] = Compile(argv[arg + f])) == NULL) {
+            fprintf(stderr, "parser: %s: %s\n", argv[arg + f], GetParserErr());
+            return 1;
+        }
+        out_names[f] = ResultName(argv[arg + f]);
+        out_cols[f] = malloc(STREAM_ROWS * sizeof(double));
+        bind[f] = calloc(CompiledSymbolCount(ces[f]) + 1, sizeof(const double *));
+        if (!out_names[f] || !out_cols[f] || !bind[f])
+            return NoMemory();
+        for (k = 0; k < CompiledSymbolCount(ces[f]); ++k) {
+            const char *name = CompiledSymbolName(ces[f], k);
+
+            for (j = f - 1; j >= 0 && !bind[f][k]; --j)  // latest result first
+                if (!strcmp(out_names[j], name)) bind[f][k] = out_cols[j];
+            for (j = 0; j < nin && !bind[f][k]; ++j)
+                if (!strcmp(in_names[j], name)) bind[f][k] = in_cols[j];
+        }
+    }
+
+    for (f = 0; f < nout; ++f) {
+        if (f) Put(",", 1);
+        PutName(out_names[f]);
+    }
+    Put("\n", 1);
+
+    rec_size = nin * sizeof(double);
+    while (more) {
+        for (rows = 0; rows < STREAM_ROWS; ) {  // read a batch of records
+            if (binary) {
+                if (!Fill(&in, rec_size)) {
+                    more = false;
+                    break;
+                }
+                for (j = 0; j < nin; ++j)
+                    memcpy(&in_cols[j][rows], in.buf + in.pos + j * sizeof(double),
+                           sizeof(double));
+                in.pos += rec_size;
+                ++rows;
+            } else {
+                if ((line = ReadLine(&in, &len)) == NULL) {
+                    more = false;
+                    break;
+                }
+                if (ParseRecord(line, len, in_cols, nin, rows))
+                    ++rows;
+            }
+        }
+        for (f = 0; f < nout; ++f)
+            EvaluateBatch(ces[f], bind[f], rows, out_cols[f]);
+        for (row = 0; row < rows; ++row) {
+            for (f = 0; f < nout; ++f) {
+                if (binary)
+                    Put(&out_cols[f][row], sizeof(double));
+                else {
+                    if (f) Put(",", 1);
+                    PutNumber(out_cols[f][row]);
+                }
+            }
+            if (!binary)
+                Put("\n", 1);
+        }
+    }
+    Flush();
+
+    for (f = 0; f < nout; ++f) {
+        FreeCompiled(ces[f]);
+        free(out_names[f]);
+        free(out_cols[f]);
+        free(bind[f]);
+    }
+    for (j = 0; j < nin; ++j) {
+        free(in_names[j]);
+        free(in_cols[j]);
+    }
+    free(ces);
+    free(out_names);
+    free(out_cols);
+    free(bind);
+    free(in_names);
+    free(in_cols);
+    CloseInput(&in);
+    return 0;
+}
+
+int main(int argc, char *argv[])
 {
     char *p, expr[1024];
     double result = 0;;
 
+    if (argc > 1)
+        return Stream(argc, argv);  // formulas given: stream records
     while (1) {
         printf("? "); fflush(stdout);  // prompt user for expression string
         fgets(expr, sizeof(expr), stdin);  // read text line